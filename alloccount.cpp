@@ -0,0 +1,47 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "alloccount.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<bool> s_counting(false);
+static std::atomic<unsigned long long> s_allocs(0);
+
+void BeginCountingAllocs()
+{
+    s_allocs.store(0, std::memory_order_relaxed);
+    s_counting.store(true, std::memory_order_relaxed);
+}
+
+unsigned long long EndCountingAllocs()
+{
+    s_counting.store(false, std::memory_order_relaxed);
+    return s_allocs.load(std::memory_order_relaxed);
+}
+
+static void* Allocate(size_t size)
+{
+    if (s_counting.load(std::memory_order_relaxed))
+        s_allocs.fetch_add(1, std::memory_order_relaxed);
+
+    // Exceptions are off, so running out of memory ends the process, the
+    // same as the default operator new.
+    while (true)
+    {
+        if (void* p = malloc(size ? size : 1))
+            return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            abort();
+        handler();
+    }
+}
+
+void* operator new(size_t size) { return Allocate(size); }
+void* operator new[](size_t size) { return Allocate(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
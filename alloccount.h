@@ -0,0 +1,15 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+//----------------------------------------------------------------------------
+// Heap allocation counting, for benchmarks and tests.
+//
+// alloccount.cpp replaces the global operator new, so linking it into a
+// program counts every allocation made through new (including by the
+// standard containers), in every build configuration.  Counting costs one
+// relaxed atomic load per allocation while it's off.
+
+void BeginCountingAllocs();
+unsigned long long EndCountingAllocs();     // Allocations since BeginCountingAllocs().
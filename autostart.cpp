@@ -0,0 +1,450 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "autostart.h"
+#include <cwchar>
+#include <cwctype>
+
+// A group that hasn't become startable yet.
+constexpr unsigned long long c_notYet = ~0ull;
+
+static bool EqualsNoCase(const std::wstring& a, const std::wstring& b)
+{
+    if (a.length() != b.length())
+        return false;
+    for (size_t i = 0; i < a.length(); ++i)
+    {
+        if (towlower(a[i]) != towlower(b[i]))
+            return false;
+    }
+    return true;
+}
+
+static std::wstring Trim(const std::wstring& s, size_t begin, size_t end)
+{
+    while (begin < end && iswspace(s[begin]))
+        ++begin;
+    while (end > begin && iswspace(s[end - 1]))
+        --end;
+    return s.substr(begin, end - begin);
+}
+
+static size_t FindGroup(const AutostartProfile& profile, const std::wstring& name)
+{
+    for (size_t i = 0; i < profile.size(); ++i)
+    {
+        if (EqualsNoCase(profile[i].name, name))
+            return i;
+    }
+    return profile.size();
+}
+
+static void SetError(std::wstring& error, size_t line, const std::wstring& message)
+{
+    error = L"Line ";
+    error.append(std::to_wstring(line));
+    error.append(L": ");
+    error.append(message);
+}
+
+bool ParseAutostartProfile(const std::wstring& text, AutostartProfile& out, std::wstring& error)
+{
+    AutostartProfile groups;
+    std::vector<std::vector<size_t>> afterLines;    // Where each dependency was named.
+    std::vector<std::wstring> allVms;
+
+    error.clear();
+    out.clear();
+
+    size_t line = 0;
+    for (size_t begin = 0; begin < text.length();)
+    {
+        size_t end = text.find(L'\n', begin);
+        if (end == std::wstring::npos)
+            end = text.length();
+
+        ++line;
+        const std::wstring s = Trim(text, begin, end);
+        begin = end + 1;
+
+        if (s.empty() || s[0] == ';' || s[0] == '#')
+            continue;
+
+        if (s[0] == '[')
+        {
+            if (s.back() != ']')
+            {
+                SetError(error, line, L"Expected ']' at the end of the group name.");
+                return false;
+            }
+
+            AutostartGroup group;
+            group.name = Trim(s, 1, s.length() - 1);
+            if (group.name.empty())
+            {
+                SetError(error, line, L"The group name is empty.");
+                return false;
+            }
+            if (FindGroup(groups, group.name) < groups.size())
+            {
+                SetError(error, line, L"Group [" + group.name + L"] is listed more than once.");
+                return false;
+            }
+
+            groups.emplace_back(std::move(group));
+            afterLines.emplace_back();
+            continue;
+        }
+
+        const size_t equals = s.find(L'=');
+        if (equals == std::wstring::npos)
+        {
+            SetError(error, line, L"Expected 'key = value' or '[group]'.");
+            return false;
+        }
+        if (groups.empty())
+        {
+            SetError(error, line, L"Expected '[group]' before the first key.");
+            return false;
+        }
+
+        AutostartGroup& group = groups.back();
+        const std::wstring key = Trim(s, 0, equals);
+        const std::wstring value = Trim(s, equals + 1, s.length());
+
+        if (EqualsNoCase(key, L"vm"))
+        {
+            if (value.empty())
+            {
+                SetError(error, line, L"The VM name is empty.");
+                return false;
+            }
+            for (const auto& vm : allVms)
+            {
+                if (EqualsNoCase(vm, value))
+                {
+                    SetError(error, line, L"VM '" + value + L"' is listed more than once.");
+                    return false;
+                }
+            }
+            allVms.emplace_back(value);
+            group.vms.emplace_back(value);
+        }
+        else if (EqualsNoCase(key, L"after"))
+        {
+            for (size_t from = 0; from <= value.length();)
+            {
+                size_t comma = value.find(L',', from);
+                if (comma == std::wstring::npos)
+                    comma = value.length();
+
+                const std::wstring name = Trim(value, from, comma);
+                from = comma + 1;
+
+                if (name.empty())
+                    continue;
+                group.after.emplace_back(name);
+                afterLines.back().emplace_back(line);
+            }
+        }
+        else if (EqualsNoCase(key, L"wait"))
+        {
+            if (EqualsNoCase(value, L"heartbeat"))
+                group.wait = AutostartWait::Heartbeat;
+            else if (EqualsNoCase(value, L"running"))
+                group.wait = AutostartWait::Running;
+            else
+            {
+                SetError(error, line, L"Expected 'heartbeat' or 'running'.");
+                return false;
+            }
+        }
+        else if (EqualsNoCase(key, L"timeout"))
+        {
+            wchar_t* stop = nullptr;
+            const unsigned long long seconds = wcstoull(value.c_str(), &stop, 10);
+            if (value.empty() || *stop || !seconds || seconds > 24 * 60 * 60)
+            {
+                SetError(error, line, L"Expected a timeout from 1 to 86400 seconds.");
+                return false;
+            }
+            group.timeout = seconds * 1000;
+        }
+        else
+        {
+            SetError(error, line, L"Unknown key '" + key + L"'.");
+            return false;
+        }
+    }
+
+    // Resolve dependencies.
+    std::vector<std::vector<size_t>> after(groups.size());
+    for (size_t i = 0; i < groups.size(); ++i)
+    {
+        for (size_t j = 0; j < groups[i].after.size(); ++j)
+        {
+            const size_t dep = FindGroup(groups, groups[i].after[j]);
+            if (dep >= groups.size())
+            {
+                SetError(error, afterLines[i][j], L"Unknown group [" + groups[i].after[j] + L"].");
+                return false;
+            }
+            if (dep == i)
+            {
+                SetError(error, afterLines[i][j], L"Group [" + groups[i].name + L"] can't come after itself.");
+                return false;
+            }
+            after[i].emplace_back(dep);
+        }
+    }
+
+    // Order the groups so each comes after its dependencies, otherwise
+    // keeping the order of the file.
+    std::vector<bool> placed(groups.size());
+    while (out.size() < groups.size())
+    {
+        size_t next = groups.size();
+        for (size_t i = 0; i < groups.size() && next == groups.size(); ++i)
+        {
+            if (placed[i])
+                continue;
+            bool ready = true;
+            for (size_t dep : after[i])
+                ready = ready && placed[dep];
+            if (ready)
+                next = i;
+        }
+
+        if (next == groups.size())
+        {
+            for (size_t i = 0; i < groups.size(); ++i)
+            {
+                if (!placed[i])
+                {
+                    error = L"The dependencies of group [" + groups[i].name + L"] form a cycle.";
+                    break;
+                }
+            }
+            out.clear();
+            return false;
+        }
+
+        placed[next] = true;
+        out.emplace_back(groups[next]);
+    }
+
+    return true;
+}
+
+AutostartPlan::AutostartPlan(const AutostartProfile& profile)
+: m_profile(profile)
+, m_after(profile.size())
+, m_startable(profile.size(), c_notYet)
+{
+    for (size_t i = 0; i < m_profile.size(); ++i)
+    {
+        for (const auto& name : m_profile[i].after)
+            m_after[i].emplace_back(FindGroup(m_profile, name));
+
+        for (const auto& name : m_profile[i].vms)
+        {
+            AutostartVm vm;
+            vm.name = name;
+            vm.group = i;
+            m_vms.emplace_back(std::move(vm));
+        }
+    }
+}
+
+AutostartVm* AutostartPlan::Find(const std::wstring& name)
+{
+    for (auto& vm : m_vms)
+    {
+        if (EqualsNoCase(vm.name, name))
+            return &vm;
+    }
+    return nullptr;
+}
+
+bool AutostartPlan::IsGroupReady(size_t group) const
+{
+    for (const auto& vm : m_vms)
+    {
+        if (vm.group == group && vm.step != AutostartStep::Ready)
+            return false;
+    }
+    return true;
+}
+
+bool AutostartPlan::IsGroupFailed(size_t group) const
+{
+    for (const auto& vm : m_vms)
+    {
+        if (vm.group == group && (vm.step == AutostartStep::Failed || vm.step == AutostartStep::Skipped))
+            return true;
+    }
+    return false;
+}
+
+bool AutostartPlan::IsGroupStartable(size_t group) const
+{
+    for (size_t dep : m_after[group])
+    {
+        if (dep >= m_profile.size() || !IsGroupReady(dep))
+            return false;
+    }
+    return true;
+}
+
+void AutostartPlan::GetStartable(unsigned long long now, std::vector<std::wstring>& out)
+{
+    for (size_t i = 0; i < m_profile.size(); ++i)
+    {
+        if (m_startable[i] == c_notYet)
+        {
+            if (!IsGroupStartable(i))
+                continue;
+            m_startable[i] = now;
+        }
+
+        for (const auto& vm : m_vms)
+        {
+            if (vm.group == i && vm.step == AutostartStep::Waiting)
+                out.emplace_back(vm.name);
+        }
+    }
+}
+
+void AutostartPlan::Start(const std::wstring& name, unsigned long long now)
+{
+    AutostartVm* vm = Find(name);
+    if (!vm || vm->step != AutostartStep::Waiting)
+        return;
+
+    vm->step = AutostartStep::Starting;
+    vm->since = now;
+    vm->started = now;
+}
+
+void AutostartPlan::Observe(const std::wstring& name, bool running, bool heartbeatOk, unsigned long long now)
+{
+    AutostartVm* vm = Find(name);
+    if (!vm || (vm->step != AutostartStep::Starting && vm->step != AutostartStep::Booting))
+        return;
+
+    if (!running)
+    {
+        // Before it's seen running, the start may simply not have begun yet.
+        if (vm->step == AutostartStep::Booting)
+            Fail(name, L"Stopped before it was ready.", now);
+        return;
+    }
+
+    if (vm->step == AutostartStep::Starting)
+    {
+        vm->step = AutostartStep::Booting;
+        vm->since = now;
+    }
+
+    if (heartbeatOk || m_profile[vm->group].wait == AutostartWait::Running)
+    {
+        vm->step = AutostartStep::Ready;
+        vm->since = now;
+    }
+}
+
+void AutostartPlan::Fail(const std::wstring& name, const std::wstring& reason, unsigned long long now)
+{
+    AutostartVm* vm = Find(name);
+    if (!vm || vm->step == AutostartStep::Ready || vm->step == AutostartStep::Failed || vm->step == AutostartStep::Skipped)
+        return;
+
+    vm->step = AutostartStep::Failed;
+    vm->since = now;
+    vm->reason = reason;
+}
+
+void AutostartPlan::Tick(unsigned long long now)
+{
+    for (auto& vm : m_vms)
+    {
+        const unsigned long long timeout = m_profile[vm.group].timeout;
+        switch (vm.step)
+        {
+        case AutostartStep::Waiting:
+            if (m_startable[vm.group] != c_notYet && now - m_startable[vm.group] > timeout)
+                Fail(vm.name, L"Couldn't be started.", now);
+            break;
+        case AutostartStep::Starting:
+            if (now - vm.started > timeout)
+                Fail(vm.name, L"Didn't start in time.", now);
+            break;
+        case AutostartStep::Booting:
+            if (now - vm.started > timeout)
+                Fail(vm.name, L"The heartbeat wasn't OK in time.", now);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // The groups are in dependency order, so one pass carries a failure
+    // through to everything that (indirectly) comes after it.
+    for (size_t i = 0; i < m_profile.size(); ++i)
+    {
+        if (m_startable[i] != c_notYet)
+            continue;
+
+        for (size_t dep : m_after[i])
+        {
+            if (dep < m_profile.size() && !IsGroupFailed(dep))
+                continue;
+
+            for (auto& vm : m_vms)
+            {
+                if (vm.group == i && vm.step == AutostartStep::Waiting)
+                {
+                    vm.step = AutostartStep::Skipped;
+                    vm.since = now;
+                    vm.reason = L"[" + m_profile[dep < m_profile.size() ? dep : i].name + L"] failed.";
+                }
+            }
+        }
+    }
+}
+
+bool AutostartPlan::Done() const
+{
+    for (const auto& vm : m_vms)
+    {
+        if (vm.step == AutostartStep::Waiting || vm.step == AutostartStep::Starting || vm.step == AutostartStep::Booting)
+            return false;
+    }
+    return true;
+}
+
+AutostartProgress AutostartPlan::GetProgress() const
+{
+    AutostartProgress progress;
+    progress.total = m_vms.size();
+    for (const auto& vm : m_vms)
+    {
+        switch (vm.step)
+        {
+        case AutostartStep::Ready:
+            ++progress.ready;
+            break;
+        case AutostartStep::Failed:
+        case AutostartStep::Skipped:
+            ++progress.failed;
+            break;
+        case AutostartStep::Starting:
+        case AutostartStep::Booting:
+            ++progress.active;
+            break;
+        default:
+            break;
+        }
+    }
+    return progress;
+}
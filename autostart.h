@@ -0,0 +1,115 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Dependency-ordered autostart.
+//
+// A profile lists groups of VMs.  A group starts only once every group it
+// comes after is ready, and the VMs within a group start in parallel.  A VM
+// is ready once it's running and its heartbeat integration service reports
+// OK (or, with "wait = running", as soon as it's running).  The profile is
+// INI-like text:
+//
+//      ; Comments start with ; or #.
+//      [dc]
+//      vm = DC01
+//
+//      [app]
+//      after = dc
+//      vm = APP01
+//      vm = APP02
+//      timeout = 600
+//
+// Keys are vm (a VM name or Name GUID; repeatable), after (comma separated
+// group names; repeatable), wait (heartbeat or running; default heartbeat),
+// and timeout (seconds each VM may take to become ready; default 300).
+//
+// AutostartPlan is the scheduler.  It doesn't talk to Hyper-V or read a
+// clock:  the caller asks it which VMs to start, starts them, and reports
+// what it observes, with caller-supplied millisecond times.
+
+enum class AutostartWait { Heartbeat, Running };
+
+struct AutostartGroup
+{
+    std::wstring name;
+    std::vector<std::wstring> after;
+    std::vector<std::wstring> vms;
+    AutostartWait wait = AutostartWait::Heartbeat;
+    unsigned long long timeout = 300000;
+};
+typedef std::vector<AutostartGroup> AutostartProfile;
+
+// Groups come back in dependency order.  On failure, error says what's wrong
+// and on which line.
+bool ParseAutostartProfile(const std::wstring& text, AutostartProfile& out, std::wstring& error);
+
+enum class AutostartStep
+{
+    Waiting,        // For the groups it comes after.
+    Starting,       // Start requested; not running yet.
+    Booting,        // Running; waiting for the heartbeat.
+    Ready,
+    Failed,
+    Skipped,        // A group it comes after failed.
+};
+
+struct AutostartVm
+{
+    std::wstring name;              // As written in the profile.
+    size_t group = 0;
+    AutostartStep step = AutostartStep::Waiting;
+    unsigned long long since = 0;   // When the current step began.
+    unsigned long long started = 0; // When Start() was called.
+    std::wstring reason;            // Why it failed or was skipped.
+};
+
+struct AutostartProgress
+{
+    size_t total = 0;
+    size_t ready = 0;
+    size_t failed = 0;              // Includes skipped.
+    size_t active = 0;              // Starting or booting.
+};
+
+class AutostartPlan
+{
+public:
+                    AutostartPlan(const AutostartProfile& profile);
+
+    // Appends the VMs that may be started now (their groups' dependencies
+    // are ready) and haven't been yet.  Call Start() for each one that's
+    // actually started; the rest are offered again next time, until their
+    // group has been startable for longer than its timeout.
+    void            GetStartable(unsigned long long now, std::vector<std::wstring>& out);
+    void            Start(const std::wstring& name, unsigned long long now);
+
+    // Reports what the caller sees for a VM that's been started.
+    void            Observe(const std::wstring& name, bool running, bool heartbeatOk, unsigned long long now);
+    void            Fail(const std::wstring& name, const std::wstring& reason, unsigned long long now);
+
+    // Fails VMs that have taken longer than their group's timeout, and skips
+    // the VMs of groups that can never start.
+    void            Tick(unsigned long long now);
+
+    bool            Done() const;
+    AutostartProgress GetProgress() const;
+    const std::vector<AutostartVm>& GetVms() const { return m_vms; }
+    const AutostartProfile& GetProfile() const { return m_profile; }
+
+private:
+    AutostartVm*    Find(const std::wstring& name);
+    bool            IsGroupReady(size_t group) const;
+    bool            IsGroupFailed(size_t group) const;
+    bool            IsGroupStartable(size_t group) const;
+
+    const AutostartProfile m_profile;
+    std::vector<std::vector<size_t>> m_after;       // Indices of each group's dependencies.
+    std::vector<unsigned long long> m_startable;    // When each group became startable, or ~0.
+    std::vector<AutostartVm> m_vms;
+};
@@ -0,0 +1,152 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "main.h"
+#include "badge.h"
+#include "trace.h"
+#include <algorithm>
+
+// Counts above this show as "+".
+constexpr UINT c_maxCount = 9;
+
+static UINT MakeKey(UINT dpi, UINT running, UINT transitioning)
+{
+    // Zero is never a valid key, since dpi is never zero.
+    return (dpi << 16) | (std::min<UINT>(running, c_maxCount + 1) << 8) | std::min<UINT>(transitioning, c_maxCount + 1);
+}
+
+UINT BadgeIconCache::GetSystemDpi()
+{
+    const HDC hdc = GetDC(0);
+    const UINT dpi = hdc ? GetDeviceCaps(hdc, LOGPIXELSY) : 96;
+    if (hdc)
+        ReleaseDC(0, hdc);
+    return dpi ? dpi : 96;
+}
+
+HICON BadgeIconCache::Get(UINT dpi, UINT running, UINT transitioning)
+{
+    const UINT key = MakeKey(dpi, running, transitioning);
+
+    Entry* victim = &m_entries[0];
+    for (auto& entry : m_entries)
+    {
+        if (entry.key == key)
+        {
+            entry.used = ++m_clock;
+            return entry.hicon;
+        }
+        if (entry.used < victim->used)
+            victim = &entry;
+    }
+
+    const HICON hicon = Render(dpi, running, transitioning);
+    if (!hicon)
+        return 0;
+
+    victim->hicon.Set(hicon);
+    victim->key = key;
+    victim->used = ++m_clock;
+    return hicon;
+}
+
+// Renders the icons that are most likely to be needed, so that normal
+// updates find them already in the cache.
+void BadgeIconCache::Prerender(UINT dpi, UINT maxRunning)
+{
+    for (UINT running = 0; running <= maxRunning; ++running)
+        Get(dpi, running, 0);
+}
+
+void BadgeIconCache::Clear()
+{
+    for (auto& entry : m_entries)
+    {
+        entry.hicon.Free();
+        entry.key = 0;
+        entry.used = 0;
+    }
+}
+
+static void DrawBadge(HDC hdc, DWORD* bits, int stride, int x, int y, int size, COLORREF color, UINT count)
+{
+    SHBRUSH hbr = CreateSolidBrush(color);
+    const HGDIOBJ hbrOld = SelectObject(hdc, hbr);
+    const HGDIOBJ hpenOld = SelectObject(hdc, GetStockObject(NULL_PEN));
+    Ellipse(hdc, x, y, x + size + 1, y + size + 1);
+    SelectObject(hdc, hpenOld);
+    SelectObject(hdc, hbrOld);
+
+    const WCHAR text[] = { WCHAR(count > c_maxCount ? '+' : '0' + count), '\0' };
+    RECT rc = { x, y, x + size, y + size };
+    SetBkMode(hdc, TRANSPARENT);
+    SetTextColor(hdc, RGB(0xff, 0xff, 0xff));
+    DrawTextW(hdc, text, -1, &rc, DT_CENTER|DT_VCENTER|DT_SINGLELINE|DT_NOPREFIX);
+
+    // GDI leaves the alpha channel zero wherever it draws, so make the badge
+    // opaque.
+    GdiFlush();
+    const double radius = size / 2.0;
+    for (int row = 0; row < size; ++row)
+    {
+        for (int col = 0; col < size; ++col)
+        {
+            const double dx = col + 0.5 - radius;
+            const double dy = row + 0.5 - radius;
+            if (dx * dx + dy * dy <= radius * radius)
+                bits[(y + row) * stride + (x + col)] |= 0xff000000;
+        }
+    }
+}
+
+HICON BadgeIconCache::Render(UINT dpi, UINT running, UINT transitioning) const
+{
+    TraceSpan span("RenderBadgeIcon");
+
+    const int cx = MulDiv(GetSystemMetrics(SM_CXSMICON), dpi, GetSystemDpi());
+    const int cy = MulDiv(GetSystemMetrics(SM_CYSMICON), dpi, GetSystemDpi());
+
+    SHICON hiconBase = HICON(LoadImageW(GetModuleHandleW(nullptr), MAKEINTRESOURCEW(m_idIcon), IMAGE_ICON, cx, cy, LR_DEFAULTCOLOR));
+    if (!hiconBase)
+        return 0;
+    if (!running && !transitioning)
+        return hiconBase.Transfer();
+
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+    bmi.bmiHeader.biWidth = cx;
+    bmi.bmiHeader.biHeight = -cy;       // Top down.
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    DWORD* bits = nullptr;
+    SHBITMAP hbmColor = CreateDIBSection(0, &bmi, DIB_RGB_COLORS, reinterpret_cast<void**>(&bits), 0, 0);
+    SHBITMAP hbmMask = CreateBitmap(cx, cy, 1, 1, nullptr);
+    SHDC hdc = CreateCompatibleDC(0);
+    if (!hbmColor || !hbmMask || !hdc || !bits)
+        return 0;
+
+    const int size = std::max<int>(cx * 9 / 16, 7);
+    SHFONT hfont = CreateFontW(-(size * 7 / 8), 0, 0, 0, FW_BOLD, false, false, false, DEFAULT_CHARSET,
+                               OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS, ANTIALIASED_QUALITY, DEFAULT_PITCH, L"Segoe UI");
+
+    const HGDIOBJ hbmOld = SelectObject(hdc, hbmColor);
+    const HGDIOBJ hfontOld = SelectObject(hdc, hfont);
+
+    DrawIconEx(hdc, 0, 0, hiconBase, cx, cy, 0, 0, DI_NORMAL);
+    if (running)
+        DrawBadge(hdc, bits, cx, cx - size, cy - size, size, RGB(0x10, 0x7c, 0x10), running);
+    if (transitioning)
+        DrawBadge(hdc, bits, cx, cx - size, 0, size, RGB(0xca, 0x50, 0x10), transitioning);
+
+    SelectObject(hdc, hfontOld);
+    SelectObject(hdc, hbmOld);
+
+    // CreateIconIndirect copies the bitmaps, so they're freed on return.
+    ICONINFO ii = {};
+    ii.fIcon = true;
+    ii.hbmMask = hbmMask;
+    ii.hbmColor = hbmColor;
+    return CreateIconIndirect(&ii);
+}
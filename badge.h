@@ -0,0 +1,43 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "main.h"
+
+//----------------------------------------------------------------------------
+// Tray icons badged with the number of running VMs (bottom right) and the
+// number of VMs changing state (top right).
+//
+// Each distinct icon is rendered once per DPI and kept in a small cache, so
+// updating the tray icon only swaps handles.  The cache owns the icons;
+// callers must not destroy them.  The icon resource is loaded from the exe.
+
+class BadgeIconCache
+{
+public:
+                    BadgeIconCache(UINT idIcon) : m_idIcon(idIcon) {}
+
+    HICON           Get(UINT dpi, UINT running, UINT transitioning);
+    void            Prerender(UINT dpi, UINT maxRunning);
+    void            Clear();
+
+    static UINT     GetSystemDpi();
+
+private:
+    struct Entry
+    {
+        UINT        key = 0;
+        ULONGLONG   used = 0;
+        SHICON      hicon;
+    };
+
+    HICON           Render(UINT dpi, UINT running, UINT transitioning) const;
+
+    const UINT      m_idIcon;
+    Entry           m_entries[16];
+    ULONGLONG       m_clock = 0;
+
+    BadgeIconCache(const BadgeIconCache&) = delete;
+    BadgeIconCache& operator=(const BadgeIconCache&) = delete;
+};
@@ -0,0 +1,231 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+//----------------------------------------------------------------------------
+// Benchmarks for the Win32-free modules, against synthetic VM lists of 10 to
+// 5000 VMs.  Each benchmark runs on its own local data; fixtures are built
+// before the timing starts.  Reports p50/p99 latency and heap allocations
+// per operation.
+//
+// The Win32 side (HMENU construction, USER object counts) is measured by
+// HyperVTray --benchmark.
+
+#include "../menumodel.h"
+#include "../pollsched.h"
+#include "../vmcache.h"
+#include "../autostart.h"
+#include "../alloccount.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cwchar>
+
+constexpr unsigned c_iterations = 50;
+
+struct BenchStats
+{
+    double p50;
+    double p99;
+    unsigned long long allocs;
+};
+
+template<class F>
+static BenchStats RunBench(unsigned iterations, F&& func)
+{
+    std::vector<double> samples;
+    samples.reserve(iterations);
+
+    unsigned long long allocs = 0;
+    for (unsigned i = 0; i < iterations; ++i)
+    {
+        BeginCountingAllocs();
+        const auto begin = std::chrono::steady_clock::now();
+        func(i);
+        const auto end = std::chrono::steady_clock::now();
+        allocs += EndCountingAllocs();
+
+        samples.push_back(std::chrono::duration<double, std::milli>(end - begin).count());
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    BenchStats stats;
+    stats.p50 = samples[samples.size() / 2];
+    stats.p99 = samples[std::min<size_t>(samples.size() - 1, samples.size() * 99 / 100)];
+    stats.allocs = iterations ? allocs / iterations : 0;
+    return stats;
+}
+
+static void PrintBenchLine(const char* name, unsigned count, const BenchStats& stats)
+{
+    printf("%-16s %5u VMs   p50 %9.3f ms   p99 %9.3f ms   %6llu allocs/op\n", name, count, stats.p50, stats.p99, stats.allocs);
+}
+
+static const VmState c_states[] =
+{
+    VmState::Running, VmState::Stopped, VmState::Saved, VmState::Paused,
+    VmState::Starting, VmState::Saving, VmState::Stopping,
+};
+
+static std::wstring MakeId(unsigned i)
+{
+    wchar_t tmp[64];
+    swprintf(tmp, 64, L"%08X-0000-0000-0000-%012u", i * 2654435761u, i);
+    return tmp;
+}
+
+static std::wstring MakeName(unsigned i, unsigned count)
+{
+    wchar_t tmp[64];
+    swprintf(tmp, 64, L"Synthetic VM %05u", (i * 7919) % count);
+    return tmp;
+}
+
+static MenuModel MakeSyntheticModel(unsigned count, unsigned seed)
+{
+    MenuModel model;
+    model.reserve(count);
+    for (unsigned i = 0; i < count; ++i)
+    {
+        VmMenuEntry entry;
+        entry.id = MakeId(i);
+        entry.name = MakeName(i, count);
+        entry.state = c_states[(i + seed) % (sizeof(c_states) / sizeof(c_states[0]))];
+        entry.enabled = GetEnabledOps(entry.state);
+        entry.slot = i;
+        AppendStateString(entry.group, entry.state, false/*brackets*/);
+        model.emplace_back(std::move(entry));
+    }
+    return model;
+}
+
+static std::vector<CachedVm> MakeSyntheticCache(unsigned count)
+{
+    std::vector<CachedVm> vms;
+    vms.reserve(count);
+    for (unsigned i = 0; i < count; ++i)
+    {
+        CachedVm vm;
+        vm.id = MakeId(i);
+        vm.name = MakeName(i, count);
+        vm.state = c_states[i % (sizeof(c_states) / sizeof(c_states[0]))];
+        vms.emplace_back(std::move(vm));
+    }
+    return vms;
+}
+
+// Five tiers, each after the one before.
+static AutostartProfile MakeSyntheticProfile(unsigned count)
+{
+    AutostartProfile profile(5);
+    for (unsigned i = 0; i < profile.size(); ++i)
+    {
+        profile[i].name = L"tier" + std::to_wstring(i);
+        if (i)
+            profile[i].after.push_back(profile[i - 1].name);
+    }
+    for (unsigned i = 0; i < count; ++i)
+        profile[i * profile.size() / count].vms.push_back(MakeId(i));
+    return profile;
+}
+
+int main()
+{
+    static const unsigned c_counts[] = { 10, 100, 1000, 5000 };
+
+    for (const unsigned count : c_counts)
+    {
+        const MenuModel before = MakeSyntheticModel(count, 0);
+        MenuModel after = MakeSyntheticModel(count, 0);
+        for (unsigned i = 0; i < count; i += 10)
+        {
+            after[i].state = VmState::Saving;
+            after[i].enabled = GetEnabledOps(VmState::Saving);
+        }
+
+        // Grouping and paging the model for the menu.
+        {
+            MenuModel model = before;
+            PrintBenchLine("group menu", count, RunBench(c_iterations, [&](unsigned) {
+                GroupMenuModel(model, true/*grouped*/);
+            }));
+        }
+
+        // Command slots for a menu of VMs that are already known.
+        {
+            CommandSlots slots(count);
+            for (const auto& entry : before)
+                slots.Get(entry.id);
+            PrintBenchLine("command slots", count, RunBench(c_iterations, [&](unsigned) {
+                for (const auto& entry : before)
+                    slots.Get(entry.id);
+                slots.Retain(before);
+            }));
+        }
+
+        // Item text for every VM, reusing one buffer.
+        {
+            std::wstring text;
+            PrintBenchLine("state strings", count, RunBench(c_iterations, [&](unsigned) {
+                for (const auto& entry : before)
+                {
+                    text = entry.name;
+                    AppendStateString(text, entry.state, true/*brackets*/);
+                }
+            }));
+        }
+
+        // Which menu items a refreshed list changes.
+        {
+            std::vector<MenuChange> changes;
+            PrintBenchLine("menu diff", count, RunBench(c_iterations, [&](unsigned) {
+                DiffMenuModel(before, after, changes);
+            }));
+        }
+
+        // A poll tick with every VM watched.
+        {
+            PollScheduler polls;
+            for (unsigned i = 0; i < count; ++i)
+                polls.Watch(before[i].id, VmState::Stopped, VmState::Running, 0);
+            std::vector<std::wstring> due;
+            due.reserve(count);
+            PrintBenchLine("poll tick", count, RunBench(c_iterations, [&](unsigned i) {
+                due.clear();
+                polls.TakeDue((i + 1) * PollScheduler::c_maxInterval, due);
+            }));
+        }
+
+        // Writing and reading the last-known list.
+        {
+            const std::vector<CachedVm> cached = MakeSyntheticCache(count);
+            std::vector<unsigned char> file;
+            PrintBenchLine("cache write", count, RunBench(c_iterations, [&](unsigned) {
+                WriteVmCache(cached, 0, file);
+            }));
+
+            std::vector<CachedVm> read;
+            PrintBenchLine("cache read", count, RunBench(c_iterations, [&](unsigned) {
+                ReadVmCache(file.data(), file.size(), read);
+            }));
+        }
+
+        // One round of autostart scheduling, with a tier booting.
+        {
+            AutostartPlan plan(MakeSyntheticProfile(count));
+            std::vector<std::wstring> startable;
+            plan.GetStartable(0, startable);
+            for (const auto& name : startable)
+                plan.Start(name, 0);
+            PrintBenchLine("autostart tick", count, RunBench(c_iterations, [&](unsigned i) {
+                startable.clear();
+                plan.GetStartable(i, startable);
+                plan.Tick(i);
+            }));
+        }
+
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "breaker.h"
+
+bool CircuitBreaker::Allow(unsigned long long now)
+{
+    switch (m_state)
+    {
+    case State::Closed:
+        return true;
+    case State::Open:
+        if (now < m_retry)
+            return false;
+        m_state = State::HalfOpen;
+        return true;
+    default:
+        return false;
+    }
+}
+
+void CircuitBreaker::Succeeded()
+{
+    m_state = State::Closed;
+    m_failures = 0;
+    m_backoff = 0;
+}
+
+void CircuitBreaker::Failed(unsigned long long now)
+{
+    if (m_state == State::Closed && ++m_failures < c_threshold)
+        return;
+
+    // Calls that were already in flight when the breaker opened may still
+    // fail afterwards; they don't extend the backoff.
+    if (m_state == State::Open)
+        return;
+
+    if (m_state == State::HalfOpen)
+        m_backoff = (m_backoff * 2 < c_maxBackoff) ? m_backoff * 2 : c_maxBackoff;
+    else
+        m_backoff = c_minBackoff;
+
+    m_state = State::Open;
+    m_retry = now + m_backoff;
+}
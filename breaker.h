@@ -0,0 +1,40 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+//----------------------------------------------------------------------------
+// Circuit breaker for calls to a service that can hang or go away.
+//
+// After c_threshold consecutive failures the breaker opens, and calls are
+// refused without being tried until a backoff period has passed.  Then one
+// trial call is let through (half open).  If it succeeds the breaker closes;
+// if it fails the breaker opens again with twice the backoff.
+//
+// All times are caller-supplied milliseconds (e.g. GetTickCount64()), and
+// nothing here reads a clock or takes a lock.
+
+class CircuitBreaker
+{
+public:
+    static constexpr unsigned c_threshold = 3;
+    static constexpr unsigned long long c_minBackoff = 5000;
+    static constexpr unsigned long long c_maxBackoff = 5 * 60 * 1000;
+
+    // Whether a call may be made now.  When half open, only the first caller
+    // gets true, and it must report the outcome.
+    bool            Allow(unsigned long long now);
+    void            Succeeded();
+    void            Failed(unsigned long long now);
+
+    // True while calls are being refused or a trial call is in flight.
+    bool            IsOpen() const { return m_state != State::Closed; }
+
+private:
+    enum class State { Closed, Open, HalfOpen };
+
+    State           m_state = State::Closed;
+    unsigned        m_failures = 0;
+    unsigned long long m_backoff = 0;
+    unsigned long long m_retry = 0;
+};
@@ -0,0 +1,520 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "main.h"
+#include "vms.h"
+#include "checkpoints.h"
+#include "propreader.h"
+#include "trace.h"
+#include <atlcomcli.h>
+#include <algorithm>
+#include <map>
+
+// Listing has to be quick to be useful in a menu; the methods start jobs, so
+// they return quickly unless VMMS is busy.
+constexpr ULONGLONG c_listTimeout = 10000;
+constexpr ULONGLONG c_methodTimeout = 30000;
+
+// Events normally keep the cache current; this covers a host whose
+// subscription failed.
+constexpr ULONGLONG c_checkpointTtl = 60000;
+
+static const WCHAR c_snapshotService[] = L"Msvm_VirtualSystemSnapshotService";
+
+struct CheckpointEntry
+{
+    bool loading = false;
+    bool valid = false;
+    LONG generation = 0;        // Bumped by invalidation, so an older fetch is discarded.
+    ULONGLONG fetched = 0;
+    HRESULT hr = S_OK;
+    Checkpoints checkpoints;
+};
+
+struct CheckpointFetch
+{
+    std::wstring host;
+    std::wstring vmId;
+    LONG generation;
+};
+
+static HWND s_hwndFetched = 0;
+static UINT s_msgFetched = 0;
+static SRWLOCK s_checkpointLock = SRWLOCK_INIT;
+static std::map<std::wstring, CheckpointEntry> s_checkpoints;
+static std::map<std::wstring, std::wstring> s_snapshotServices;    // Path for each host.
+
+static std::wstring GetKey(const std::wstring& host, const std::wstring& vmId)
+{
+    std::wstring key(host);
+    key.push_back('|');
+    key.append(vmId);
+    return key;
+}
+
+// The properties shown for each checkpoint, and its path for applying it.
+enum { c_checkpointPath, c_checkpointName, c_checkpointCreated, c_checkpointPropCount };
+static constexpr PropDef c_checkpointProps[] =
+{
+    { L"__PATH",        PropType::String,   true },
+    { L"ElementName",   PropType::String,   false },
+    { L"CreationTime",  PropType::String,   false },
+};
+static_assert(_countof(c_checkpointProps) == c_checkpointPropCount, "c_checkpointProps doesn't match its indices");
+
+static HRESULT QueryCheckpoints(const std::wstring& host, const std::wstring& vmId, Checkpoints& out)
+{
+    // InstanceID is the key, so that WMI still fills in __PATH.
+    std::wstring query(L"SELECT InstanceID, ElementName, CreationTime FROM Msvm_VirtualSystemSettingData "
+                       L"WHERE VirtualSystemType=\"Microsoft:Hyper-V:Snapshot:Realized\" AND VirtualSystemIdentifier=\"");
+    for (WCHAR c : vmId)
+    {
+        if (c == '"' || c == '\\')
+            query.push_back('\\');
+        query.push_back(c);
+    }
+    query.append(L"\"");
+
+    WmiSession& session = GetSession(host);
+    return session.Call([&](IWbemServices* pServices) -> HRESULT
+    {
+        HRESULT hr;
+
+        out.clear();
+
+        const WmiDeadline deadline(session, c_listTimeout);
+
+        SPI<IEnumWbemClassObject> spEnum;
+        {
+            TraceSpan span("ExecQuery(checkpoints)");
+            hr = pServices->ExecQuery(BSTR(L"WQL"), BSTR(query.c_str()), WBEM_FLAG_FORWARD_ONLY|WBEM_FLAG_RETURN_IMMEDIATELY, 0, &spEnum);
+        }
+        if (FAILED(hr))
+            return hr;
+
+        constexpr ULONG c_batch = 32;
+        IWbemClassObject* objects[c_batch];
+        PropertyReader reader(c_checkpointProps);
+
+        while (true)
+        {
+            ULONG uReturned = 0;
+            {
+                TraceSpan span("Next(checkpoints)");
+                hr = NextObjects(spEnum, deadline, c_batch, objects, &uReturned);
+            }
+            if (FAILED(hr))
+                return hr;
+
+            for (ULONG i = 0; i < uReturned; ++i)
+            {
+                SPI<IWbemClassObject> spObject;
+                spObject = objects[i];
+
+                VmCheckpoint checkpoint;
+                if (!reader.Read(spObject))
+                    continue;
+                reader.GetString(c_checkpointPath, checkpoint.path);
+                reader.GetString(c_checkpointName, checkpoint.name);
+                reader.GetString(c_checkpointCreated, checkpoint.created);
+                out.emplace_back(std::move(checkpoint));
+            }
+
+            if (hr == WBEM_S_FALSE)
+                break;
+        }
+
+        // CIM datetimes sort chronologically as strings.
+        std::sort(out.begin(), out.end(), [](const VmCheckpoint& a, const VmCheckpoint& b) {
+            return a.created < b.created;
+        });
+        return S_OK;
+    });
+}
+
+static void CALLBACK FetchCheckpointsCallback(PTP_CALLBACK_INSTANCE /*instance*/, void* context)
+{
+    CheckpointFetch* const pFetch = static_cast<CheckpointFetch*>(context);
+    const HRESULT hrInit = CoInitializeEx(0, COINIT_MULTITHREADED);
+
+    Checkpoints checkpoints;
+    HRESULT hr;
+    {
+        TraceSpan span("GetCheckpoints");
+        hr = QueryCheckpoints(pFetch->host, pFetch->vmId, checkpoints);
+    }
+
+    // If the list was invalidated while this fetch was in flight, the result
+    // may already be out of date, so fetch it again.
+    bool again = false;
+    AcquireSRWLockExclusive(&s_checkpointLock);
+    CheckpointEntry& entry = s_checkpoints[GetKey(pFetch->host, pFetch->vmId)];
+    if (entry.generation == pFetch->generation)
+    {
+        entry.loading = false;
+        entry.valid = true;
+        entry.fetched = GetTickCount64();
+        entry.hr = hr;
+        entry.checkpoints = std::move(checkpoints);
+    }
+    else
+    {
+        pFetch->generation = entry.generation;
+        again = !!TrySubmitThreadpoolCallback(FetchCheckpointsCallback, pFetch, nullptr);
+        entry.loading = again;
+    }
+    ReleaseSRWLockExclusive(&s_checkpointLock);
+
+    if (!again)
+    {
+        delete pFetch;
+        PostMessage(s_hwndFetched, s_msgFetched, 0, 0);
+    }
+
+    if (SUCCEEDED(hrInit))
+        CoUninitialize();
+}
+
+void InitCheckpoints(HWND hwnd, UINT msg)
+{
+    s_hwndFetched = hwnd;
+    s_msgFetched = msg;
+}
+
+void RequestCheckpoints(const VmSnapshot& vm)
+{
+    const std::wstring key = GetKey(vm.host, vm.id);
+
+    AcquireSRWLockExclusive(&s_checkpointLock);
+    CheckpointEntry& entry = s_checkpoints[key];
+    const bool fresh = (entry.valid && SUCCEEDED(entry.hr) && GetTickCount64() - entry.fetched < c_checkpointTtl);
+    const bool start = (!entry.loading && !fresh);
+    if (start)
+        entry.loading = true;
+    const LONG generation = entry.generation;
+    ReleaseSRWLockExclusive(&s_checkpointLock);
+
+    if (!start)
+        return;
+
+    CheckpointFetch* const pFetch = new CheckpointFetch { vm.host, vm.id, generation };
+    if (!TrySubmitThreadpoolCallback(FetchCheckpointsCallback, pFetch, nullptr))
+    {
+        delete pFetch;
+        AcquireSRWLockExclusive(&s_checkpointLock);
+        s_checkpoints[key].loading = false;
+        ReleaseSRWLockExclusive(&s_checkpointLock);
+    }
+}
+
+// A list that's merely old is returned while it's refreshed in the
+// background; an invalidated one, or a failure being retried, isn't.
+bool GetCheckpoints(const VmSnapshot& vm, Checkpoints& out, HRESULT* phr)
+{
+    RequestCheckpoints(vm);
+
+    bool found = false;
+
+    AcquireSRWLockShared(&s_checkpointLock);
+    const auto iter = s_checkpoints.find(GetKey(vm.host, vm.id));
+    if (iter != s_checkpoints.end())
+    {
+        const CheckpointEntry& entry = iter->second;
+        if (entry.valid && (SUCCEEDED(entry.hr) || !entry.loading))
+        {
+            out = entry.checkpoints;
+            if (phr)
+                *phr = entry.hr;
+            found = true;
+        }
+    }
+    ReleaseSRWLockShared(&s_checkpointLock);
+
+    return found;
+}
+
+void InvalidateCheckpoints(const std::wstring& host, const std::wstring& vmId)
+{
+    AcquireSRWLockExclusive(&s_checkpointLock);
+    const auto iter = s_checkpoints.find(GetKey(host, vmId));
+    if (iter != s_checkpoints.end())
+    {
+        ++iter->second.generation;
+        iter->second.valid = false;
+    }
+    ReleaseSRWLockExclusive(&s_checkpointLock);
+}
+
+static void InvalidateHost(const std::wstring& host)
+{
+    const std::wstring prefix = GetKey(host, std::wstring());
+
+    AcquireSRWLockExclusive(&s_checkpointLock);
+    for (auto& iter : s_checkpoints)
+    {
+        if (iter.first.compare(0, prefix.length(), prefix) == 0)
+        {
+            ++iter.second.generation;
+            iter.second.valid = false;
+        }
+    }
+    ReleaseSRWLockExclusive(&s_checkpointLock);
+}
+
+// Change notifications.  The sink only invalidates the cache, so nothing is
+// posted to the window; the next time the submenu opens, it's refetched.
+
+class CheckpointEventSink : public ObjectSink
+{
+public:
+    CheckpointEventSink(const std::wstring& host) : m_host(host) {}
+
+    STDMETHODIMP Indicate(long lObjectCount, IWbemClassObject** apObjArray) override
+    {
+        for (long i = 0; i < lObjectCount; ++i)
+        {
+            VARIANT vt;
+            VariantInit(&vt);
+            if (SUCCEEDED(apObjArray[i]->Get(L"TargetInstance", 0, &vt, 0, 0)) && V_VT(&vt) == VT_UNKNOWN && V_UNKNOWN(&vt))
+            {
+                SPQI<IWbemClassObject> spTarget;
+                std::wstring vmId;
+                if (spTarget.FQuery(V_UNKNOWN(&vt)) && GetStringProp(spTarget, L"VirtualSystemIdentifier", vmId))
+                    InvalidateCheckpoints(m_host, vmId);
+            }
+            VariantClear(&vt);
+        }
+        return WBEM_S_NO_ERROR;
+    }
+    STDMETHODIMP SetStatus(long lFlags, HRESULT /*hResult*/, BSTR /*strParam*/, IWbemClassObject* /*pObjParam*/) override
+    {
+        // Without events, nothing cached for the host can be trusted.
+        if (lFlags == WBEM_STATUS_COMPLETE)
+            InvalidateHost(m_host);
+        return WBEM_S_NO_ERROR;
+    }
+
+private:
+    const std::wstring m_host;
+};
+
+struct CheckpointSubscription
+{
+    SPI<IWbemServices> spServices;
+    SPI<IWbemObjectSink> spSink;
+};
+
+static SRWLOCK s_subscriptionLock = SRWLOCK_INIT;
+static std::vector<CheckpointSubscription> s_subscriptions;
+
+// Hosts that can't deliver events fall back to the cache's time limit, so a
+// failure here is reported but doesn't undo the other hosts' subscriptions.
+HRESULT SubscribeCheckpointChanges()
+{
+    UnsubscribeCheckpointChanges();
+
+    HRESULT hrFirst = S_OK;
+    for (const auto& status : GetHostStatus())
+    {
+        SPI<IWbemObjectSink> spSink;
+        spSink = new CheckpointEventSink(status.host);
+
+        SPI<IWbemServices> spServices;
+        const HRESULT hr = GetSession(status.host).Call([&](IWbemServices* pServices) -> HRESULT
+        {
+            TraceSpan span("ExecNotificationQueryAsync(checkpoints)");
+            const HRESULT hr = pServices->ExecNotificationQueryAsync(BSTR(L"WQL"),
+                BSTR(L"SELECT * FROM __InstanceOperationEvent WITHIN 2 "
+                     L"WHERE TargetInstance ISA 'Msvm_VirtualSystemSettingData' "
+                     L"AND TargetInstance.VirtualSystemType = 'Microsoft:Hyper-V:Snapshot:Realized'"),
+                0, 0, spSink);
+            if (SUCCEEDED(hr))
+                spServices.Set(pServices);
+            return hr;
+        });
+        if (FAILED(hr))
+        {
+            if (SUCCEEDED(hrFirst))
+                hrFirst = hr;
+            continue;
+        }
+
+        CheckpointSubscription subscription;
+        subscription.spServices = std::move(spServices);
+        subscription.spSink = std::move(spSink);
+
+        AcquireSRWLockExclusive(&s_subscriptionLock);
+        s_subscriptions.emplace_back(std::move(subscription));
+        ReleaseSRWLockExclusive(&s_subscriptionLock);
+    }
+    return hrFirst;
+}
+
+void UnsubscribeCheckpointChanges()
+{
+    std::vector<CheckpointSubscription> subscriptions;
+    AcquireSRWLockExclusive(&s_subscriptionLock);
+    subscriptions.swap(s_subscriptions);
+    ReleaseSRWLockExclusive(&s_subscriptionLock);
+
+    for (auto& subscription : subscriptions)
+    {
+        if (subscription.spServices && subscription.spSink)
+            subscription.spServices->CancelAsyncCall(subscription.spSink);
+    }
+}
+
+// Creating and applying checkpoints.
+
+struct CheckpointRequest
+{
+    HWND hwnd;
+    UINT msg;
+    VmSnapshot vm;
+    std::wstring checkpointPath;    // Empty to create a checkpoint.
+};
+
+static HRESULT GetSnapshotServicePath(IWbemServices* pServices, const WmiDeadline& deadline, const std::wstring& host, std::wstring& out)
+{
+    AcquireSRWLockShared(&s_checkpointLock);
+    const auto cached = s_snapshotServices.find(host);
+    if (cached != s_snapshotServices.end())
+        out = cached->second;
+    ReleaseSRWLockShared(&s_checkpointLock);
+    if (!out.empty())
+        return S_OK;
+
+    const HRESULT hr = GetServicePath(pServices, deadline, c_snapshotService, out);
+    if (FAILED(hr))
+        return hr;
+
+    AcquireSRWLockExclusive(&s_checkpointLock);
+    s_snapshotServices[host] = out;
+    ReleaseSRWLockExclusive(&s_checkpointLock);
+    return S_OK;
+}
+
+static HRESULT CallSnapshotService(const CheckpointRequest& request, ULONG& returnValue, std::wstring& job)
+{
+    const bool apply = !request.checkpointPath.empty();
+    LPCWSTR const method = apply ? L"ApplySnapshot" : L"CreateSnapshot";
+
+    WmiSession& session = GetSession(request.vm.host);
+    return session.Call([&](IWbemServices* pServices) -> HRESULT
+    {
+        HRESULT hr;
+
+        const WmiDeadline deadline(session, c_methodTimeout);
+
+        std::wstring service;
+        hr = GetSnapshotServicePath(pServices, deadline, request.vm.host, service);
+        if (FAILED(hr))
+            return hr;
+
+        SPI<IWbemClassObject> spInParams;
+        hr = GetMethodParams(pServices, deadline, c_snapshotService, method, &spInParams);
+        if (FAILED(hr))
+            return hr;
+
+        if (apply)
+        {
+            CComVariant snapshot(request.checkpointPath.c_str());
+            if (FAILED(hr = spInParams->Put(L"Snapshot", 0, &snapshot, 0)))
+                return hr;
+        }
+        else
+        {
+            // SnapshotType 2 is a full snapshot; the host's checkpoint type
+            // setting decides whether it's a production or standard one.
+            CComVariant system(request.vm.path.c_str());
+            CComVariant type(LONG(2));
+            if (FAILED(hr = spInParams->Put(L"AffectedSystem", 0, &system, 0)))
+                return hr;
+            if (FAILED(hr = spInParams->Put(L"SnapshotType", 0, &type, 0)))
+                return hr;
+        }
+
+        SPI<IWbemClassObject> spOutParams;
+        hr = ExecMethod(pServices, deadline, service.c_str(), method, spInParams, &spOutParams);
+        if (hr == WBEM_E_NOT_FOUND || hr == WBEM_E_INVALID_OBJECT_PATH)
+        {
+            AcquireSRWLockExclusive(&s_checkpointLock);
+            s_snapshotServices.erase(request.vm.host);
+            ReleaseSRWLockExclusive(&s_checkpointLock);
+        }
+        if (FAILED(hr))
+            return hr;
+
+        if (spOutParams)
+        {
+            GetIntegerProp(spOutParams, L"ReturnValue", returnValue);
+            GetStringProp(spOutParams, L"Job", job);
+        }
+        return S_OK;
+    });
+}
+
+static void CALLBACK CheckpointRequestCallback(PTP_CALLBACK_INSTANCE /*instance*/, void* context)
+{
+    CheckpointRequest* const pRequest = static_cast<CheckpointRequest*>(context);
+    const HRESULT hrInit = CoInitializeEx(0, COINIT_MULTITHREADED);
+
+    VmRequestResult* const pResult = new VmRequestResult;
+    {
+        TraceSpan span(pRequest->checkpointPath.empty() ? "CreateSnapshot" : "ApplySnapshot");
+        pResult->hr = CallSnapshotService(*pRequest, pResult->returnValue, pResult->job);
+    }
+    pResult->host = std::move(pRequest->vm.host);
+    pResult->id = std::move(pRequest->vm.id);
+    pResult->name = std::move(pRequest->vm.name);
+
+    // A job that's started is tracked and invalidates the list when it
+    // finishes; one that completed already has changed it.
+    if (SUCCEEDED(pResult->hr) && pResult->returnValue == 0)
+        InvalidateCheckpoints(pResult->host, pResult->id);
+
+    if (!PostMessage(pRequest->hwnd, pRequest->msg, 0, LPARAM(pResult)))
+        delete pResult;
+    delete pRequest;
+
+    if (SUCCEEDED(hrInit))
+        CoUninitialize();
+}
+
+static bool SubmitCheckpointRequest(HWND hwnd, UINT msg, const VmSnapshot& vm, const std::wstring& checkpointPath)
+{
+    CheckpointRequest* const pRequest = new CheckpointRequest { hwnd, msg, vm, checkpointPath };
+    if (!TrySubmitThreadpoolCallback(CheckpointRequestCallback, pRequest, nullptr))
+    {
+        delete pRequest;
+        return false;
+    }
+    return true;
+}
+
+bool CreateCheckpoint(HWND hwnd, UINT msg, const VmSnapshot& vm)
+{
+    return SubmitCheckpointRequest(hwnd, msg, vm, std::wstring());
+}
+
+bool ApplyCheckpoint(HWND hwnd, UINT msg, const VmSnapshot& vm, const std::wstring& checkpointPath)
+{
+    if (checkpointPath.empty())
+        return false;
+    return SubmitCheckpointRequest(hwnd, msg, vm, checkpointPath);
+}
+
+void AppendCheckpointTime(std::wstring& inout, const std::wstring& created)
+{
+    if (created.length() < 12)
+        return;
+    for (size_t i = 0; i < 12; ++i)
+    {
+        if (created[i] < '0' || created[i] > '9')
+            return;
+    }
+
+    WCHAR text[32];
+    swprintf_s(text, L"%.4s-%.2s-%.2s %.2s:%.2s", &created[0], &created[4], &created[6], &created[8], &created[10]);
+    inout.append(text);
+}
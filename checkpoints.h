@@ -0,0 +1,44 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "main.h"
+#include "vms.h"
+
+// Checkpoints (realized Msvm_VirtualSystemSettingData snapshots) of each VM.
+//
+// The list for a VM is fetched on a pool thread and cached until WMI reports
+// that one of the VM's checkpoints was created, deleted, or renamed (or, as
+// a backstop, until it's a minute old).  RequestCheckpoints() starts a fetch
+// unless one is cached or in flight, so it's cheap to call speculatively.
+// GetCheckpoints() doesn't wait; it returns false if the list isn't available
+// yet, and (msg, 0, 0) is posted to the window given to InitCheckpoints()
+// each time a fetch finishes.
+
+struct VmCheckpoint
+{
+    std::wstring name;          // ElementName.
+    std::wstring path;          // __PATH, the Snapshot argument to ApplySnapshot.
+    std::wstring created;       // CreationTime, as a CIM datetime.
+};
+typedef std::vector<VmCheckpoint> Checkpoints;
+
+void InitCheckpoints(HWND hwnd, UINT msg);
+void RequestCheckpoints(const VmSnapshot& vm);
+bool GetCheckpoints(const VmSnapshot& vm, Checkpoints& out, HRESULT* phr=nullptr);
+void InvalidateCheckpoints(const std::wstring& host, const std::wstring& vmId);
+
+// Subscribes to checkpoint changes on every host, to keep the cache current.
+HRESULT SubscribeCheckpointChanges();
+void UnsubscribeCheckpointChanges();
+
+// Msvm_VirtualSystemSnapshotService methods, issued from a pool thread.  The
+// result is posted to the window as (msg, 0, VmRequestResult*), the same as
+// a state change, so a returned job can be tracked; the receiver must delete
+// the result.
+bool CreateCheckpoint(HWND hwnd, UINT msg, const VmSnapshot& vm);
+bool ApplyCheckpoint(HWND hwnd, UINT msg, const VmSnapshot& vm, const std::wstring& checkpointPath);
+
+// Formats a CIM datetime (yyyymmddHHMMSS.mmmmmmsUUU) as "yyyy-mm-dd HH:MM".
+void AppendCheckpointTime(std::wstring& inout, const std::wstring& created);
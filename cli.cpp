@@ -0,0 +1,372 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "main.h"
+#include "vms.h"
+#include "jobs.h"
+#include "cli.h"
+#include <stdio.h>
+#include <stdarg.h>
+
+static const struct { LPCWSTR name; VmState state; } c_waitStates[] =
+{
+    { L"running",   VmState::Running },
+    { L"stopped",   VmState::Stopped },
+    { L"off",       VmState::Stopped },
+    { L"saved",     VmState::Saved },
+    { L"paused",    VmState::Paused },
+};
+
+bool ParseWaitState(LPCWSTR text, VmState& out)
+{
+    for (const auto& s : c_waitStates)
+    {
+        if (_wcsicmp(text, s.name) == 0)
+        {
+            out = s.state;
+            return true;
+        }
+    }
+    return false;
+}
+
+//----------------------------------------------------------------------------
+// Output.  HyperVTray is a GUI app, so stdout and stderr are only usable if
+// they were redirected, or after attaching to the parent's console.  Results
+// go to stdout and errors to stderr.  Lines are written as they're produced
+// rather than buffered.
+
+class OutputStream
+{
+public:
+    void Open(DWORD which)
+    {
+        m_h = GetStdHandle(which);
+        DWORD mode;
+        m_console = (IsValid() && GetConsoleMode(m_h, &mode));
+    }
+
+    bool IsValid() const { return m_h && m_h != INVALID_HANDLE_VALUE; }
+
+    void Write(LPCWSTR s, size_t len)
+    {
+        if (!IsValid() || !len)
+            return;
+
+        DWORD written;
+        if (m_console)
+        {
+            WriteConsoleW(m_h, s, DWORD(len), &written, nullptr);
+            return;
+        }
+
+        // Redirected output is written as UTF-8.
+        const int needed = WideCharToMultiByte(CP_UTF8, 0, s, int(len), nullptr, 0, nullptr, nullptr);
+        if (needed <= 0)
+            return;
+        m_utf8.resize(needed);
+        WideCharToMultiByte(CP_UTF8, 0, s, int(len), &m_utf8[0], needed, nullptr, nullptr);
+        WriteFile(m_h, m_utf8.c_str(), DWORD(needed), &written, nullptr);
+    }
+
+private:
+    HANDLE m_h = 0;
+    bool m_console = false;
+    std::string m_utf8;
+};
+
+class Output
+{
+public:
+    Output()
+    {
+        m_out.Open(STD_OUTPUT_HANDLE);
+        m_err.Open(STD_ERROR_HANDLE);
+        if ((!m_out.IsValid() || !m_err.IsValid()) && AttachConsole(ATTACH_PARENT_PROCESS))
+        {
+            if (!m_out.IsValid())
+                m_out.Open(STD_OUTPUT_HANDLE);
+            if (!m_err.IsValid())
+                m_err.Open(STD_ERROR_HANDLE);
+        }
+    }
+
+    void Write(const std::wstring& s) { m_out.Write(s.c_str(), s.length()); }
+    void Write(LPCWSTR s, size_t len) { m_out.Write(s, len); }
+
+    void Error(LPCWSTR format, ...)
+    {
+        WCHAR message[1024];
+        va_list args;
+        va_start(args, format);
+        const int len = vswprintf_s(message, format, args);
+        va_end(args);
+        if (len > 0)
+            m_err.Write(message, len);
+    }
+
+private:
+    OutputStream m_out;
+    OutputStream m_err;
+};
+
+static void AppendJsonString(std::wstring& out, const std::wstring& s)
+{
+    out.push_back('"');
+    for (WCHAR c : s)
+    {
+        switch (c)
+        {
+        case '"':   out.append(L"\\\""); break;
+        case '\\':  out.append(L"\\\\"); break;
+        case '\n':  out.append(L"\\n"); break;
+        case '\r':  out.append(L"\\r"); break;
+        case '\t':  out.append(L"\\t"); break;
+        default:
+            if (c < 0x20)
+            {
+                WCHAR escape[8];
+                swprintf_s(escape, L"\\u%04x", c);
+                out.append(escape);
+            }
+            else
+            {
+                out.push_back(c);
+            }
+            break;
+        }
+    }
+    out.push_back('"');
+}
+
+//----------------------------------------------------------------------------
+// Commands.
+
+struct ListContext
+{
+    Output* output;
+    bool json;
+    ULONG count;
+    std::wstring line;
+};
+
+static void ListCallback(VmSnapshot&& vm, void* context)
+{
+    ListContext& c = *static_cast<ListContext*>(context);
+
+    c.line.clear();
+    if (c.json)
+    {
+        c.line.append(c.count ? L",\n  {\"id\":" : L"\n  {\"id\":");
+        AppendJsonString(c.line, vm.id);
+        c.line.append(L",\"name\":");
+        AppendJsonString(c.line, vm.name);
+        c.line.append(L",\"state\":");
+        std::wstring state;
+        AppendStateString(state, vm.state, false/*brackets*/);
+        AppendJsonString(c.line, state);
+        WCHAR tmp[64];
+        swprintf_s(tmp, L",\"enabledState\":%u,\"healthState\":%u}", ULONG(vm.state), vm.health);
+        c.line.append(tmp);
+    }
+    else
+    {
+        c.line = vm.name;
+        c.line.push_back('\t');
+        AppendStateString(c.line, vm.state, false/*brackets*/);
+        c.line.push_back('\t');
+        c.line.append(vm.id);
+        c.line.push_back('\n');
+    }
+
+    c.output->Write(c.line);
+    ++c.count;
+}
+
+static int DoList(Output& output, bool json)
+{
+    ListContext context;
+    context.output = &output;
+    context.json = json;
+    context.count = 0;
+
+    if (json)
+        output.Write(L"[", 1);
+
+    const HRESULT hr = EnumerateVirtualMachines(ListCallback, &context);
+
+    if (json)
+        output.Write(context.count ? L"\n]\n" : L"]\n", context.count ? 3 : 2);
+
+    if (FAILED(hr))
+    {
+        output.Error(L"error: unable to enumerate virtual machines (0x%08X).\n", hr);
+        return 1;
+    }
+    return 0;
+}
+
+struct FindContext
+{
+    LPCWSTR nameOrId;
+    VirtualMachines matches;
+};
+
+static void FindCallback(VmSnapshot&& vm, void* context)
+{
+    FindContext& c = *static_cast<FindContext*>(context);
+    if (_wcsicmp(vm.name.c_str(), c.nameOrId) == 0 || _wcsicmp(vm.id.c_str(), c.nameOrId) == 0)
+        c.matches.emplace_back(std::move(vm));
+}
+
+static bool FindVm(Output& output, LPCWSTR nameOrId, VmSnapshot& out)
+{
+    FindContext context;
+    context.nameOrId = nameOrId;
+
+    const HRESULT hr = EnumerateVirtualMachines(FindCallback, &context);
+    if (FAILED(hr))
+    {
+        output.Error(L"error: unable to enumerate virtual machines (0x%08X).\n", hr);
+        return false;
+    }
+    if (context.matches.empty())
+    {
+        output.Error(L"error: no virtual machine named \"%s\".\n", nameOrId);
+        return false;
+    }
+    if (context.matches.size() > 1)
+    {
+        output.Error(L"error: more than one virtual machine is named \"%s\"; use its GUID instead.\n", nameOrId);
+        return false;
+    }
+
+    out = std::move(context.matches[0]);
+    return true;
+}
+
+static void SnapshotCallback(VmSnapshot&& vm, void* context)
+{
+    *static_cast<VmSnapshot*>(context) = std::move(vm);
+}
+
+// Follows the job that finishes a state change.
+static int DoJob(Output& output, const VmSnapshot& vm, const std::wstring& job, ULONGLONG deadline)
+{
+    while (true)
+    {
+        JobStatus status;
+        const HRESULT hr = GetJobStatus(job, vm.host, status);
+        if (FAILED(hr))
+        {
+            output.Error(L"error: unable to check the state change of \"%s\" (0x%08X).\n", vm.name.c_str(), hr);
+            return 1;
+        }
+
+        if (status.failed)
+        {
+            if (status.errorDescription.empty())
+                output.Error(L"error: changing the state of \"%s\" failed (%u).\n", vm.name.c_str(), status.errorCode);
+            else
+                output.Error(L"error: changing the state of \"%s\" failed: %s\n", vm.name.c_str(), status.errorDescription.c_str());
+            return 1;
+        }
+        if (status.done)
+            return 0;
+
+        if (GetTickCount64() >= deadline)
+        {
+            output.Error(L"error: timed out waiting for \"%s\" to change state.\n", vm.name.c_str());
+            return 2;
+        }
+
+        Sleep(250);
+    }
+}
+
+static int DoWait(Output& output, const VmSnapshot& vm, VmState state, ULONGLONG deadline)
+{
+    while (true)
+    {
+        VmSnapshot current;
+        if (SUCCEEDED(EnumerateVirtualMachines(SnapshotCallback, &current, vm.id.c_str())) &&
+            current.state == state)
+            return 0;
+
+        if (GetTickCount64() >= deadline)
+        {
+            output.Error(L"error: timed out waiting for \"%s\".\n", vm.name.c_str());
+            return 2;
+        }
+
+        Sleep(250);
+    }
+}
+
+int RunHeadless(const HeadlessOptions& options)
+{
+    Output output;
+
+    if (int(options.list) + int(!!options.start) + int(!!options.save) > 1)
+    {
+        output.Error(L"error: only one of --list, --start, and --save may be used.\n");
+        return 1;
+    }
+
+    LPCWSTR const target = options.start ? options.start : options.save;
+    if (options.wait != VmState::Unknown && !target)
+    {
+        output.Error(L"error: --wait requires --start or --save.\n");
+        return 1;
+    }
+
+    if (FAILED(InitCom()))
+    {
+        output.Error(L"error: unable to initialize COM.\n");
+        return 1;
+    }
+
+    if (options.list)
+        return DoList(output, options.json);
+
+    VmSnapshot vm;
+    if (!FindVm(output, target, vm))
+        return 1;
+
+    // --timeout covers both the state change and the --wait.
+    const ULONGLONG deadline = GetTickCount64() + ULONGLONG(options.timeout) * 1000;
+
+    const VmOp op = options.start ? VmOp::Start : VmOp::Save;
+    const VmState requestedState = GetOpTarget(op);
+    if (vm.state != requestedState)
+    {
+        if (!(GetEnabledOps(vm.state) & OpBit(op)))
+        {
+            std::wstring state;
+            AppendStateString(state, vm.state, false/*brackets*/);
+            output.Error(L"error: \"%s\" can't be %s while it is %s.\n", vm.name.c_str(), options.start ? L"started" : L"saved", state.c_str());
+            return 1;
+        }
+
+        std::wstring job;
+        const HRESULT hr = ChangeVmState(vm, requestedState, &job);
+        if (FAILED(hr))
+        {
+            output.Error(L"error: unable to change the state of \"%s\" (0x%08X).\n", vm.name.c_str(), hr);
+            return 1;
+        }
+
+        // Success only means the change was started; a job finishes it.
+        if (!job.empty())
+        {
+            const int ret = DoJob(output, vm, job, deadline);
+            if (ret)
+                return ret;
+        }
+    }
+
+    if (options.wait != VmState::Unknown)
+        return DoWait(output, vm, options.wait, deadline);
+
+    return 0;
+}
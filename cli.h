@@ -0,0 +1,27 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "main.h"
+#include "vmstate.h"
+
+// Headless command line mode.  Runs without creating the hidden window, the
+// tray icon, or a message loop, and writes results to stdout and errors to
+// stderr.  --start and --save return once the state change has finished (or
+// failed), following the job Hyper-V starts for it.
+
+struct HeadlessOptions
+{
+    bool list = false;
+    bool json = false;
+    LPCWSTR start = nullptr;        // VM name or GUID.
+    LPCWSTR save = nullptr;         // VM name or GUID.
+    VmState wait = VmState::Unknown;
+    DWORD timeout = 60;             // Seconds, for the state change and --wait.
+
+    bool Any() const { return list || start || save || wait != VmState::Unknown; }
+};
+
+bool ParseWaitState(LPCWSTR text, VmState& out);
+int RunHeadless(const HeadlessOptions& options);
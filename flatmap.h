@@ -0,0 +1,157 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <functional>
+#include <utility>
+
+//----------------------------------------------------------------------------
+// Flat open-addressing hash map.
+//
+// Entries live in a single array and collisions are resolved by linear
+// probing, so a lookup is a hash plus (usually) one key compare, with no
+// per-entry allocations.  Erase uses backward shifting instead of tombstones,
+// so lookups stay short after many inserts and erases.  Pointers returned by
+// Find() are invalidated by operator[] and Erase().
+
+template<class Key, class Value, class Hash = std::hash<Key>>
+class FlatMap
+{
+    struct Slot
+    {
+        bool used = false;
+        Key key;
+        Value value;
+    };
+
+public:
+    size_t          Size() const { return m_count; }
+    bool            Empty() const { return !m_count; }
+
+    void Clear()
+    {
+        m_slots.clear();
+        m_count = 0;
+    }
+
+    Value* Find(const Key& key)
+    {
+        if (!m_count)
+            return nullptr;
+        for (size_t i = Home(key);; i = Next(i))
+        {
+            Slot& slot = m_slots[i];
+            if (!slot.used)
+                return nullptr;
+            if (slot.key == key)
+                return &slot.value;
+        }
+    }
+    const Value* Find(const Key& key) const { return const_cast<FlatMap*>(this)->Find(key); }
+    bool Contains(const Key& key) const { return !!Find(key); }
+
+    // Inserts a default value if the key isn't present.
+    Value& operator[](const Key& key)
+    {
+        if (Value* value = Find(key))
+            return *value;
+
+        if ((m_count + 1) * 4 > m_slots.size() * 3)
+            Grow();
+
+        size_t i = Home(key);
+        while (m_slots[i].used)
+            i = Next(i);
+
+        Slot& slot = m_slots[i];
+        slot.used = true;
+        slot.key = key;
+        slot.value = Value();
+        ++m_count;
+        return slot.value;
+    }
+
+    bool Erase(const Key& key)
+    {
+        if (!m_count)
+            return false;
+
+        size_t hole = Home(key);
+        while (true)
+        {
+            if (!m_slots[hole].used)
+                return false;
+            if (m_slots[hole].key == key)
+                break;
+            hole = Next(hole);
+        }
+
+        // Shift later entries in the probe sequence back into the hole, so
+        // no lookup ever stops early at it.
+        for (size_t i = Next(hole); m_slots[i].used; i = Next(i))
+        {
+            const size_t home = Home(m_slots[i].key);
+            const bool movable = (hole <= i) ? (home <= hole || home > i) : (home <= hole && home > i);
+            if (movable)
+            {
+                m_slots[hole] = std::move(m_slots[i]);
+                hole = i;
+            }
+        }
+
+        m_slots[hole] = Slot();
+        --m_count;
+        return true;
+    }
+
+    // Calls func(const Key&, Value&) for each entry, in no particular order.
+    // The map must not be modified during the walk.
+    template<class F>
+    void ForEach(F&& func)
+    {
+        for (auto& slot : m_slots)
+        {
+            if (slot.used)
+                func(const_cast<const Key&>(slot.key), slot.value);
+        }
+    }
+    template<class F>
+    void ForEach(F&& func) const
+    {
+        for (const auto& slot : m_slots)
+        {
+            if (slot.used)
+                func(slot.key, slot.value);
+        }
+    }
+
+private:
+    size_t Home(const Key& key) const { return Hash()(key) & (m_slots.size() - 1); }
+    size_t Next(size_t i) const { return (i + 1) & (m_slots.size() - 1); }
+
+    void Grow()
+    {
+        std::vector<Slot> old;
+        old.swap(m_slots);
+        m_slots.resize(old.empty() ? 16 : old.size() * 2);
+        m_count = 0;
+
+        for (auto& slot : old)
+        {
+            if (!slot.used)
+                continue;
+            size_t i = Home(slot.key);
+            while (m_slots[i].used)
+                i = Next(i);
+            m_slots[i] = std::move(slot);
+            ++m_count;
+        }
+    }
+
+private:
+    std::vector<Slot> m_slots;          // Size is always 0 or a power of 2.
+    size_t m_count = 0;
+};
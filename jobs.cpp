@@ -0,0 +1,319 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "main.h"
+#include "vms.h"
+#include "jobs.h"
+#include "trace.h"
+#include "propreader.h"
+#include <algorithm>
+
+// https://learn.microsoft.com/en-us/windows/win32/hyperv_v2/msvm-concretejob
+enum class JobState
+{
+    New             = 2,
+    Starting        = 3,
+    Running         = 4,
+    Suspended       = 5,
+    ShuttingDown    = 6,
+    Completed       = 7,
+    Terminated      = 8,
+    Killed          = 9,
+    Exception       = 10,
+    Service         = 11,
+    QueryPending    = 12,
+};
+
+// Service and QueryPending come after the finished states, but the job is
+// still in progress.
+static bool IsFinishedJobState(ULONG state)
+{
+    switch (JobState(state))
+    {
+    case JobState::Completed:
+    case JobState::Terminated:
+    case JobState::Killed:
+    case JobState::Exception:
+        return true;
+    default:
+        return false;
+    }
+}
+
+struct TrackedJob
+{
+    std::wstring instanceId;
+    std::wstring host;
+    std::wstring vmId;
+    std::wstring vmName;
+};
+
+static HWND s_hwndJobs = 0;
+static UINT s_msgJobs = 0;
+static SRWLOCK s_jobLock = SRWLOCK_INIT;
+static std::vector<TrackedJob> s_jobs;
+static LONG s_polling = 0;
+
+void InitJobTracker(HWND hwnd, UINT msg)
+{
+    s_hwndJobs = hwnd;
+    s_msgJobs = msg;
+}
+
+// Extracts the key from a path such as
+// \\HOST\root\virtualization\v2:Msvm_ConcreteJob.InstanceID="...".
+static bool GetJobInstanceId(const std::wstring& jobPath, std::wstring& out)
+{
+    static const WCHAR c_key[] = L"InstanceID=\"";
+
+    const size_t start = jobPath.find(c_key);
+    if (start == std::wstring::npos)
+        return false;
+
+    out.clear();
+    for (size_t i = start + _countof(c_key) - 1; i < jobPath.length(); ++i)
+    {
+        if (jobPath[i] == '\\' && i + 1 < jobPath.length())
+            ++i;
+        else if (jobPath[i] == '"')
+            return !out.empty();
+        out.push_back(jobPath[i]);
+    }
+    return false;
+}
+
+bool TrackJob(const std::wstring& jobPath, const std::wstring& host, const std::wstring& vmId, const std::wstring& vmName)
+{
+    TrackedJob job;
+    if (!GetJobInstanceId(jobPath, job.instanceId))
+        return false;
+    job.host = host;
+    job.vmId = vmId;
+    job.vmName = vmName;
+
+    AcquireSRWLockExclusive(&s_jobLock);
+    s_jobs.emplace_back(std::move(job));
+    ReleaseSRWLockExclusive(&s_jobLock);
+    return true;
+}
+
+bool HasTrackedJobs()
+{
+    AcquireSRWLockShared(&s_jobLock);
+    const bool any = !s_jobs.empty();
+    ReleaseSRWLockShared(&s_jobLock);
+    return any;
+}
+
+// The Msvm_ConcreteJob properties that are polled.
+enum { c_jobInstanceId, c_jobState, c_jobPercentComplete, c_jobErrorCode, c_jobErrorDescription, c_jobPropCount };
+static constexpr PropDef c_jobProps[] =
+{
+    { L"InstanceID",        PropType::String,   true },
+    { L"JobState",          PropType::Integer,  false },
+    { L"PercentComplete",   PropType::Integer,  false },
+    { L"ErrorCode",         PropType::Integer,  false },
+    { L"ErrorDescription",  PropType::String,   false },
+};
+static_assert(_countof(c_jobProps) == c_jobPropCount, "c_jobProps doesn't match its indices");
+
+// Properties the job doesn't have keep their previous values.
+static void ReadJobStatus(const PropertyReader& reader, JobStatus& status)
+{
+    if (reader.Has(c_jobState))
+        status.state = ULONG(reader.GetInteger(c_jobState));
+    if (reader.Has(c_jobPercentComplete))
+        status.percentComplete = ULONG(reader.GetInteger(c_jobPercentComplete));
+    if (reader.Has(c_jobErrorCode))
+        status.errorCode = ULONG(reader.GetInteger(c_jobErrorCode));
+    if (reader.Has(c_jobErrorDescription))
+        reader.GetString(c_jobErrorDescription, status.errorDescription);
+
+    status.done = IsFinishedJobState(status.state);
+    status.failed = (status.done && (status.state != ULONG(JobState::Completed) || status.errorCode != 0));
+}
+
+// Jobs are polled every second, so a poll that takes longer is not useful.
+constexpr ULONGLONG c_pollTimeout = 5000;
+
+// Updates the entries in list that belong to host, with one query.
+static HRESULT QueryJobs(const std::wstring& host, JobStatusList& list)
+{
+    std::wstring query(L"SELECT InstanceID, JobState, PercentComplete, ErrorCode, ErrorDescription FROM Msvm_ConcreteJob WHERE ");
+    bool any = false;
+    for (const auto& status : list)
+    {
+        if (status.host != host)
+            continue;
+        if (any)
+            query.append(L" OR ");
+        query.append(L"InstanceID=\"");
+        for (WCHAR c : status.instanceId)
+        {
+            if (c == '"' || c == '\\')
+                query.push_back('\\');
+            query.push_back(c);
+        }
+        query.append(L"\"");
+        any = true;
+    }
+    if (!any)
+        return S_FALSE;
+
+    WmiSession& session = GetSession(host);
+    return session.Call([&](IWbemServices* pServices) -> HRESULT
+    {
+        HRESULT hr;
+
+        const WmiDeadline deadline(session, c_pollTimeout);
+
+        SPI<IEnumWbemClassObject> spEnum;
+        {
+            TraceSpan span("ExecQuery(Msvm_ConcreteJob)");
+            hr = pServices->ExecQuery(BSTR(L"WQL"), BSTR(query.c_str()), WBEM_FLAG_FORWARD_ONLY|WBEM_FLAG_RETURN_IMMEDIATELY, 0, &spEnum);
+        }
+        if (FAILED(hr))
+            return hr;
+
+        constexpr ULONG c_batch = 32;
+        IWbemClassObject* objects[c_batch];
+        PropertyReader reader(c_jobProps);
+
+        while (true)
+        {
+            ULONG uReturned = 0;
+            {
+                TraceSpan span("Next(Msvm_ConcreteJob)");
+                hr = NextObjects(spEnum, deadline, c_batch, objects, &uReturned);
+            }
+            if (FAILED(hr))
+                return hr;
+
+            for (ULONG i = 0; i < uReturned; ++i)
+            {
+                SPI<IWbemClassObject> spObject;
+                spObject = objects[i];
+
+                if (!reader.Read(spObject))
+                    continue;
+
+                size_t length;
+                LPCWSTR instanceId = reader.GetString(c_jobInstanceId, &length);
+                for (auto& status : list)
+                {
+                    if (status.host == host && status.instanceId.compare(0, std::wstring::npos, instanceId, length) == 0)
+                    {
+                        ReadJobStatus(reader, status);
+                        break;
+                    }
+                }
+            }
+
+            if (hr == WBEM_S_FALSE)
+                break;
+        }
+
+        return S_OK;
+    });
+}
+
+HRESULT GetJobStatus(const std::wstring& jobPath, const std::wstring& host, JobStatus& status)
+{
+    JobStatusList list(1);
+    if (!GetJobInstanceId(jobPath, list[0].instanceId))
+        return E_INVALIDARG;
+    list[0].host = host;
+
+    const HRESULT hr = QueryJobs(host, list);
+    if (FAILED(hr))
+        return hr;
+
+    // As when polling, a job that's gone has finished.
+    if (!list[0].state)
+        list[0].done = true;
+
+    status = std::move(list[0]);
+    return S_OK;
+}
+
+static void CALLBACK PollJobsCallback(PTP_CALLBACK_INSTANCE /*instance*/, void* /*context*/)
+{
+    const HRESULT hrInit = CoInitializeEx(0, COINIT_MULTITHREADED);
+
+    JobStatusList* const pList = new JobStatusList;
+    std::vector<std::wstring> hosts;
+
+    AcquireSRWLockShared(&s_jobLock);
+    for (const auto& job : s_jobs)
+    {
+        JobStatus status;
+        status.instanceId = job.instanceId;
+        status.host = job.host;
+        status.vmId = job.vmId;
+        status.vmName = job.vmName;
+        pList->emplace_back(std::move(status));
+        if (std::find(hosts.begin(), hosts.end(), job.host) == hosts.end())
+            hosts.emplace_back(job.host);
+    }
+    ReleaseSRWLockShared(&s_jobLock);
+
+    // One query per host covers every tracked job on that host.  A host that
+    // fails leaves its jobs as they were, to be polled again next time.
+
+    bool any = false;
+    for (const auto& host : hosts)
+    {
+        if (QueryJobs(host, *pList) != S_OK)
+            continue;
+
+        // A job that no longer exists has been cleaned up, so it's finished;
+        // its outcome is reflected in the VM's state.
+        for (auto& status : *pList)
+        {
+            if (status.host == host && !status.state)
+                status.done = true;
+        }
+        any = true;
+    }
+
+    if (any)
+    {
+        AcquireSRWLockExclusive(&s_jobLock);
+        for (const auto& status : *pList)
+        {
+            if (!status.done)
+                continue;
+            for (auto iter = s_jobs.begin(); iter != s_jobs.end(); ++iter)
+            {
+                if (iter->host == status.host && iter->instanceId == status.instanceId)
+                {
+                    s_jobs.erase(iter);
+                    break;
+                }
+            }
+        }
+        ReleaseSRWLockExclusive(&s_jobLock);
+    }
+
+    InterlockedExchange(&s_polling, 0);
+
+    if (!any || !PostMessage(s_hwndJobs, s_msgJobs, 0, LPARAM(pList)))
+        delete pList;
+
+    if (SUCCEEDED(hrInit))
+        CoUninitialize();
+}
+
+bool PollJobs()
+{
+    if (!HasTrackedJobs())
+        return false;
+
+    if (InterlockedCompareExchange(&s_polling, 1, 0) != 0)
+        return true;
+
+    if (!TrySubmitThreadpoolCallback(PollJobsCallback, nullptr, nullptr))
+        InterlockedExchange(&s_polling, 0);
+
+    return true;
+}
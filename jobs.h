@@ -0,0 +1,36 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "main.h"
+
+// Tracks Msvm_ConcreteJob instances returned by asynchronous methods (such as
+// RequestStateChange returning 4096).  All tracked jobs on a host are polled
+// together with a single query; each poll posts (msg, 0, JobStatusList*) to the window
+// and the receiver must delete the list.  Jobs that have finished are
+// dropped from tracking after they're reported.
+
+struct JobStatus
+{
+    std::wstring instanceId;
+    std::wstring host;          // Empty for the local machine.
+    std::wstring vmId;
+    std::wstring vmName;
+    ULONG state = 0;            // JobState; 7 to 10 mean the job has finished.
+    ULONG percentComplete = 0;
+    ULONG errorCode = 0;
+    std::wstring errorDescription;
+    bool done = false;
+    bool failed = false;
+};
+typedef std::vector<JobStatus> JobStatusList;
+
+void InitJobTracker(HWND hwnd, UINT msg);
+bool TrackJob(const std::wstring& jobPath, const std::wstring& host, const std::wstring& vmId, const std::wstring& vmName);
+bool HasTrackedJobs();
+bool PollJobs();
+
+// Queries one job synchronously, e.g. to follow a job started by
+// ChangeVmState().  A job that no longer exists is reported as done.
+HRESULT GetJobStatus(const std::wstring& jobPath, const std::wstring& host, JobStatus& status);
@@ -3,6 +3,16 @@
 
 #include "main.h"
 #include "vms.h"
+#include "menumodel.h"
+#include "jobs.h"
+#include "checkpoints.h"
+#include "autostart.h"
+#include "alloccount.h"
+#include "trace.h"
+#include "cli.h"
+#include "flatmap.h"
+#include "statewatch.h"
+#include "badge.h"
 #include "darkmode.h"
 #include "res.h"
 #include <windowsx.h>
@@ -10,250 +20,1346 @@
 #include <shellapi.h>
 #include <dwmapi.h>
 #include <wbemidl.h>
-#include <map>
+#include <algorithm>
 
 static const WCHAR c_usage[] =
-L"Usage:  HyperVTray [--help --nodarkmode]\n"
+L"Usage:  HyperVTray [--help --nodarkmode --host name --concurrency n --group by --pagesize n --autostart file --benchmark --trace file]\n"
+L"        HyperVTray --list [--json]\n"
+L"        HyperVTray {--start name | --save name} [--wait state [--timeout seconds]]\n"
 L"\n"
-L"HyperVTray adds a system tray icon which you can right click on to manage Hyper-V virtual machines."
+L"HyperVTray adds a system tray icon which you can right click on to manage Hyper-V virtual machines.\n"
+L"\n"
+L"The --list, --start, and --save options run without a tray icon, write to stdout, and exit.\n"
+L"Only one of them may be used at a time; errors are written to stderr.\n"
+L"The --wait state can be running, stopped, saved, or paused.  The default --timeout is 60.\n"
+L"\n"
+L"  --host name\tMonitor VMs on the named Hyper-V host; repeat for several hosts.  Use . for\n"
+L"\t\tthis machine (the default).  With several hosts, the menu is grouped by host.\n"
+L"  --concurrency n\tMaximum number of state changes to issue at once (default 4).\n"
+L"  --group by\tGroup VMs in the menu by state, tag, or none (default none).  Tags are\n"
+L"\t\tREG_SZ values under HKCU\\Software\\HyperVTray\\Tags, named by VM name or GUID.\n"
+L"  --pagesize n\tMaximum number of VMs per menu page before cascading (default 25).\n"
+L"  --autostart file\tStart the VMs listed in the profile file, group by group in dependency\n"
+L"\t\torder, waiting for each VM's heartbeat before starting the groups after it.\n"
+L"  --benchmark\tTime menu and notification processing for synthetic VM lists.\n"
+L"  --trace file\tOn exit, write timing spans to file as Chrome trace-event JSON."
 ;
 
-static const UINT c_msgTaskbarCreated = RegisterWindowMessageW(L"TaskbarCreated");
-static const WCHAR c_szWndClass[] = L"HyperVTray_hidden_window";
+static const UINT c_msgTaskbarCreated = RegisterWindowMessageW(L"TaskbarCreated");
+static const WCHAR c_szWndClass[] = L"HyperVTray_hidden_window";
+
+static HINSTANCE s_hinst = 0;
+static ULONG s_concurrency = 4;
+static HWND s_hwndMain = 0;
+static HICON s_hicon = 0;
+
+// Tray icon management.
+
+constexpr UINT c_idTrayIcon = 1;
+constexpr UINT WMU_TRAYNOTIFY = WM_USER;
+constexpr UINT WMU_VMSTATECHANGED = WM_USER + 1;
+constexpr UINT WMU_VMSREFRESHED = WM_USER + 2;
+constexpr UINT WMU_VMREQUESTDONE = WM_USER + 3;
+constexpr UINT WMU_JOBSTATUS = WM_USER + 4;
+constexpr UINT WMU_VMSPOLLED = WM_USER + 5;
+constexpr UINT WMU_SUBSCRIBED = WM_USER + 6;
+constexpr UINT WMU_CHECKPOINTDONE = WM_USER + 7;
+constexpr UINT WMU_CHECKPOINTSFETCHED = WM_USER + 8;
+static const WCHAR c_szTip[] = L"Hyper-V management";
+static std::wstring s_tip;
+static std::wstring s_jobTip;           // Progress lines for tracked jobs.
+static std::wstring s_autostartTip;     // Progress line for autostart.
+static bool s_isIconInstalled = false;
+
+// The tray icon is badged with VM counts.  s_hiconTray is owned by s_badges.
+static BadgeIconCache s_badges(IDI_MAIN);
+static HICON s_hiconTray = 0;
+static UINT s_trayDpi = 0;
+
+static bool TrayMessage(DWORD dwMessage, LPCWSTR title=nullptr, LPCWSTR message=nullptr, DWORD dwInfoFlags=NIIF_INFO)
+{
+    NOTIFYICONDATA  data = { sizeof(data) };
+    data.hWnd               = s_hwndMain;
+    data.uID                = c_idTrayIcon;
+    data.uFlags             = NIF_MESSAGE;
+    data.uCallbackMessage   = WMU_TRAYNOTIFY;
+
+    if (s_hiconTray || s_hicon)
+    {
+        data.uFlags |= NIF_ICON;
+        data.hIcon = s_hiconTray ? s_hiconTray : s_hicon;
+    }
+
+    data.uFlags |= NIF_TIP;
+    wcsncpy_s(data.szTip, s_tip.empty() ? c_szTip : s_tip.c_str(), _TRUNCATE);
+
+    if (title && message)
+    {
+        data.uFlags = NIF_INFO;
+        data.dwInfoFlags = dwInfoFlags;
+        wcsncpy_s(data.szInfo, message, _TRUNCATE);
+        wcsncpy_s(data.szInfoTitle, title, _TRUNCATE);
+        data.uTimeout = 4 * 1000;
+    }
+
+    const DWORD tickBegin = GetTickCount();
+    while (!Shell_NotifyIcon(dwMessage, &data))
+    {
+        if (GetTickCount() - tickBegin > 10 * 1000)
+            return false;
+        Sleep(500);
+    }
+
+    return true;
+}
+
+static void AddTrayIcon()
+{
+    assert(!s_isIconInstalled);
+
+    TrayMessage(NIM_ADD);
+    s_isIconInstalled = true;
+}
+
+static void UpdateTrayIcon(LPCWSTR title=nullptr, LPCWSTR message=nullptr, DWORD dwInfoFlags=NIIF_INFO)
+{
+    assert(s_isIconInstalled);
+
+    TrayMessage(NIM_MODIFY, title, message, dwInfoFlags);
+}
+
+// The tip is the title plus any progress lines.
+static void UpdateTip()
+{
+    std::wstring tip;
+    if (!s_jobTip.empty() || !s_autostartTip.empty())
+    {
+        tip = c_szTip;
+        tip.append(s_autostartTip);
+        tip.append(s_jobTip);
+    }
+
+    if (tip != s_tip)
+    {
+        s_tip = std::move(tip);
+        UpdateTrayIcon();
+    }
+}
+
+static void DeleteTrayIcon()
+{
+	if (s_isIconInstalled)
+    {
+        TrayMessage(NIM_DELETE);
+        s_isIconInstalled = false;
+    }
+}
+
+// Selects the badged tray icon for the VM counts.  The icons are rendered
+// ahead of time or on a cache miss here, never inside TrayMessage.
+static void UpdateTrayBadge(const VirtualMachines& vms)
+{
+    UINT running = 0;
+    UINT transitioning = 0;
+    for (const auto& vm : vms)
+    {
+        if (vm.state == VmState::Running)
+            ++running;
+        else if (IsTransitioningState(vm.state))
+            ++transitioning;
+    }
+
+    const HICON hicon = s_badges.Get(s_trayDpi, running, transitioning);
+    if (hicon && hicon != s_hiconTray)
+    {
+        s_hiconTray = hicon;
+        if (s_isIconInstalled)
+            UpdateTrayIcon();
+    }
+}
+
+// Re-renders the badges if the DPI changed (e.g. after the taskbar was
+// recreated, or the display settings changed).
+static void InitTrayBadge()
+{
+    const UINT dpi = BadgeIconCache::GetSystemDpi();
+    if (dpi == s_trayDpi)
+        return;
+
+    s_badges.Clear();
+    s_trayDpi = dpi;
+    s_badges.Prerender(s_trayDpi, 4);
+
+    const VmListPtr vms = GetCachedVirtualMachines();
+    s_hiconTray = vms ? 0 : s_badges.Get(s_trayDpi, 0, 0);
+    if (vms)
+        UpdateTrayBadge(*vms);
+}
+
+// Notifications.
+
+constexpr UINT c_timerId = 99;
+constexpr UINT c_jobTimerId = 100;
+constexpr UINT c_jobTimerInterval = 1000;
+
+static StateWatcher s_watcher;
+
+static void StopWatching(const std::wstring& id, bool finished)
+{
+    s_watcher.Unwatch(id, finished, GetTickCount64());
+}
+
+// Sets the timer for the next poll that's due, if polling is needed.
+static void SchedulePoll()
+{
+    const ULONGLONG next = s_watcher.NextPoll();
+    if (!next)
+    {
+        KillTimer(s_hwndMain, c_timerId);
+        return;
+    }
+
+    const ULONGLONG now = GetTickCount64();
+    SetTimer(s_hwndMain, c_timerId, UINT(next > now ? next - now : USER_TIMER_MINIMUM), 0);
+}
+
+static void OnStateChanged(const std::wstring& id, const std::wstring& name, VmState newState)
+{
+    if (!s_watcher.Observe(id, name, newState, GetTickCount64()).changed)
+        return;
+
+    std::wstring message = name;
+    AppendStateString(message, newState, false/*brackets*/);
+    UpdateTrayIcon(L"VM State Changed", message.c_str());
+}
+
+// Polling fallback, used only when WMI event subscription is unavailable.
+// The timer queries the VMs that are due, and this processes the result.
+static void DoNotifications(const VirtualMachines& vms)
+{
+    TraceSpan span("DoNotifications");
+
+    for (const auto& vm : vms)
+    {
+        if (!s_watcher.IsWatching(vm.id))
+            continue;
+
+        OnStateChanged(vm.id, vm.name, vm.state);
+        if (s_watcher.Empty())
+            break;
+    }
+}
+
+static void StartWatching(const VmSnapshot& vm, VmState target)
+{
+    s_watcher.Watch(vm.id, vm.name, vm.state, target, GetTickCount64());
+    SchedulePoll();
+}
+
+static void DoPoll()
+{
+    std::vector<std::wstring> due;
+    s_watcher.TakeDue(GetTickCount64(), due);
+    if (!due.empty())
+        QueryVirtualMachines(s_hwndMain, WMU_VMSPOLLED, std::move(due));
+    SchedulePoll();
+}
+
+// Subscribing can wait on a connection, so it never happens on this thread.
+static void CALLBACK SubscribeCallback(PTP_CALLBACK_INSTANCE /*instance*/, void* /*context*/)
+{
+    const HRESULT hrInit = CoInitializeEx(0, COINIT_MULTITHREADED);
+
+    const HRESULT hr = SubscribeStateChanges(s_hwndMain, WMU_VMSTATECHANGED);
+    PostMessage(s_hwndMain, WMU_SUBSCRIBED, WPARAM(hr), 0);
+    SubscribeCheckpointChanges();
+
+    if (SUCCEEDED(hrInit))
+        CoUninitialize();
+}
+
+static void OnStateEvent(WPARAM wParam, LPARAM lParam)
+{
+    VmStateEvent* const pEvent = reinterpret_cast<VmStateEvent*>(lParam);
+    if (pEvent)
+    {
+        OnStateChanged(pEvent->id, pEvent->name, pEvent->state);
+        delete pEvent;
+        RequestRefresh();
+        return;
+    }
+
+    // A host's subscription ended (e.g. VMMS restarted).  Poll until it's
+    // back; resubscribing leaves the other hosts' subscriptions alone, and if
+    // it fails, polling simply continues.
+    assert(FAILED(HRESULT(wParam)));
+    s_watcher.SetSubscribed(false);
+    TrySubmitThreadpoolCallback(SubscribeCallback, nullptr, nullptr);
+    SchedulePoll();
+}
+
+// Startup pipeline.  The tray icon goes up as soon as the window exists.  COM
+// security is set on this thread right after initializing COM, before
+// anything else can use COM (CoInitializeSecurity fails with RPC_E_TOO_LATE
+// after that).  The WMI connections, the first enumeration, and the event
+// subscription then happen on a pool thread, so the first menu after logon
+// usually finds the VM list already cached.
+
+static HRESULT s_hrComSecurity = S_OK;
+static LARGE_INTEGER s_startTime = {};
+
+static void ReportStartupTime(const char* span, LPCWSTR what)
+{
+    if (!s_startTime.QuadPart)
+        return;
+
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+
+    if (g_tracing)
+        RecordSpan(span, s_startTime.QuadPart);
+
+    WCHAR message[128];
+    swprintf_s(message, L"HyperVTray: startup to %s %.1f ms\n", what, double(now.QuadPart - s_startTime.QuadPart) * 1000 / double(freq.QuadPart));
+    OutputDebugStringW(message);
+}
+
+static void CALLBACK StartupCallback(PTP_CALLBACK_INSTANCE /*instance*/, void* /*context*/)
+{
+    const HRESULT hrInit = CoInitializeEx(0, COINIT_MULTITHREADED);
+
+    HRESULT hr = s_hrComSecurity;
+
+    // Each host connects and enumerates on its own pool thread.
+    RequestRefresh();
+
+    // Subscribe to VM state changes; if that fails, DoNotifications() polls
+    // while any operations are being watched.
+    if (SUCCEEDED(hr))
+        hr = SubscribeStateChanges(s_hwndMain, WMU_VMSTATECHANGED);
+    PostMessage(s_hwndMain, WMU_SUBSCRIBED, WPARAM(hr), 0);
+
+    // Without these, cached checkpoint lists simply expire sooner.
+    if (SUCCEEDED(hr))
+        SubscribeCheckpointChanges();
+
+    if (SUCCEEDED(hrInit))
+        CoUninitialize();
+}
+
+// Context menu.
+
+// Refresh on hover if the cached list is older than this.
+constexpr ULONGLONG c_prefetchAge = 1000;
+
+// Time from right click until the menu is visible (i.e. the menu loop has
+// gone idle for the first time).
+static LARGE_INTEGER s_clickTime = {};
+static double s_lastMenuLatency = 0;
+
+static void ReportMenuLatency()
+{
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+
+    s_lastMenuLatency = double(now.QuadPart - s_clickTime.QuadPart) * 1000 / double(freq.QuadPart);
+    if (g_tracing)
+        RecordSpan("ClickToMenuVisible", s_clickTime.QuadPart);
+    s_clickTime.QuadPart = 0;
+
+    // Menus and their popups are USER objects, so this shows what the menu
+    // costs in handles as well as time.
+    WCHAR message[128];
+    swprintf_s(message, L"HyperVTray: click to menu visible %.1f ms, %u USER objects\n",
+               s_lastMenuLatency, GetGuiResources(GetCurrentProcess(), GR_USEROBJECTS));
+    OutputDebugStringW(message);
+}
+
+enum class MenuMode { Watching, LDown, Cancelled };
+enum class MenuGrouping { None, State, Tag };
+
+// Each VM gets a block of 10 command IDs starting at IDM_FIRSTVM, and menu
+// command IDs must fit in a WORD.
+constexpr UINT c_maxSlots = (0xFFFF - IDM_FIRSTVM) / 10;
+
+static VmListPtr s_vms;
+static HMENU s_hmenu = 0;
+static bool s_inContextMenu = false;
+static INT s_menuSelectSlot = -1;
+static INT s_menuDownSlot = -1;
+static MenuMode s_menuMode = MenuMode::Watching;
+static RECT s_menuItemRect;
+static FlatMap<std::wstring, bool> s_selected;
+static CommandSlots s_slots(c_maxSlots);
+
+static MenuGrouping s_grouping = MenuGrouping::None;
+static UINT s_pageSize = 25;
+static FlatMap<std::wstring, std::wstring> s_tags;
+
+// Cascading popups are only filled in when they're about to be shown, so
+// building the menu costs the same no matter how many VMs there are.  That
+// includes each VM's own popup of commands, since at most one or two of them
+// are ever opened.
+enum class PopupKind
+{
+    Range,                          // A range of VMs from a group.
+    Vm,                             // A VM's commands; first is its index in the model.
+    Checkpoints,                    // A VM's checkpoints; likewise.
+};
+struct MenuPopup
+{
+    size_t group;
+    size_t first;                   // Range of entries within the group.
+    size_t count;
+    bool populated;
+    PopupKind kind;
+};
+
+// Everything a built menu refers to.  The tray's menu is s_menu; the
+// benchmark builds its own.
+struct MenuState
+{
+    MenuModel model;
+    std::vector<MenuGroup> groups;
+    FlatMap<HMENU, MenuPopup> popups;
+
+    void Clear()
+    {
+        model.clear();
+        groups.clear();
+        popups.Clear();
+    }
+};
+static MenuState s_menu;
+
+// Checkpoint items can't fit in a VM's block of command IDs, so each one
+// gets an ID from IDM_FIRSTCHECKPOINT up, for as long as the menu is open.
+struct CheckpointCommand
+{
+    UINT slot;                      // The VM's command slot.
+    std::wstring name;
+    std::wstring path;
+};
+constexpr UINT c_maxCheckpointCommands = IDM_FIRSTVM - IDM_FIRSTCHECKPOINT;
+static std::vector<CheckpointCommand> s_checkpointCommands;
+
+// The Checkpoints popup that's open, if any.  If its list was still being
+// fetched when it opened, it says so when the fetch finishes.
+static HMENU s_hmenuCheckpoints = 0;
+
+static const struct { VmOp op; LPCWSTR text; } c_vmOps[] =
+{
+    { VmOp::Connect,    L"&Connect" },
+    { VmOp::Start,      L"Sta&rt" },
+    { VmOp::Stop,       L"St&op" },
+    { VmOp::ShutDown,   L"Shut&Down" },
+    { VmOp::Save,       L"Sa&ve State" },
+    { VmOp::Pause,      L"&Pause" },
+    { VmOp::Select,     L"Se&lect" },
+};
+
+static DWORD EnableFlags(bool enable)
+{
+    return enable ? MF_ENABLED : MF_DISABLED;
+}
+
+static UINT GetVmCommand(const VmMenuEntry& entry, VmOp op)
+{
+    return IDM_FIRSTVM + (entry.slot * 10) + WORD(op);
+}
+
+// The VM's own popup item gets the last ID in its block, so that finding it
+// by command doesn't match an item in its submenu instead.
+static UINT GetVmPopupId(const VmMenuEntry& entry)
+{
+    static_assert(WORD(VmOp::Max) <= 9, "too many VmOps for the command ID block");
+    return IDM_FIRSTVM + (entry.slot * 10) + 9;
+}
+
+static const VmSnapshot* FindVmBySlot(UINT slot)
+{
+    const std::wstring* id = s_slots.Lookup(slot);
+    if (!id || !s_vms)
+        return nullptr;
+
+    for (const auto& vm : *s_vms)
+    {
+        if (vm.id == *id)
+            return &vm;
+    }
+    return nullptr;
+}
+
+// Tags are REG_SZ values under HKCU\Software\HyperVTray\Tags, where the value
+// name is a VM's name or Name GUID and the data is the tag.
+static void LoadTags()
+{
+    SHKEY hkey;
+    if (RegOpenKeyExW(HKEY_CURRENT_USER, L"Software\\HyperVTray\\Tags", 0, KEY_READ, &hkey) != ERROR_SUCCESS)
+        return;
+
+    for (DWORD i = 0;; ++i)
+    {
+        WCHAR name[256];
+        WCHAR data[256];
+        DWORD cchName = _countof(name);
+        DWORD cbData = sizeof(data) - sizeof(data[0]);
+        DWORD type;
+        const LONG err = RegEnumValueW(hkey, i, name, &cchName, nullptr, &type, LPBYTE(data), &cbData);
+        if (err == ERROR_NO_MORE_ITEMS)
+            break;
+        if (err != ERROR_SUCCESS || type != REG_SZ)
+            continue;
+
+        data[cbData / sizeof(data[0])] = '\0';
+        if (*data)
+            s_tags[name] = data;
+    }
+}
+
+static LPCWSTR GetHostLabel(const std::wstring& host)
+{
+    return host.empty() ? L"Local" : host.c_str();
+}
+
+static bool IsMenuGrouped()
+{
+    return s_grouping != MenuGrouping::None || GetHostCount() > 1;
+}
+
+static MenuModel BuildMenuModel(const VirtualMachines& vms, CommandSlots& slots)
+{
+    MenuModel model;
+    model.reserve(vms.size());
+    for (const auto& vm : vms)
+    {
+        VmMenuEntry entry;
+        entry.slot = slots.Get(vm.id);
+        if (entry.slot == CommandSlots::c_none)
+            continue;
+
+        entry.id = vm.id;
+        entry.name = vm.name;
+        entry.state = vm.state;
+
+        // A last-known VM can't be operated on until WMI confirms it.
+        if (vm.stale)
+        {
+            entry.detail = L"  (last known)";
+            entry.enabled = OpBit(VmOp::Connect);
+        }
+        else
+        {
+            if (vm.state == VmState::Running)
+                AppendStatsString(entry.detail, vm.stats);
+            entry.enabled = GetEnabledOps(vm.state);
+        }
+        entry.selected = s_selected.Contains(vm.id);
+
+        if (s_grouping == MenuGrouping::State)
+        {
+            AppendStateString(entry.group, vm.state, false/*brackets*/);
+        }
+        else if (s_grouping == MenuGrouping::Tag)
+        {
+            const std::wstring* tag = s_tags.Find(vm.id);
+            if (!tag)
+                tag = s_tags.Find(vm.name);
+            if (tag)
+                entry.group = *tag;
+        }
+
+        // With several hosts, VMs are grouped by host first.
+        if (GetHostCount() > 1)
+        {
+            std::wstring group(GetHostLabel(vm.host));
+            if (s_grouping != MenuGrouping::None)
+            {
+                group.append(L" / ");
+                group.append(entry.group.empty() ? L"Untagged" : entry.group.c_str());
+            }
+            entry.group = std::move(group);
+        }
+
+        model.emplace_back(std::move(entry));
+    }
+    return model;
+}
+
+// Adds an &1 through &9 accelerator for the first nine items in a popup.
+static void AppendAccelerator(std::wstring& out, size_t position)
+{
+    if (position < 9)
+    {
+        WCHAR prefix[] = { '&', WCHAR('1' + position), ' ', '-', ' ', '\0' };
+        out.append(prefix);
+    }
+}
+
+static void GetMenuItemText(const VmMenuEntry& entry, std::wstring& out)
+{
+    out.clear();
+    AppendAccelerator(out, entry.position % s_pageSize);
+    out += entry.name;
+    AppendStateString(out, entry.state, true/*brackets*/);
+    out += entry.detail;
+}
+
+static void AppendPopup(HMENU hmenu, UINT id, HMENU hmenuSub, LPCWSTR text)
+{
+    MENUITEMINFOW mii = { sizeof(mii) };
+    mii.fMask = MIIM_ID|MIIM_SUBMENU|MIIM_STRING;
+    mii.wID = id;
+    mii.hSubMenu = hmenuSub;
+    mii.dwTypeData = const_cast<LPWSTR>(text);
+    InsertMenuItemW(hmenu, GetMenuItemCount(hmenu), true, &mii);
+}
+
+static void AppendLazyPopup(MenuState& menu, HMENU hmenu, LPCWSTR text, size_t group, size_t first, size_t count)
+{
+    HMENU hmenuSub = CreatePopupMenu();
+    if (!hmenuSub)
+        return;
+
+    menu.popups[hmenuSub] = { group, first, count, false, PopupKind::Range };
+    AppendPopup(hmenu, 0, hmenuSub, text);
+}
+
+static void AppendVmItem(MenuState& menu, HMENU hmenu, size_t index)
+{
+    const VmMenuEntry& entry = menu.model[index];
+
+    std::wstring name;
+    GetMenuItemText(entry, name);
+
+    HMENU hmenuSub = CreatePopupMenu();
+    if (!hmenuSub)
+        return;
+
+    menu.popups[hmenuSub] = { 0, index, 1, false, PopupKind::Vm };
+    AppendPopup(hmenu, GetVmPopupId(entry), hmenuSub, name.c_str());
+}
+
+// Uses the model as of when the popup is opened, which UpdateContextMenu may
+// have replaced since the menu was built.
+static void PopulateVmPopup(MenuState& menu, HMENU hmenu, size_t index)
+{
+    const VmMenuEntry& entry = menu.model[index];
+    const unsigned checkpointOps = OpBit(VmOp::Checkpoint) | OpBit(VmOp::ApplyCheckpoint);
+
+    for (const auto& op : c_vmOps)
+    {
+        const bool enable = !!(entry.enabled & OpBit(op.op));
+        const bool check = (op.op == VmOp::Select && entry.selected);
+        if (op.op == VmOp::Select)
+        {
+            AppendMenuW(hmenu, MF_SEPARATOR, -1, L"");
+            if (HMENU hmenuSub = CreatePopupMenu())
+            {
+                menu.popups[hmenuSub] = { 0, index, 1, false, PopupKind::Checkpoints };
+                AppendPopup(hmenu, 0, hmenuSub, L"C&heckpoints");
+                EnableMenuItem(hmenu, GetMenuItemCount(hmenu) - 1, MF_BYPOSITION|EnableFlags(!!(entry.enabled & checkpointOps)));
+            }
+            AppendMenuW(hmenu, MF_SEPARATOR, -1, L"");
+        }
+        AppendMenuW(hmenu, MF_STRING|EnableFlags(enable)|(check ? MF_CHECKED : 0), GetVmCommand(entry, op.op), op.text);
+    }
+
+    // Start fetching the checkpoints now, in case they're wanted next.
+    if (entry.enabled & checkpointOps)
+    {
+        if (const VmSnapshot* pVm = FindVmBySlot(entry.slot))
+            RequestCheckpoints(*pVm);
+    }
+}
+
+enum class CheckpointList { Shown, Loading, Failed };
+
+static CheckpointList PopulateCheckpointPopup(HMENU hmenu, const VmMenuEntry& entry)
+{
+    while (GetMenuItemCount(hmenu) > 0)
+        DeleteMenu(hmenu, 0, MF_BYPOSITION);
+
+    AppendMenuW(hmenu, MF_STRING|EnableFlags(!!(entry.enabled & OpBit(VmOp::Checkpoint))), GetVmCommand(entry, VmOp::Checkpoint), L"&Create Checkpoint");
+    AppendMenuW(hmenu, MF_SEPARATOR, -1, L"");
+
+    Checkpoints checkpoints;
+    HRESULT hr = S_OK;
+    const VmSnapshot* pVm = FindVmBySlot(entry.slot);
+    if (!pVm || !GetCheckpoints(*pVm, checkpoints, &hr))
+    {
+        AppendMenuW(hmenu, MF_GRAYED, -1, L"Loading\x2026");
+        return CheckpointList::Loading;
+    }
+    if (FAILED(hr))
+    {
+        AppendMenuW(hmenu, MF_GRAYED, -1, L"Unable to list checkpoints");
+        return CheckpointList::Failed;
+    }
+    if (checkpoints.empty())
+    {
+        AppendMenuW(hmenu, MF_GRAYED, -1, L"No checkpoints");
+        return CheckpointList::Shown;
+    }
+
+    // Choosing a checkpoint applies it (after confirming).  The creation time
+    // is right-aligned like an accelerator.
+    const bool enable = !!(entry.enabled & OpBit(VmOp::ApplyCheckpoint));
+    std::wstring text;
+    for (auto& checkpoint : checkpoints)
+    {
+        if (s_checkpointCommands.size() >= c_maxCheckpointCommands)
+            break;
+
+        text.clear();
+        for (WCHAR c : checkpoint.name)
+        {
+            if (c == '&')
+                text.push_back('&');
+            text.push_back(c);
+        }
+        text.append(L"\t");
+        AppendCheckpointTime(text, checkpoint.created);
+
+        const UINT id = IDM_FIRSTCHECKPOINT + UINT(s_checkpointCommands.size());
+        s_checkpointCommands.push_back({ entry.slot, std::move(checkpoint.name), std::move(checkpoint.path) });
+        AppendMenuW(hmenu, MF_STRING|EnableFlags(enable), id, text.c_str());
+    }
+    return CheckpointList::Shown;
+}
+
+// Fills a popup with a range of VMs from a group.  If the range is larger
+// than a page, it's split into at most s_pageSize cascading popups instead,
+// each covering a power of s_pageSize entries.
+static void PopulatePopup(MenuState& menu, HMENU hmenu, const MenuPopup& popup)
+{
+    const auto& entries = menu.groups[popup.group].entries;
+
+    if (popup.count <= s_pageSize)
+    {
+        for (size_t i = popup.first; i < popup.first + popup.count; ++i)
+            AppendVmItem(menu, hmenu, entries[i]);
+        return;
+    }
+
+    size_t chunk = s_pageSize;
+    while (popup.count > chunk * s_pageSize)
+        chunk *= s_pageSize;
+
+    std::wstring text;
+    const size_t end = popup.first + popup.count;
+    for (size_t first = popup.first; first < end; first += chunk)
+    {
+        const size_t count = std::min<size_t>(chunk, end - first);
+        text.clear();
+        AppendAccelerator(text, (first - popup.first) / chunk);
+        text.append(menu.model[entries[first]].name);
+        text.append(L" \x2013 ");
+        text.append(menu.model[entries[first + count - 1]].name);
+        AppendLazyPopup(menu, hmenu, text.c_str(), popup.group, first, count);
+    }
+}
+
+static void OnInitMenuPopup(MenuState& menu, HMENU hmenu)
+{
+    MenuPopup* const found = menu.popups.Find(hmenu);
+    if (!found || found->populated)
+        return;
+
+    // Copy it, since populating can add popups and invalidate the pointer.
+    found->populated = true;
+    const MenuPopup popup = *found;
+
+    TraceSpan span("PopulatePopup");
+    switch (popup.kind)
+    {
+    case PopupKind::Range:
+        PopulatePopup(menu, hmenu, popup);
+        break;
+    case PopupKind::Vm:
+        if (popup.first < menu.model.size())
+            PopulateVmPopup(menu, hmenu, popup.first);
+        break;
+    case PopupKind::Checkpoints:
+        if (&menu == &s_menu)
+            s_hmenuCheckpoints = hmenu;
+        // If the list isn't available, fill it in again the next time it
+        // opens.
+        if (popup.first < menu.model.size() && PopulateCheckpointPopup(hmenu, menu.model[popup.first]) != CheckpointList::Shown)
+        {
+            if (MenuPopup* again = menu.popups.Find(hmenu))
+                again->populated = false;
+        }
+        break;
+    }
+}
+
+static void OnUninitMenuPopup(HMENU hmenu)
+{
+    if (hmenu == s_hmenuCheckpoints)
+        s_hmenuCheckpoints = 0;
+}
+
+// A checkpoint fetch finished.  If the Checkpoints popup is open and still
+// waiting for its list, the "Loading" item says what was found instead.  An
+// open popup doesn't resize to fit new items, so the list itself is shown the
+// next time the popup opens.
+static void OnCheckpointsFetched()
+{
+    const HMENU hmenu = s_hmenuCheckpoints;
+    const MenuPopup* const popup = hmenu ? s_menu.popups.Find(hmenu) : nullptr;
+    if (!popup || popup->populated || popup->first >= s_menu.model.size())
+        return;
+
+    // If it's still loading, another fetch is on its way.
+    Checkpoints checkpoints;
+    HRESULT hr = S_OK;
+    const VmSnapshot* pVm = FindVmBySlot(s_menu.model[popup->first].slot);
+    if (!pVm || !GetCheckpoints(*pVm, checkpoints, &hr))
+        return;
+
+    LPCWSTR text;
+    if (FAILED(hr))
+        text = L"Unable to list checkpoints";
+    else if (checkpoints.empty())
+        text = L"No checkpoints";
+    else
+        text = L"Reopen to see the list";
+
+    // The item after "Create Checkpoint" and the separator.
+    MENUITEMINFOW mii = { sizeof(mii) };
+    mii.fMask = MIIM_STRING;
+    mii.dwTypeData = const_cast<LPWSTR>(text);
+    SetMenuItemInfoW(hmenu, 2, true/*fByPosition*/, &mii);
+}
+
+static HMENU BuildContextMenu(MenuState& menu)
+{
+    TraceSpan span("BuildContextMenu");
+
+    menu.groups = GroupMenuModel(menu.model, IsMenuGrouped());
+    menu.popups.Clear();
+
+    HMENU hmenu = CreatePopupMenu();
+    if (hmenu)
+    {
+        if (!IsMenuGrouped())
+        {
+            if (!menu.groups.empty())
+                PopulatePopup(menu, hmenu, { 0, 0, menu.groups[0].entries.size(), true, PopupKind::Range });
+        }
+        else
+        {
+            std::wstring text;
+            for (size_t i = 0; i < menu.groups.size(); ++i)
+            {
+                const auto& group = menu.groups[i];
+                WCHAR count[32];
+                swprintf_s(count, L" (%zu)", group.entries.size());
+
+                text.clear();
+                AppendAccelerator(text, i);
+                text.append(group.label.empty() ? L"Untagged" : group.label.c_str());
+                text.append(count);
+                AppendLazyPopup(menu, hmenu, text.c_str(), i, 0, group.entries.size());
+            }
+        }
+
+        // Hosts whose last refresh failed or timed out have no VMs to show,
+        // and while a host's circuit breaker is open it isn't even asked.
+        for (const auto& status : GetHostStatus())
+        {
+            if (!status.responding || (status.reported && FAILED(status.hr)))
+            {
+                std::wstring text;
+                if (GetHostCount() > 1)
+                {
+                    text = GetHostLabel(status.host);
+                    text.append(L":  not responding");
+                }
+                else
+                {
+                    text = L"Hyper-V not responding";
+                }
+                AppendMenuW(hmenu, MF_GRAYED, -1, text.c_str());
+            }
+        }
+
+        AppendMenuW(hmenu, MF_SEPARATOR, -1, L"");
+        if (s_selected.Empty())
+        {
+            AppendMenuW(hmenu, 0, IDM_STARTALL, L"Start &All");
+            AppendMenuW(hmenu, 0, IDM_SAVEALL, L"Save All R&unning");
+            AppendMenuW(hmenu, 0, IDM_SHUTDOWNALL, L"Shut Down A&ll");
+        }
+        else
+        {
+            AppendMenuW(hmenu, 0, IDM_STARTALL, L"Start Selected (&A)");
+            AppendMenuW(hmenu, 0, IDM_SAVEALL, L"Save Selected (&U)");
+            AppendMenuW(hmenu, 0, IDM_SHUTDOWNALL, L"Shut Down Selected (&L)");
+            AppendMenuW(hmenu, 0, IDM_CLEARSELECTION, L"Clear Selectio&n");
+        }
+        AppendMenuW(hmenu, MF_SEPARATOR, -1, L"");
+        AppendMenuW(hmenu, 0, IDM_MANAGER, L"Hyper-V &Manager");
+        AppendMenuW(hmenu, MF_SEPARATOR, -1, L"");
+        AppendMenuW(hmenu, 0, IDM_EXIT, L"E&xit");
+    }
+
+    return hmenu;
+}
+
+static BOOL CALLBACK InvalidateMenuWindow(HWND hwnd, LPARAM /*lParam*/)
+{
+    WCHAR cls[16];
+    if (GetClassNameW(hwnd, cls, _countof(cls)) && wcscmp(cls, L"#32768") == 0)
+        InvalidateRect(hwnd, nullptr, true);
+    return true;
+}
+
+// Applies the differences between a built menu's model and a newer one to
+// the menu, in place.  This works while the menu is being tracked.  Items are
+// found by command ID, so VMs in popups that haven't been populated yet are
+// simply skipped (they'll use the new model when populated), as are the
+// commands of VMs whose own popup hasn't been opened.  If VMs were added,
+// removed, or reordered, the menu is left alone and false is returned, since
+// the groups and pages would change; the next time it opens it will be
+// rebuilt.  Otherwise changes gets what was updated.
+static bool ApplyMenuChanges(MenuState& menu, HMENU hmenu, MenuModel&& model, std::vector<MenuChange>& changes)
+{
+    if (!DiffMenuModel(menu.model, model, changes))
+        return false;
+
+    // The menu's layout doesn't change, even if a VM's group did.
+    for (size_t i = 0; i < model.size(); ++i)
+        model[i].position = menu.model[i].position;
+
+    std::wstring name;
+    for (const auto& change : changes)
+    {
+        const auto& entry = model[change.index];
+
+        MENUITEMINFOW mii = { sizeof(mii) };
+        mii.fMask = MIIM_SUBMENU;
+        if (!GetMenuItemInfoW(hmenu, GetVmPopupId(entry), false, &mii))
+            continue;
+
+        if (change.text)
+        {
+            GetMenuItemText(entry, name);
+
+            mii.fMask = MIIM_STRING;
+            mii.dwTypeData = const_cast<LPWSTR>(name.c_str());
+            SetMenuItemInfoW(hmenu, GetVmPopupId(entry), false, &mii);
+        }
+
+        // By command, EnableMenuItem also finds Create Checkpoint in the
+        // Checkpoints popup.
+        if (change.enabled && mii.hSubMenu)
+        {
+            for (unsigned op = 0; op < unsigned(VmOp::Max); ++op)
+            {
+                if (change.enabled & OpBit(VmOp(op)))
+                {
+                    const bool enable = !!(entry.enabled & OpBit(VmOp(op)));
+                    EnableMenuItem(mii.hSubMenu, GetVmCommand(entry, VmOp(op)), MF_BYCOMMAND|EnableFlags(enable));
+                }
+            }
+        }
+    }
+
+    menu.model = std::move(model);
+    return true;
+}
+
+static void UpdateContextMenu(const VmListPtr& vms)
+{
+    if (!s_hmenu || !vms)
+        return;
+
+    TraceSpan span("UpdateContextMenu");
+
+    std::vector<MenuChange> changes;
+    if (!ApplyMenuChanges(s_menu, s_hmenu, BuildMenuModel(*vms, s_slots), changes))
+        return;
+
+    s_vms = vms;
+
+    if (!changes.empty() && s_inContextMenu)
+        EnumThreadWindows(GetCurrentThreadId(), InvalidateMenuWindow, 0);
+}
+
+static void RequestStateChange(const VmSnapshot& vm, VmState requestedState)
+{
+    StartWatching(vm, requestedState);
+    QueueStateChange(vm, requestedState);
+}
+
+// Applies an operation to the selected VMs, or to all VMs if none are
+// selected.  The requests are issued concurrently.
+static void DoBulkCommand(UINT id)
+{
+    if (!s_vms)
+        return;
+
+    VmOp op;
+    switch (id)
+    {
+    case IDM_STARTALL:      op = VmOp::Start; break;
+    case IDM_SAVEALL:       op = VmOp::Save; break;
+    case IDM_SHUTDOWNALL:   op = VmOp::Stop; break;
+    default:                return;
+    }
+
+    for (const auto& vm : *s_vms)
+    {
+        if (vm.stale || (!s_selected.Empty() && !s_selected.Contains(vm.id)))
+            continue;
+
+        if (GetEnabledOps(vm.state) & OpBit(op))
+            RequestStateChange(vm, GetOpTarget(op));
+    }
+
+    s_selected.Clear();
+}
+
+// Autostart.  Each time the refresh replaces the VM list, the plan hears what
+// the started VMs are doing, and any VMs whose groups are now unblocked are
+// started together (QueueStateChange() issues up to --concurrency at once).
+// A timer keeps the refreshes coming until the plan is done.
+
+constexpr UINT c_autostartTimerId = 101;
+constexpr UINT c_autostartInterval = 2000;
+constexpr ULONG c_heartbeatOk = 2;
+
+static std::unique_ptr<AutostartPlan> s_autostart;
+static FlatMap<std::wstring, std::wstring> s_autostartIds; // Name GUID to the profile's name for it.
+
+static bool IsHeartbeatOk(const VmSnapshot& vm)
+{
+    return vm.stats.valid && vm.stats.heartbeat == c_heartbeatOk;
+}
+
+// A profile can name a VM by Name GUID or by ElementName.
+static const VmSnapshot* FindAutostartVm(const VirtualMachines& vms, const std::wstring& name)
+{
+    for (const auto& vm : vms)
+    {
+        if (_wcsicmp(vm.id.c_str(), name.c_str()) == 0)
+            return &vm;
+    }
+    for (const auto& vm : vms)
+    {
+        if (_wcsicmp(vm.name.c_str(), name.c_str()) == 0)
+            return &vm;
+    }
+    return nullptr;
+}
+
+static bool HaveAllHostsReported()
+{
+    for (const auto& status : GetHostStatus())
+    {
+        if (!status.reported)
+            return false;
+    }
+    return true;
+}
+
+static void UpdateAutostartTip()
+{
+    std::wstring tip;
+    if (s_autostart)
+    {
+        tip = L"\nAutostart";
+
+        // Name the group in progress, if any.
+        for (const auto& vm : s_autostart->GetVms())
+        {
+            if (vm.step == AutostartStep::Starting || vm.step == AutostartStep::Booting)
+            {
+                tip.append(L" [");
+                tip.append(s_autostart->GetProfile()[vm.group].name);
+                tip.append(L"]");
+                break;
+            }
+        }
+
+        const AutostartProgress progress = s_autostart->GetProgress();
+        WCHAR line[64];
+        swprintf_s(line, L": %zu of %zu ready", progress.ready, progress.total);
+        tip.append(line);
+        if (progress.failed)
+        {
+            swprintf_s(line, L", %zu failed", progress.failed);
+            tip.append(line);
+        }
+    }
+
+    s_autostartTip = std::move(tip);
+    UpdateTip();
+}
+
+static void FinishAutostart()
+{
+    const AutostartProgress progress = s_autostart->GetProgress();
+
+    WCHAR line[128];
+    swprintf_s(line, L"%zu of %zu VMs are ready.", progress.ready, progress.total);
+    std::wstring message = line;
+    for (const auto& vm : s_autostart->GetVms())
+    {
+        if (vm.step == AutostartStep::Failed || vm.step == AutostartStep::Skipped)
+        {
+            message.append(L"\n");
+            message.append(vm.name);
+            message.append(L": ");
+            message.append(vm.reason);
+        }
+    }
+
+    // The balloon text is limited to 255 characters.
+    if (message.length() > 255)
+    {
+        message.resize(252);
+        message.append(L"...");
+    }
+
+    KillTimer(s_hwndMain, c_autostartTimerId);
+    s_autostart.reset();
+    s_autostartIds.Clear();
+    UpdateAutostartTip();
+
+    UpdateTrayIcon(L"Autostart Finished", message.c_str(), progress.failed ? NIIF_WARNING : NIIF_INFO);
+}
+
+static void AdvanceAutostart(const VirtualMachines& vms)
+{
+    if (!s_autostart)
+        return;
+
+    const ULONGLONG now = GetTickCount64();
+
+    for (const auto& vm : vms)
+    {
+        const std::wstring* name = s_autostartIds.Find(vm.id);
+        if (name && !vm.stale)
+            s_autostart->Observe(*name, vm.state == VmState::Running, IsHeartbeatOk(vm), now);
+    }
+
+    std::vector<std::wstring> startable;
+    s_autostart->GetStartable(now, startable);
+    for (const auto& name : startable)
+    {
+        // Until every host has reported, a missing VM may just be on a host
+        // that hasn't answered yet.  The plan gives up on it after the
+        // group's timeout.
+        const VmSnapshot* pVm = FindAutostartVm(vms, name);
+        if (!pVm)
+        {
+            if (HaveAllHostsReported())
+                s_autostart->Fail(name, L"Not found.", now);
+            continue;
+        }
+        if (pVm->stale)
+            continue;
+
+        // A VM that's running, or on its way there, only needs watching.  One
+        // that's on its way somewhere else (e.g. saving) can't be started
+        // yet, so it's left waiting and offered again once it settles; the
+        // plan gives up on it after the group's timeout.
+        const bool startable = !!(GetEnabledOps(pVm->state) & OpBit(VmOp::Start));
+        const bool running = (GetSettledState(pVm->state) == VmState::Running);
+        if (!startable && !running)
+            continue;
+
+        s_autostartIds[pVm->id] = name;
+        s_autostart->Start(name, now);
 
-static HINSTANCE s_hinst = 0;
-static HWND s_hwndMain = 0;
-static HICON s_hicon = 0;
+        if (startable)
+            RequestStateChange(*pVm, VmState::Running);
+        else
+            s_autostart->Observe(name, pVm->state == VmState::Running, IsHeartbeatOk(*pVm), now);
+    }
 
-// Tray icon management.
+    s_autostart->Tick(now);
 
-constexpr UINT c_idTrayIcon = 1;
-constexpr UINT WMU_TRAYNOTIFY = WM_USER;
-static const WCHAR c_szTip[] = L"Hyper-V management";
-static bool s_isIconInstalled = false;
+    if (s_autostart->Done())
+        FinishAutostart();
+    else
+        UpdateAutostartTip();
+}
 
-static bool TrayMessage(DWORD dwMessage, LPCWSTR title=nullptr, LPCWSTR message=nullptr, DWORD dwInfoFlags=NIIF_INFO)
+static void OnAutostartFailed(const std::wstring& id, const std::wstring& reason)
 {
-    NOTIFYICONDATA  data = { sizeof(data) };
-    data.hWnd               = s_hwndMain;
-    data.uID                = c_idTrayIcon;
-    data.uFlags             = NIF_MESSAGE;
-    data.uCallbackMessage   = WMU_TRAYNOTIFY;
+    if (!s_autostart)
+        return;
 
-    if (s_hicon)
+    if (const std::wstring* name = s_autostartIds.Find(id))
     {
-        data.uFlags |= NIF_ICON;
-        data.hIcon = s_hicon;
+        s_autostart->Fail(*name, reason, GetTickCount64());
+        if (const VmListPtr vms = GetCachedVirtualMachines())
+            AdvanceAutostart(*vms);
     }
+}
 
-    data.uFlags |= NIF_TIP;
-    wcscpy_s(data.szTip, c_szTip);
+// Profiles are UTF-16 with a BOM, or else UTF-8 (with or without a BOM).
+static bool LoadAutostartProfile(LPCWSTR file, AutostartProfile& profile, std::wstring& error)
+{
+    SFileHandle hFile(CreateFileW(file, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0));
+    LARGE_INTEGER size = {};
+    if (hFile.IsEmpty() || !GetFileSizeEx(hFile, &size) || size.QuadPart > 1024 * 1024)
+    {
+        WCHAR message[64];
+        swprintf_s(message, L"Unable to read the file (error %u).", hFile.IsEmpty() ? GetLastError() : ERROR_FILE_TOO_LARGE);
+        error = message;
+        return false;
+    }
 
-    if (title && message)
+    std::string bytes(size_t(size.QuadPart), '\0');
+    DWORD read = 0;
+    if (!bytes.empty() && (!ReadFile(hFile, &bytes[0], DWORD(bytes.size()), &read, nullptr) || read != bytes.size()))
     {
-        data.uFlags = NIF_INFO;
-        data.dwInfoFlags = dwInfoFlags;
-        wcscpy_s(data.szInfo, message);
-        wcscpy_s(data.szInfoTitle, title);
-        data.uTimeout = 4 * 1000;
+        WCHAR message[64];
+        swprintf_s(message, L"Unable to read the file (error %u).", GetLastError());
+        error = message;
+        return false;
     }
 
-    const DWORD tickBegin = GetTickCount();
-    while (!Shell_NotifyIcon(dwMessage, &data))
+    std::wstring text;
+    if (bytes.size() >= 2 && BYTE(bytes[0]) == 0xff && BYTE(bytes[1]) == 0xfe)
     {
-        if (GetTickCount() - tickBegin > 10 * 1000)
-            return false;
-        Sleep(500);
+        text.assign(reinterpret_cast<const WCHAR*>(bytes.data() + 2), (bytes.size() - 2) / sizeof(WCHAR));
+    }
+    else
+    {
+        size_t skip = 0;
+        if (bytes.size() >= 3 && BYTE(bytes[0]) == 0xef && BYTE(bytes[1]) == 0xbb && BYTE(bytes[2]) == 0xbf)
+            skip = 3;
+        const int len = MultiByteToWideChar(CP_UTF8, 0, bytes.data() + skip, int(bytes.size() - skip), nullptr, 0);
+        text.resize(size_t(len));
+        if (len)
+            MultiByteToWideChar(CP_UTF8, 0, bytes.data() + skip, int(bytes.size() - skip), &text[0], len);
     }
 
-    return true;
+    return ParseAutostartProfile(text, profile, error);
 }
 
-static void AddTrayIcon()
+static void StartAutostart(const AutostartProfile& profile)
 {
-    assert(!s_isIconInstalled);
-
-    TrayMessage(NIM_ADD);
-    s_isIconInstalled = true;
+    s_autostart = std::make_unique<AutostartPlan>(profile);
+    UpdateAutostartTip();
+    SetTimer(s_hwndMain, c_autostartTimerId, c_autostartInterval, 0);
 }
 
-static void UpdateTrayIcon(LPCWSTR title=nullptr, LPCWSTR message=nullptr, DWORD dwInfoFlags=NIIF_INFO)
+// Methods return 0 when completed synchronously, and 4096 when a job was
+// started.  Returns false if the request failed.
+static bool TrackRequestJob(const VmRequestResult* pResult)
 {
-    assert(s_isIconInstalled);
+    if (SUCCEEDED(pResult->hr) && pResult->returnValue == 4096)
+    {
+        if (TrackJob(pResult->job, pResult->host, pResult->id, pResult->name))
+        {
+            PollJobs();
+            SetTimer(s_hwndMain, c_jobTimerId, c_jobTimerInterval, 0);
+        }
+        return true;
+    }
+    return SUCCEEDED(pResult->hr) && pResult->returnValue == 0;
+}
 
-    TrayMessage(NIM_MODIFY, title, message, dwInfoFlags);
+static void ReportRequestFailure(const VmRequestResult* pResult, LPCWSTR title)
+{
+    WCHAR message[256];
+    if (FAILED(pResult->hr))
+        swprintf_s(message, L"%s: error 0x%08X", pResult->name.c_str(), pResult->hr);
+    else
+        swprintf_s(message, L"%s: error %u", pResult->name.c_str(), pResult->returnValue);
+    UpdateTrayIcon(title, message, NIIF_ERROR);
 }
 
-static void DeleteTrayIcon()
+static void OnRequestDone(VmRequestResult* pResult)
 {
-	if (s_isIconInstalled)
+    if (!TrackRequestJob(pResult))
     {
-        TrayMessage(NIM_DELETE);
-        s_isIconInstalled = false;
+        StopWatching(pResult->id, false/*finished*/);
+        ReportRequestFailure(pResult, L"VM State Change Failed");
+        OnAutostartFailed(pResult->id, L"The start request failed.");
     }
-}
 
-// Notifications.
+    delete pResult;
+}
 
-constexpr UINT c_timerId = 99;
-constexpr UINT c_timerFirstInterval = 500;
-constexpr UINT c_timerRepeatInterval = 2500;
-
-struct WatchForStateChanges
-{
-    WatchForStateChanges() = default;
-    WatchForStateChanges(VmState _original, VmState _target)
-        : original(_original)
-        , seen(_original)
-        , target(_target)
-        , changed(false)
-    {}
-
-    VmState original = VmState::Unknown;
-    VmState seen = VmState::Unknown;
-    VmState target = VmState::Unknown;
-    bool changed = false;
-};
+static void OnCheckpointDone(VmRequestResult* pResult)
+{
+    if (!TrackRequestJob(pResult))
+        ReportRequestFailure(pResult, L"Checkpoint Failed");
 
-static std::map<std::wstring, WatchForStateChanges> s_watching;
-static UINT s_nextInterval = c_timerFirstInterval;
+    delete pResult;
+}
 
-static void DoNotifications()
+static void OnJobStatus(JobStatusList* pList)
 {
-    auto vms = GetVirtualMachines();
-
-    std::wstring message;
-    for (const auto& vm : vms)
+    std::wstring tip;
+    for (const auto& status : *pList)
     {
-        auto& watching = s_watching.find(vm.name);
-        if (watching == s_watching.end())
-            continue;
-
-        ULONG state;
-        if (!GetIntegerProp(vm.vm, L"EnabledState", state))
-            continue;
-
-        auto& w = watching->second;
-        const VmState oldState = w.seen;
-        const VmState newState = VmState(state);
-
-        bool doErase = false;
+        // Any finished job may have been a checkpoint being created or
+        // applied, so refetch the VM's checkpoints next time.
+        if (status.done)
+            InvalidateCheckpoints(status.host, status.vmId);
 
-        if (oldState != newState)
+        if (status.failed)
         {
-            s_nextInterval = c_timerRepeatInterval;
-            w.seen = newState;
-            w.changed = true;
+            StopWatching(status.vmId, false/*finished*/);
 
-            doErase = (newState == w.target);
+            std::wstring message = status.vmName;
+            message.append(L": ");
+            if (!status.errorDescription.empty())
+                message.append(status.errorDescription);
+            else
+                message.append(L"the operation did not complete");
+            UpdateTrayIcon(L"VM Operation Failed", message.c_str(), NIIF_ERROR);
 
-            message = vm.name;
-            AppendStateString(message, newState, false/*brackets*/);
-            UpdateTrayIcon(L"VM State Changed", message.c_str());
+            OnAutostartFailed(status.vmId, status.errorDescription.empty() ? L"The start job failed." : status.errorDescription);
         }
-        else if (w.changed && (newState == VmState::Running ||
-                               newState == VmState::Stopped ||
-                               newState == VmState::Paused ||
-                               newState == VmState::Saved))
+        else if (!status.done)
         {
-            doErase = true;
-        }
-
-        if (doErase)
-        {
-            s_watching.erase(vm.name);
-            if (s_watching.empty())
-                break;
+            WCHAR line[128];
+            swprintf_s(line, L"\n%s: %u%%", status.vmName.c_str(), status.percentComplete);
+            tip.append(line);
         }
     }
-}
-
-// Context menu.
-
-enum class VmOp { Connect, Start, Stop, ShutDown, Save, Pause };
-enum class MenuMode { Watching, LDown, Cancelled };
+    delete pList;
 
-static VirtualMachines s_vms;
-static HMENU s_hmenu = 0;
-static bool s_inContextMenu = false;
-static INT s_menuSelectIndex = -1;
-static INT s_menuDownIndex = -1;
-static MenuMode s_menuMode = MenuMode::Watching;
-static RECT s_menuItemRect;
+    s_jobTip = std::move(tip);
+    UpdateTip();
 
-static DWORD EnableFlags(bool enable)
-{
-    return enable ? MF_ENABLED : MF_DISABLED;
+    if (!HasTrackedJobs())
+        KillTimer(s_hwndMain, c_jobTimerId);
 }
 
-static HMENU BuildContextMenu(const VirtualMachines vms)
+// Applying a checkpoint discards the VM's current state, so it's confirmed
+// first, the same as in Hyper-V Manager.
+static void DoApplyCheckpoint(UINT index)
 {
-    HMENU hmenu = CreatePopupMenu();
-    if (hmenu)
-    {
-        std::wstring name;
-        ULONG state;
-        for (UINT i = 0; i < vms.size(); ++i)
-        {
-            if (!GetIntegerProp(vms[i].vm, L"EnabledState", state))
-                continue;
-
-            VmState vmstate = VmState(state);
-
-            name.clear();
-            if (i + 1 <= 9)
-            {
-                WCHAR prefix[] = { '&', WCHAR('1' + i), ' ', '-', ' ', '\0' };
-                name = prefix;
-            }
-            name += vms[i].name;
-            AppendStateString(name, vmstate, true/*brackets*/);
-
-            const UINT idmBase = IDM_FIRSTVM + (i * 10);
-            const UINT idmPopup = idmBase + WORD(VmOp::Connect);
-            AppendMenuW(hmenu, MF_POPUP, idmPopup, name.c_str());
-
-            bool enableStart = true;
-            bool enableStop = true;
-            bool enableSave = true;
-            bool enablePause = true;
-            switch (vmstate)
-            {
-            case VmState::Running:
-                enableStart = false;
-                break;
-            case VmState::Saved:
-            case VmState::ShutDown:
-            case VmState::Stopped:
-                enableStop = false;
-                enableSave = false;
-                enablePause = false;
-                break;
-            case VmState::Paused:
-                enablePause = false;
-                break;
-            }
+    if (index >= s_checkpointCommands.size())
+        return;
 
-            HMENU hmenuSub = CreatePopupMenu();
-            AppendMenuW(hmenuSub, MF_STRING, idmBase + WORD(VmOp::Connect), L"&Connect");
-            AppendMenuW(hmenuSub, MF_STRING|EnableFlags(enableStart), idmBase + WORD(VmOp::Start), L"Sta&rt");
-            AppendMenuW(hmenuSub, MF_STRING|EnableFlags(enableStop), idmBase + WORD(VmOp::Stop), L"St&op");
-            AppendMenuW(hmenuSub, MF_STRING, idmBase + WORD(VmOp::ShutDown), L"Shut&Down");
-            AppendMenuW(hmenuSub, MF_STRING|EnableFlags(enableSave), idmBase + WORD(VmOp::Save), L"Sa&ve State");
-            AppendMenuW(hmenuSub, MF_STRING|EnableFlags(enablePause), idmBase + WORD(VmOp::Pause), L"&Pause");
+    const auto& command = s_checkpointCommands[index];
+    const VmSnapshot* pVm = FindVmBySlot(command.slot);
+    if (!pVm || !(GetEnabledOps(pVm->state) & OpBit(VmOp::ApplyCheckpoint)))
+        return;
 
-            MENUITEMINFOW mii = { sizeof(mii) };
-            mii.fMask = MIIM_SUBMENU;
-            mii.hSubMenu = hmenuSub;
-            SetMenuItemInfoW(hmenu, idmPopup, false, &mii);
-        }
-        AppendMenuW(hmenu, MF_SEPARATOR, -1, L"");
-        AppendMenuW(hmenu, 0, IDM_MANAGER, L"Hyper-V &Manager");
-        AppendMenuW(hmenu, MF_SEPARATOR, -1, L"");
-        AppendMenuW(hmenu, 0, IDM_EXIT, L"E&xit");
-    }
+    std::wstring message(L"Apply checkpoint \"");
+    message.append(command.name);
+    message.append(L"\" to \"");
+    message.append(pVm->name);
+    message.append(L"\"?\n\nThe virtual machine's current state will be lost.");
+    if (MessageBoxW(s_hwndMain, message.c_str(), L"HyperVTray", MB_OKCANCEL|MB_ICONWARNING|MB_DEFBUTTON2) != IDOK)
+        return;
 
-    return hmenu;
+    ApplyCheckpoint(s_hwndMain, WMU_CHECKPOINTDONE, *pVm, command.path);
 }
 
 static void DoCommand(UINT id)
@@ -268,37 +1374,44 @@ static void DoCommand(UINT id)
     {
         LaunchManager(s_hwndMain);
     }
+    else if (id == IDM_STARTALL || id == IDM_SAVEALL || id == IDM_SHUTDOWNALL)
+    {
+        DoBulkCommand(id);
+    }
+    else if (id == IDM_CLEARSELECTION)
+    {
+        s_selected.Clear();
+    }
+    else if (id >= IDM_FIRSTCHECKPOINT && id < IDM_FIRSTVM)
+    {
+        DoApplyCheckpoint(id - IDM_FIRSTCHECKPOINT);
+    }
     else if (id >= IDM_FIRSTVM)
     {
-        const UINT index = (id - IDM_FIRSTVM) / 10;
-        if (index < s_vms.size())
+        const VmSnapshot* pVm = FindVmBySlot((id - IDM_FIRSTVM) / 10);
+        if (pVm)
         {
-            const auto& vm = s_vms[index];
+            const auto& vm = *pVm;
 
             const VmOp op = VmOp((id - IDM_FIRSTVM) % 10);
-            VmState requestedState = VmState::Unknown;
-
-            switch (VmOp((id - IDM_FIRSTVM) % 10))
-            {
-            case VmOp::Connect:     VmConnect(vm.vm); break;
-            case VmOp::Start:       requestedState = VmState::Running; break;
-            case VmOp::Stop:        requestedState = VmState::Stopped; break;
-            case VmOp::ShutDown:    requestedState = VmState::ShutDown; break;
-            case VmOp::Save:        requestedState = VmState::Saved; break;
-            case VmOp::Pause:       requestedState = VmState::Paused; break;
-            }
-
-            if (requestedState != VmState::Unknown)
+            switch (op)
             {
-                ULONG state;
-                if (GetIntegerProp(vm.vm, L"EnabledState", state))
-                {
-                    s_watching[vm.name] = { VmState(state), requestedState };
-                    s_nextInterval = c_timerFirstInterval;
-                    SetTimer(s_hwndMain, c_timerId, s_nextInterval, 0);
-                }
-
-                ChangeVmState(vm.vm, requestedState);
+            case VmOp::Connect:
+                VmConnect(vm);
+                break;
+            case VmOp::Select:
+                if (!s_selected.Erase(vm.id))
+                    s_selected[vm.id] = true;
+                break;
+            case VmOp::Checkpoint:
+                if (GetEnabledOps(vm.state) & OpBit(op))
+                    CreateCheckpoint(s_hwndMain, WMU_CHECKPOINTDONE, vm);
+                break;
+            default:
+                // The VM may have changed state since the menu was built.
+                if (GetOpTarget(op) != VmState::Unknown && (GetEnabledOps(vm.state) & OpBit(op)))
+                    RequestStateChange(vm, GetOpTarget(op));
+                break;
             }
         }
     }
@@ -306,17 +1419,20 @@ static void DoCommand(UINT id)
 
 static void OnMenuSelect(WPARAM wParam, LPARAM lParam)
 {
-    s_menuSelectIndex = -1;
+    s_menuSelectSlot = -1;
 
     const WORD flags = HIWORD(wParam);
     if (flags & MF_POPUP)
     {
         const UINT index = LOWORD(wParam);
-        if (index < s_vms.size())
+
+        MENUITEMINFOW mii = { sizeof(mii) };
+        mii.fMask = MIIM_ID;
+        if (GetMenuItemInfoW(HMENU(lParam), index, true, &mii) && mii.wID >= IDM_FIRSTVM)
         {
             if (GetMenuItemRect(0, HMENU(lParam), index, &s_menuItemRect))
             {
-                s_menuSelectIndex = index;
+                s_menuSelectSlot = (mii.wID - IDM_FIRSTVM) / 10;
             }
         }
     }
@@ -326,13 +1442,16 @@ static void OnEnterIdle(WPARAM wParam, LPARAM lParam)
 {
     if (wParam == MSGF_MENU)
     {
+        if (s_clickTime.QuadPart)
+            ReportMenuLatency();
+
         POINT pt;
         if (!GetCursorPos(&pt))
         {
 LCancel:
             s_menuMode = MenuMode::Cancelled;
-            s_menuSelectIndex = -1;
-            s_menuDownIndex = -1;
+            s_menuSelectSlot = -1;
+            s_menuDownSlot = -1;
             return;
         }
 
@@ -340,38 +1459,48 @@ LCancel:
         if (fDown)
         {
             if (s_menuMode == MenuMode::Cancelled ||
-                (s_menuMode == MenuMode::LDown && s_menuDownIndex != s_menuSelectIndex) ||
+                (s_menuMode == MenuMode::LDown && s_menuDownSlot != s_menuSelectSlot) ||
                 !PtInRect(&s_menuItemRect, pt))
                 goto LCancel;
-            s_menuDownIndex = s_menuSelectIndex;
+            s_menuDownSlot = s_menuSelectSlot;
             s_menuMode = MenuMode::LDown;
         }
-        else if (s_menuSelectIndex < 0 || !PtInRect(&s_menuItemRect, pt))
+        else if (s_menuSelectSlot < 0 || !PtInRect(&s_menuItemRect, pt))
         {
             s_menuMode = MenuMode::Watching;
-            s_menuDownIndex = -1;
+            s_menuDownSlot = -1;
         }
-        else if (s_menuMode == MenuMode::LDown && s_menuDownIndex == s_menuSelectIndex)
+        else if (s_menuMode == MenuMode::LDown && s_menuDownSlot == s_menuSelectSlot)
         {
-            assert(s_menuDownIndex >= 0);
+            assert(s_menuDownSlot >= 0);
             SendMessage(s_hwndMain, WM_CANCELMODE, 0, 0);
-            if (UINT(s_menuDownIndex) < s_vms.size())
-                VmConnect(s_vms[s_menuDownIndex].vm);
+            if (const VmSnapshot* pVm = FindVmBySlot(s_menuDownSlot))
+                VmConnect(*pVm);
             goto LCancel;
         }
     }
 }
 
+constexpr DWORD c_firstMenuWait = 3000;
+
 static void DoContextMenu(HWND hwnd)
 {
-    s_vms = GetVirtualMachines();
+    // Render from the cached list, if there is one, and refresh it in the
+    // background.  Only the very first menu has to wait for WMI, and then only
+    // for a little while; hosts that answer later show up via the refresher.
 
-    s_hmenu = BuildContextMenu(s_vms);
+    if ((s_vms = GetCachedVirtualMachines()))
+        RequestRefresh();
+    else
+        s_vms = WaitForVirtualMachines(c_firstMenuWait);
+
+    s_menu.model = BuildMenuModel(*s_vms, s_slots);
+    s_hmenu = BuildContextMenu(s_menu);
     if (!s_hmenu)
         return;
 
-    s_menuSelectIndex = -1;
-    s_menuDownIndex = -1;
+    s_menuSelectSlot = -1;
+    s_menuDownSlot = -1;
     s_menuMode = MenuMode::Watching;
 
     // Workaround:  due to a well-known issue in Windows, the menu won't
@@ -382,7 +1511,11 @@ static void DoContextMenu(HWND hwnd)
 
     POINT pt;
     GetCursorPos(&pt);
-    const UINT id = TrackPopupMenu(s_hmenu, TPM_LEFTALIGN|TPM_RIGHTBUTTON|TPM_RETURNCMD, pt.x, pt.y, 0, hwnd, NULL);
+    UINT id;
+    {
+        TraceSpan span("TrackPopupMenu");
+        id = TrackPopupMenu(s_hmenu, TPM_LEFTALIGN|TPM_RIGHTBUTTON|TPM_RETURNCMD, pt.x, pt.y, 0, hwnd, NULL);
+    }
 
     s_inContextMenu = false;
 
@@ -392,10 +1525,17 @@ static void DoContextMenu(HWND hwnd)
 
     DestroyMenu(s_hmenu);
     s_hmenu = 0;
+    s_hmenuCheckpoints = 0;
+
+    // Free the command slots of VMs that are gone.  The VM for the chosen
+    // command is in the model, so its slot survives until DoCommand.
+    s_slots.Retain(s_menu.model);
+    s_menu.Clear();
 
     DoCommand(id);
 
-    s_vms.clear();
+    s_checkpointCommands.clear();
+    s_vms.reset();
 }
 
 static LRESULT CALLBACK HiddenWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
@@ -412,7 +1552,19 @@ static LRESULT CALLBACK HiddenWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARA
             case WM_LBUTTONDBLCLK:
                 break;
 
+            case WM_MOUSEMOVE:
+                {
+                    // Speculatively refresh when the mouse hovers over the
+                    // icon, so the list is current if the menu is opened.
+                    ULONGLONG age;
+                    GetCachedVirtualMachines(&age);
+                    if (age > c_prefetchAge)
+                        RequestRefresh();
+                }
+                break;
+
             case WM_RBUTTONUP:
+                QueryPerformanceCounter(&s_clickTime);
                 DoContextMenu(hwnd);
                 break;
 
@@ -422,6 +1574,12 @@ static LRESULT CALLBACK HiddenWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARA
         }
         break;
 
+    case WM_INITMENUPOPUP:
+        OnInitMenuPopup(s_menu, HMENU(wParam));
+        break;
+    case WM_UNINITMENUPOPUP:
+        OnUninitMenuPopup(HMENU(wParam));
+        break;
     case WM_MENUSELECT:
         OnMenuSelect(wParam, lParam);
         break;
@@ -429,28 +1587,96 @@ static LRESULT CALLBACK HiddenWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARA
         OnEnterIdle(wParam, lParam);
         break;
 
+    case WMU_VMSTATECHANGED:
+        OnStateEvent(wParam, lParam);
+        break;
+    case WMU_VMREQUESTDONE:
+        OnRequestDone(reinterpret_cast<VmRequestResult*>(lParam));
+        break;
+    case WMU_CHECKPOINTDONE:
+        OnCheckpointDone(reinterpret_cast<VmRequestResult*>(lParam));
+        break;
+    case WMU_CHECKPOINTSFETCHED:
+        OnCheckpointsFetched();
+        break;
+    case WMU_JOBSTATUS:
+        OnJobStatus(reinterpret_cast<JobStatusList*>(lParam));
+        break;
+    case WMU_SUBSCRIBED:
+        s_watcher.SetSubscribed(SUCCEEDED(HRESULT(wParam)));
+        SchedulePoll();
+        break;
+    case WMU_VMSREFRESHED:
+        {
+            const VmListPtr vms = GetCachedVirtualMachines();
+            if (vms)
+            {
+                if (s_startTime.QuadPart)
+                {
+                    ReportStartupTime("Startup(first menu ready)", L"first menu ready");
+                    s_startTime.QuadPart = 0;
+                }
+                if (s_watcher.NeedsPolling())
+                    DoNotifications(*vms);
+                UpdateContextMenu(vms);
+                UpdateTrayBadge(*vms);
+                AdvanceAutostart(*vms);
+                SaveLastKnownVirtualMachines();
+            }
+        }
+        break;
+
+    case WMU_VMSPOLLED:
+        {
+            VirtualMachines* const pVms = reinterpret_cast<VirtualMachines*>(lParam);
+            if (s_watcher.NeedsPolling())
+                DoNotifications(*pVms);
+            delete pVms;
+        }
+        break;
+
+    case WM_DISPLAYCHANGE:
+        InitTrayBadge();
+        break;
+
     case WM_TIMER:
-        if (wParam == c_timerId)
+        if (wParam == c_jobTimerId)
+        {
+            if (!PollJobs())
+                KillTimer(hwnd, c_jobTimerId);
+        }
+        else if (wParam == c_timerId)
         {
-            if (!s_inContextMenu)
+            DoPoll();
+        }
+        else if (wParam == c_autostartTimerId)
+        {
+            // Timeouts still apply while a host isn't answering.
+            if (!RequestRefresh())
             {
-                DoNotifications();
-                SetTimer(hwnd, c_timerId, s_nextInterval, 0);
+                if (const VmListPtr vms = GetCachedVirtualMachines())
+                    AdvanceAutostart(*vms);
             }
-            if (s_watching.empty())
-                KillTimer(hwnd, c_timerId);
         }
         break;
 
     case WM_DESTROY:
-        s_vms.clear();
+        CancelWmiCalls();
+        UnsubscribeStateChanges();
+        UnsubscribeCheckpointChanges();
+        s_vms.reset();
         DeleteTrayIcon();
+        s_hiconTray = 0;
+        s_badges.Clear();
         s_hwndMain = 0;
         break;
 
     default:
         if (uMsg == c_msgTaskbarCreated)
         {
+            // The icon went away with the old taskbar.
+            s_isIconInstalled = false;
+            InitTrayBadge();
             AddTrayIcon();
             break;
         }
@@ -460,6 +1686,187 @@ static LRESULT CALLBACK HiddenWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARA
     return 0;
 }
 
+// Benchmark.
+//
+// Times the UI-side hot paths against a synthetic VM list, so regressions can
+// be measured without a Hyper-V host.  Everything runs on local data, never
+// the tray's own menu, and fixtures are built before the timing starts.  The
+// Win32-free modules have their own portable benchmark (bench/bench.cpp).
+
+static VirtualMachines MakeSyntheticVms(UINT count, UINT seed)
+{
+    static const VmState c_states[] =
+    {
+        VmState::Running, VmState::Stopped, VmState::Saved, VmState::Paused,
+        VmState::Starting, VmState::Saving, VmState::Stopping,
+    };
+
+    VirtualMachines vms;
+    vms.reserve(count);
+    for (UINT i = 0; i < count; ++i)
+    {
+        WCHAR tmp[256];
+        VmSnapshot vm;
+        swprintf_s(tmp, L"%08X-0000-0000-0000-%012u", i * 2654435761u, i);
+        vm.id = tmp;
+        swprintf_s(tmp, L"Synthetic VM %05u", (i * 7919) % count);
+        vm.name = tmp;
+        swprintf_s(tmp, L"\\\\localhost\\root\\virtualization\\v2:Msvm_ComputerSystem.CreationClassName=\"Msvm_ComputerSystem\",Name=\"%s\"", vm.id.c_str());
+        vm.path = tmp;
+        vm.state = c_states[(i + seed) % _countof(c_states)];
+        vms.emplace_back(std::move(vm));
+    }
+    return vms;
+}
+
+struct BenchStats
+{
+    double p50;
+    double p99;
+    ULONGLONG allocs;
+};
+
+// Calls func(i) for each iteration i.
+template<class F>
+static BenchStats RunBench(UINT iterations, F&& func)
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+
+    std::vector<double> samples;
+    samples.reserve(iterations);
+
+    ULONGLONG allocs = 0;
+    for (UINT i = 0; i < iterations; ++i)
+    {
+        BeginCountingAllocs();
+        LARGE_INTEGER begin, end;
+        QueryPerformanceCounter(&begin);
+        func(i);
+        QueryPerformanceCounter(&end);
+        allocs += EndCountingAllocs();
+
+        samples.push_back(double(end.QuadPart - begin.QuadPart) * 1000 / double(freq.QuadPart));
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    BenchStats stats;
+    stats.p50 = samples[samples.size() / 2];
+    stats.p99 = samples[std::min<size_t>(samples.size() - 1, samples.size() * 99 / 100)];
+    stats.allocs = iterations ? allocs / iterations : 0;
+    return stats;
+}
+
+static void AppendBenchLine(std::wstring& out, LPCWSTR name, UINT count, const BenchStats& stats)
+{
+    WCHAR line[256];
+    swprintf_s(line, L"%-16s %5u VMs   p50 %9.3f ms   p99 %9.3f ms   %6llu allocs/op\n", name, count, stats.p50, stats.p99, stats.allocs);
+    out.append(line);
+}
+
+static std::wstring RunBenchmarks()
+{
+    static const UINT c_counts[] = { 10, 100, 1000, 5000 };
+    constexpr UINT c_iterations = 50;
+
+    std::wstring out;
+    for (const UINT count : c_counts)
+    {
+        const VirtualMachines before = MakeSyntheticVms(count, 0);
+        VirtualMachines after = MakeSyntheticVms(count, 0);
+        for (UINT i = 0; i < count; i += 10)
+            after[i].state = VmState::Saving;
+
+        CommandSlots slots(c_maxSlots);
+
+        // Enumeration:  the work the refresher does after WMI returns.  Each
+        // iteration sorts its own unsorted copy, made ahead of time.
+        {
+            std::vector<VirtualMachines> unsorted(c_iterations, MakeSyntheticVms(count, 0));
+            AppendBenchLine(out, L"enumerate", count, RunBench(c_iterations, [&](UINT i) {
+                std::sort(unsorted[i].begin(), unsorted[i].end(), &VmSnapshot::less);
+            }));
+        }
+
+        // Menu build:  model plus HMENU construction and teardown.
+        AppendBenchLine(out, L"build menu", count, RunBench(c_iterations, [&](UINT) {
+            MenuState menu;
+            menu.model = BuildMenuModel(before, slots);
+            const HMENU hmenu = BuildContextMenu(menu);
+            DestroyMenu(hmenu);
+        }));
+
+        // USER objects held by a freshly built menu, and the cost of opening
+        // one VM's popup.
+        {
+            MenuState menu;
+            const DWORD base = GetGuiResources(GetCurrentProcess(), GR_USEROBJECTS);
+            menu.model = BuildMenuModel(before, slots);
+            const HMENU hmenu = BuildContextMenu(menu);
+            const DWORD held = GetGuiResources(GetCurrentProcess(), GR_USEROBJECTS) - base;
+
+            HMENU hmenuVm = 0;
+            menu.popups.ForEach([&](HMENU h, const MenuPopup& popup) {
+                if (popup.kind == PopupKind::Vm && !hmenuVm)
+                    hmenuVm = h;
+            });
+            LARGE_INTEGER begin, end, freq;
+            QueryPerformanceFrequency(&freq);
+            QueryPerformanceCounter(&begin);
+            if (hmenuVm)
+                OnInitMenuPopup(menu, hmenuVm);
+            QueryPerformanceCounter(&end);
+
+            DestroyMenu(hmenu);
+
+            WCHAR line[256];
+            swprintf_s(line, L"%-16s %5u VMs   %6u USER objects   open VM popup %.3f ms\n", L"menu handles", count, held,
+                       double(end.QuadPart - begin.QuadPart) * 1000 / double(freq.QuadPart));
+            out.append(line);
+        }
+
+        // State strings for every VM.
+        AppendBenchLine(out, L"state strings", count, RunBench(c_iterations, [&](UINT) {
+            std::wstring text;
+            for (const auto& vm : before)
+            {
+                text = vm.name;
+                AppendStateString(text, vm.state, true/*brackets*/);
+            }
+        }));
+
+        // Menu update:  what happens to an open menu when a refreshed list
+        // arrives, alternating between the two lists so every iteration has
+        // changes to apply.
+        {
+            MenuState menu;
+            menu.model = BuildMenuModel(before, slots);
+            const HMENU hmenu = BuildContextMenu(menu);
+
+            // Open the VMs' own popups too, so enable states get updated.
+            std::vector<HMENU> vmPopups;
+            menu.popups.ForEach([&](HMENU h, const MenuPopup& popup) {
+                if (popup.kind == PopupKind::Vm)
+                    vmPopups.push_back(h);
+            });
+            for (HMENU h : vmPopups)
+                OnInitMenuPopup(menu, h);
+
+            std::vector<MenuChange> changes;
+            AppendBenchLine(out, L"menu update", count, RunBench(c_iterations, [&](UINT i) {
+                ApplyMenuChanges(menu, hmenu, BuildMenuModel((i & 1) ? before : after, slots), changes);
+            }));
+
+            DestroyMenu(hmenu);
+        }
+
+        out.append(L"\n");
+    }
+
+    return out;
+}
+
 // Hidden main window.
 
 static bool Init()
@@ -487,31 +1894,42 @@ static bool Init()
     if (!s_hwndMain)
         return false;
 
-    // Initialize COM.
+    InitTrayBadge();
+    AddTrayIcon();
+    ReportStartupTime("Startup(icon visible)", L"icon visible");
+
+    // Initialize COM and COM security on this thread; the rest happens in
+    // the background.
 
-    HRESULT hr = CoInitializeEx(0, COINIT_MULTITHREADED);
-    if (SUCCEEDED(hr))
-        hr = CoInitializeSecurity(
-            NULL,                        // Security descriptor
-            -1,                          // COM negotiates authentication service
-            NULL,                        // Authentication services
-            NULL,                        // Reserved
-            RPC_C_AUTHN_LEVEL_DEFAULT,   // Default authentication level for proxies
-            RPC_C_IMP_LEVEL_IMPERSONATE, // Default Impersonation level for proxies
-            NULL,                        // Authentication info
-            EOAC_NONE,                   // Additional capabilities of the client or server
-            NULL);                       // Reserved
-    if (FAILED(hr))
+    CoInitializeEx(0, COINIT_MULTITHREADED);
+    s_hrComSecurity = InitComSecurity();
+    if (FAILED(s_hrComSecurity))
     {
         // TODO: somehow report the error?
     }
 
+    InitRefresher(s_hwndMain, WMU_VMSREFRESHED);
+    InitStateChanges(s_hwndMain, WMU_VMREQUESTDONE, s_concurrency);
+    InitCheckpoints(s_hwndMain, WMU_CHECKPOINTSFETCHED);
+    InitJobTracker(s_hwndMain, WMU_JOBSTATUS);
+
+    if (s_grouping == MenuGrouping::Tag)
+        LoadTags();
+
+    // Until the first refresh finishes, the menu shows the last known VMs.
+    if (LoadLastKnownVirtualMachines())
+        ReportStartupTime("Startup(last known menu ready)", L"last known menu ready");
+
+    if (!TrySubmitThreadpoolCallback(StartupCallback, nullptr, nullptr))
+        StartupCallback(nullptr, nullptr);
+
     return true;
 }
 
 int PASCAL WinMain(HINSTANCE hinstCurrent, HINSTANCE /*hinstPrevious*/, LPSTR /*lpszCmdLine*/, int /*nCmdShow*/)
 {
     s_hinst = hinstCurrent;
+    QueryPerformanceCounter(&s_startTime);
 
     int argc;
     const WCHAR **argv = const_cast<const WCHAR**>(CommandLineToArgvW(GetCommandLine(), &argc));
@@ -525,6 +1943,10 @@ int PASCAL WinMain(HINSTANCE hinstCurrent, HINSTANCE /*hinstPrevious*/, LPSTR /*
     // Parse options.
 
     bool fAllowDarkMode = true;
+    LPCWSTR traceFile = nullptr;
+    HeadlessOptions headless;
+    std::vector<std::wstring> hosts;
+    AutostartProfile autostart;
 
     while (argc)
     {
@@ -539,22 +1961,142 @@ int PASCAL WinMain(HINSTANCE hinstCurrent, HINSTANCE /*hinstPrevious*/, LPSTR /*
             return 0;
         }
 
+        if (_wcsicmp(argv[0], L"/benchmark") == 0 ||
+            _wcsicmp(argv[0], L"--benchmark") == 0)
+        {
+            const std::wstring results = RunBenchmarks();
+            OutputDebugStringW(results.c_str());
+            MessageBoxW(0, results.c_str(), L"HyperVTray Benchmark", MB_OK|MB_ICONINFORMATION);
+            return 0;
+        }
+
         if (_wcsicmp(argv[0], L"/nodarkmode") == 0 ||
             _wcsicmp(argv[0], L"--nodarkmode") == 0)
         {
             fAllowDarkMode = false;
         }
+        else if (_wcsicmp(argv[0], L"/list") == 0 ||
+                 _wcsicmp(argv[0], L"--list") == 0)
+        {
+            headless.list = true;
+        }
+        else if (_wcsicmp(argv[0], L"/json") == 0 ||
+                 _wcsicmp(argv[0], L"--json") == 0)
+        {
+            headless.json = true;
+        }
+        else if (argc > 1 &&
+                 (_wcsicmp(argv[0], L"/start") == 0 ||
+                  _wcsicmp(argv[0], L"--start") == 0))
+        {
+            --argc, ++argv;
+            headless.start = argv[0];
+        }
+        else if (argc > 1 &&
+                 (_wcsicmp(argv[0], L"/save") == 0 ||
+                  _wcsicmp(argv[0], L"--save") == 0))
+        {
+            --argc, ++argv;
+            headless.save = argv[0];
+        }
+        else if (argc > 1 &&
+                 (_wcsicmp(argv[0], L"/wait") == 0 ||
+                  _wcsicmp(argv[0], L"--wait") == 0) &&
+                 ParseWaitState(argv[1], headless.wait))
+        {
+            --argc, ++argv;
+        }
+        else if (argc > 1 &&
+                 (_wcsicmp(argv[0], L"/timeout") == 0 ||
+                  _wcsicmp(argv[0], L"--timeout") == 0))
+        {
+            --argc, ++argv;
+            headless.timeout = wcstoul(argv[0], nullptr, 10);
+        }
+        else if (argc > 1 &&
+                 (_wcsicmp(argv[0], L"/trace") == 0 ||
+                  _wcsicmp(argv[0], L"--trace") == 0))
+        {
+            --argc, ++argv;
+            traceFile = argv[0];
+            EnableTracing();
+        }
+        else if (argc > 1 &&
+                 (_wcsicmp(argv[0], L"/group") == 0 ||
+                  _wcsicmp(argv[0], L"--group") == 0) &&
+                 (_wcsicmp(argv[1], L"state") == 0 ||
+                  _wcsicmp(argv[1], L"tag") == 0 ||
+                  _wcsicmp(argv[1], L"none") == 0))
+        {
+            --argc, ++argv;
+            if (_wcsicmp(argv[0], L"state") == 0)
+                s_grouping = MenuGrouping::State;
+            else if (_wcsicmp(argv[0], L"tag") == 0)
+                s_grouping = MenuGrouping::Tag;
+            else
+                s_grouping = MenuGrouping::None;
+        }
+        else if (argc > 1 &&
+                 (_wcsicmp(argv[0], L"/host") == 0 ||
+                  _wcsicmp(argv[0], L"--host") == 0))
+        {
+            --argc, ++argv;
+            hosts.emplace_back(argv[0]);
+        }
+        else if (argc > 1 &&
+                 (_wcsicmp(argv[0], L"/pagesize") == 0 ||
+                  _wcsicmp(argv[0], L"--pagesize") == 0))
+        {
+            --argc, ++argv;
+            s_pageSize = std::min<UINT>(std::max<UINT>(wcstoul(argv[0], nullptr, 10), 2), 100);
+        }
+        else if (argc > 1 &&
+                 (_wcsicmp(argv[0], L"/autostart") == 0 ||
+                  _wcsicmp(argv[0], L"--autostart") == 0))
+        {
+            --argc, ++argv;
+            std::wstring error;
+            if (!LoadAutostartProfile(argv[0], autostart, error))
+            {
+                std::wstring message = L"Unable to use autostart profile \"";
+                message.append(argv[0]);
+                message.append(L"\".\n\n");
+                message.append(error);
+                MessageBox(0, message.c_str(), L"HyperVTray", MB_OK|MB_ICONERROR);
+                return 1;
+            }
+        }
+        else if (argc > 1 &&
+                 (_wcsicmp(argv[0], L"/concurrency") == 0 ||
+                  _wcsicmp(argv[0], L"--concurrency") == 0))
+        {
+            --argc, ++argv;
+            s_concurrency = std::max<ULONG>(wcstoul(argv[0], nullptr, 10), 1);
+        }
         else
         {
-            WCHAR message[1024];
-            swprintf_s(message, L"Unrecognized argument \"%s\".\n\n%s", argv[0], c_usage);
-            MessageBox(0, message, L"HyperVTray", MB_OK|MB_ICONERROR);
+            std::wstring message(L"Unrecognized argument \"");
+            message.append(argv[0]);
+            message.append(L"\".\n\n");
+            message.append(c_usage);
+            MessageBox(0, message.c_str(), L"HyperVTray", MB_OK|MB_ICONERROR);
             return 1;
         }
 
         --argc, ++argv;
     }
 
+    // Headless commands skip the window, tray icon, and message loop, and
+    // don't participate in the single instance mutex.
+
+    if (headless.Any())
+    {
+        const int ret = RunHeadless(headless);
+        if (traceFile)
+            WriteTrace(traceFile);
+        return ret;
+    }
+
     if (fAllowDarkMode)
         AllowDarkMode();
 
@@ -578,6 +2120,8 @@ int PASCAL WinMain(HINSTANCE hinstCurrent, HINSTANCE /*hinstPrevious*/, LPSTR /*
 
     // Initialize the app.
 
+    SetHosts(hosts);
+
     MSG msg = { 0 };
 
     if (!Init())
@@ -586,7 +2130,8 @@ int PASCAL WinMain(HINSTANCE hinstCurrent, HINSTANCE /*hinstPrevious*/, LPSTR /*
         goto LError;
     }
 
-    AddTrayIcon();
+    if (!autostart.empty())
+        StartAutostart(autostart);
 
     // Main message loop.
 
@@ -607,6 +2152,9 @@ int PASCAL WinMain(HINSTANCE hinstCurrent, HINSTANCE /*hinstPrevious*/, LPSTR /*
     }
 
 LError:
+    if (traceFile)
+        WriteTrace(traceFile);
+
     ReleaseMutex(hMutex);
 
     return int(msg.wParam);
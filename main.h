@@ -142,6 +142,7 @@ class SH_RegCloseKey { protected: void Free(HKEY hkey) { RegCloseKey(hkey); } };
 class SH_DeleteObject { protected: void Free(HGDIOBJ hobj) { DeleteObject(hobj); } };
 class SH_DestroyCursor { protected: void Free(HCURSOR hcur) { DestroyCursor(hcur); } };
 class SH_DestroyIcon { protected: void Free(HICON hicon) { DestroyIcon(hicon); } };
+class SH_DeleteDC { protected: void Free(HDC hdc) { DeleteDC(hdc); } };
 
 typedef SH<HANDLE, NULL, SH_CloseHandle> SHandle;
 typedef SH<HANDLE, DWORD_PTR(INVALID_HANDLE_VALUE), SH_CloseHandle> SFileHandle;
@@ -153,4 +154,5 @@ typedef SH<HBITMAP, NULL, SH_DeleteObject> SHBITMAP;
 typedef SH<HFONT, NULL, SH_DeleteObject> SHFONT;
 typedef SH<HCURSOR, NULL, SH_DestroyCursor> SHCURSOR;
 typedef SH<HICON, NULL, SH_DestroyIcon> SHICON;
+typedef SH<HDC, NULL, SH_DeleteDC> SHDC;
 
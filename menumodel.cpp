@@ -0,0 +1,127 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "menumodel.h"
+#include <algorithm>
+#include <cwchar>
+
+#ifndef _WIN32
+#define _wcsicmp wcscasecmp
+#endif
+
+bool DiffMenuModel(const MenuModel& before, const MenuModel& after, std::vector<MenuChange>& changes)
+{
+    changes.clear();
+
+    if (before.size() != after.size())
+        return false;
+
+    for (size_t i = 0; i < before.size(); ++i)
+    {
+        const auto& a = before[i];
+        const auto& b = after[i];
+        if (a.id != b.id)
+        {
+            changes.clear();
+            return false;
+        }
+
+        MenuChange change;
+        change.index = i;
+        change.text = (a.state != b.state || a.name != b.name || a.detail != b.detail);
+        change.enabled = (a.enabled ^ b.enabled);
+        if (change.text || change.enabled)
+            changes.emplace_back(change);
+    }
+
+    return true;
+}
+
+std::vector<MenuGroup> GroupMenuModel(MenuModel& model, bool grouped)
+{
+    std::vector<MenuGroup> groups;
+    FlatMap<std::wstring, size_t> lookup;
+    const std::wstring none;
+
+    for (size_t i = 0; i < model.size(); ++i)
+    {
+        const std::wstring& label = grouped ? model[i].group : none;
+
+        size_t group;
+        if (const size_t* found = lookup.Find(label))
+        {
+            group = *found;
+        }
+        else
+        {
+            group = groups.size();
+            lookup[label] = group;
+            groups.emplace_back();
+            groups.back().label = label;
+        }
+
+        model[i].position = unsigned(groups[group].entries.size());
+        groups[group].entries.push_back(i);
+    }
+
+    std::sort(groups.begin(), groups.end(), [](const MenuGroup& a, const MenuGroup& b) {
+        if (a.label.empty() != b.label.empty())
+            return b.label.empty();
+        return _wcsicmp(a.label.c_str(), b.label.c_str()) < 0;
+    });
+
+    return groups;
+}
+
+unsigned CommandSlots::Get(const std::wstring& id)
+{
+    if (const unsigned* found = m_slots.Find(id))
+        return *found;
+
+    unsigned slot;
+    if (!m_free.empty())
+    {
+        slot = m_free.back();
+        m_free.pop_back();
+    }
+    else if (m_ids.size() < m_capacity)
+    {
+        slot = unsigned(m_ids.size());
+        m_ids.emplace_back();
+    }
+    else
+    {
+        return c_none;
+    }
+
+    m_ids[slot] = id;
+    m_slots[id] = slot;
+    return slot;
+}
+
+const std::wstring* CommandSlots::Lookup(unsigned slot) const
+{
+    if (slot >= m_ids.size() || m_ids[slot].empty())
+        return nullptr;
+    return &m_ids[slot];
+}
+
+void CommandSlots::Retain(const MenuModel& model)
+{
+    std::vector<bool> keep(m_ids.size());
+    for (const auto& entry : model)
+    {
+        if (entry.slot < keep.size())
+            keep[entry.slot] = true;
+    }
+
+    for (unsigned slot = 0; slot < m_ids.size(); ++slot)
+    {
+        if (!keep[slot] && !m_ids[slot].empty())
+        {
+            m_slots.Erase(m_ids[slot]);
+            m_ids[slot].clear();
+            m_free.push_back(slot);
+        }
+    }
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "vmstate.h"
+#include "flatmap.h"
+#include <string>
+#include <vector>
+
+// What the context menu shows for one VM.  This has no dependency on Win32,
+// so the menu contents and the differences between two snapshots can be
+// computed without touching USER.
+struct VmMenuEntry
+{
+    std::wstring id;
+    std::wstring name;
+    VmState state = VmState::Unknown;
+    std::wstring detail;            // Resource usage shown after the state.
+    unsigned enabled = 0;           // OpBit() for each enabled VmOp.
+    bool selected = false;          // Included in bulk operations.
+    unsigned slot = 0;              // From CommandSlots; determines the command IDs.
+    std::wstring group;             // State or tag to group by.
+    unsigned position = 0;          // Index within its group, set by GroupMenuModel().
+};
+typedef std::vector<VmMenuEntry> MenuModel;
+
+// VMs that share a group label, in model order.
+struct MenuGroup
+{
+    std::wstring label;
+    std::vector<size_t> entries;    // Indices into the MenuModel.
+};
+
+// Assigns each VM a small number that stays the same for as long as the VM
+// is listed, so menu command IDs don't depend on the VM's position in the
+// menu.  Slots of VMs that are gone are reused by Retain().
+class CommandSlots
+{
+public:
+    static constexpr unsigned c_none = unsigned(-1);
+
+                    CommandSlots(unsigned capacity) : m_capacity(capacity) {}
+
+    unsigned        Get(const std::wstring& id);    // Returns c_none if all slots are in use.
+    const std::wstring* Lookup(unsigned slot) const;
+    void            Retain(const MenuModel& model);
+
+private:
+    const unsigned  m_capacity;
+    FlatMap<std::wstring, unsigned> m_slots;
+    std::vector<std::wstring> m_ids;                // Indexed by slot; empty if free.
+    std::vector<unsigned> m_free;
+};
+
+struct MenuChange
+{
+    size_t index;
+    bool text;                      // The name, state, or detail changed.
+    unsigned enabled;               // OpBit() for each VmOp whose enable state changed.
+};
+
+// Compares two models.  Returns false if the set or order of VMs differs, in
+// which case the menu can't be updated in place.  Otherwise fills changes with
+// only the entries that differ.
+bool DiffMenuModel(const MenuModel& before, const MenuModel& after, std::vector<MenuChange>& changes);
+
+// Partitions the model by each entry's group label, and sets each entry's
+// position.  Groups are sorted by label, with the unlabeled group last.  If
+// not grouped, everything goes into a single unlabeled group.
+std::vector<MenuGroup> GroupMenuModel(MenuModel& model, bool grouped);
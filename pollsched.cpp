@@ -0,0 +1,93 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "pollsched.h"
+#include <algorithm>
+
+// Until a transition has been observed, guess by the target state.  Pausing
+// is nearly instant, while saving has to write out all of the VM's memory.
+static unsigned long long GetDefaultExpected(VmState target)
+{
+    switch (target)
+    {
+    case VmState::Paused:   return 500;
+    case VmState::Running:  return 3000;
+    case VmState::Stopped:  return 5000;
+    case VmState::ShutDown: return 15000;
+    case VmState::Saved:    return 15000;
+    default:                return 2000;
+    }
+}
+
+static unsigned long long Clamp(unsigned long long interval)
+{
+    if (interval < PollScheduler::c_minInterval)
+        return PollScheduler::c_minInterval;
+    if (interval > PollScheduler::c_maxInterval)
+        return PollScheduler::c_maxInterval;
+    return interval;
+}
+
+unsigned long long PollScheduler::GetExpected(VmState original, VmState target) const
+{
+    return GetExpected(GetTransition(original, target));
+}
+
+unsigned long long PollScheduler::GetExpected(unsigned transition) const
+{
+    if (const unsigned long long* learned = m_learned.Find(transition))
+        return *learned;
+    return GetDefaultExpected(VmState(transition & 0xffff));
+}
+
+void PollScheduler::Watch(const std::wstring& id, VmState original, VmState target, unsigned long long now)
+{
+    Watched& w = m_watched[id];
+    w.transition = GetTransition(original, target);
+    w.started = now;
+
+    // Look first a bit before it's expected to finish, then back off from a
+    // quarter of the expected duration.
+    const unsigned long long expected = GetExpected(w.transition);
+    w.due = now + Clamp(expected * 3 / 4);
+    w.interval = Clamp(expected / 4);
+}
+
+void PollScheduler::Unwatch(const std::wstring& id, bool reachedTarget, unsigned long long now)
+{
+    const Watched* w = m_watched.Find(id);
+    if (!w)
+        return;
+
+    if (reachedTarget && now >= w->started)
+    {
+        // Exponential moving average, weighted 1/4 toward the new sample.
+        const unsigned long long duration = now - w->started;
+        unsigned long long& learned = m_learned[w->transition];
+        learned = learned ? (learned * 3 + duration) / 4 : duration;
+    }
+
+    m_watched.Erase(id);
+}
+
+void PollScheduler::TakeDue(unsigned long long now, std::vector<std::wstring>& due)
+{
+    m_watched.ForEach([&](const std::wstring& id, Watched& w) {
+        if (w.due > now)
+            return;
+
+        due.push_back(id);
+        w.due = now + w.interval;
+        w.interval = Clamp(w.interval * 2);
+    });
+}
+
+unsigned long long PollScheduler::NextDue() const
+{
+    unsigned long long next = 0;
+    m_watched.ForEach([&](const std::wstring&, const Watched& w) {
+        if (!next || w.due < next)
+            next = w.due;
+    });
+    return next;
+}
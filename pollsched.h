@@ -0,0 +1,57 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "vmstate.h"
+#include "flatmap.h"
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Poll scheduler for watched state changes.
+//
+// Each watched VM gets its own next poll time, based on how long the same
+// transition (original state to target state) has taken before.  The first
+// poll is near when the transition is expected to finish, and later polls
+// back off exponentially.  Observed durations are folded into a moving
+// average per transition.
+//
+// All times are caller-supplied milliseconds (e.g. GetTickCount64()), and
+// nothing here reads a clock, so the schedule is deterministic.
+
+class PollScheduler
+{
+public:
+    static constexpr unsigned long long c_minInterval = 250;
+    static constexpr unsigned long long c_maxInterval = 30000;
+
+    void            Watch(const std::wstring& id, VmState original, VmState target, unsigned long long now);
+    void            Unwatch(const std::wstring& id, bool reachedTarget, unsigned long long now);
+    bool            Empty() const { return m_watched.Empty(); }
+
+    // Appends the VMs that are due at now to due, and reschedules them, so
+    // they can all be fetched with a single query.
+    void            TakeDue(unsigned long long now, std::vector<std::wstring>& due);
+
+    // Time of the earliest scheduled poll, or 0 if nothing is watched.
+    unsigned long long NextDue() const;
+
+    // Expected duration of a transition, in milliseconds.
+    unsigned long long GetExpected(VmState original, VmState target) const;
+
+private:
+    struct Watched
+    {
+        unsigned        transition = 0;
+        unsigned long long started = 0;
+        unsigned long long due = 0;
+        unsigned long long interval = 0;
+    };
+
+    static unsigned GetTransition(VmState original, VmState target) { return (unsigned(original) << 16) | (unsigned(target) & 0xffff); }
+    unsigned long long GetExpected(unsigned transition) const;
+
+    FlatMap<std::wstring, Watched> m_watched;
+    FlatMap<unsigned, unsigned long long> m_learned;    // Average duration per transition.
+};
@@ -78,6 +78,35 @@ define_exe("hypervtray", "windowedapp")
         defines("_CRT_SECURE_NO_WARNINGS")
         defines("_CRT_NONSTDC_NO_WARNINGS")
 
+--------------------------------------------------------------------------------
+-- The Win32-free modules, which also build with `premake5 gmake` (or CMake)
+-- on Linux.
+local portable_files = {
+    "autostart.cpp",
+    "breaker.cpp",
+    "menumodel.cpp",
+    "pollsched.cpp",
+    "propvalues.cpp",
+    "requestqueue.cpp",
+    "session.cpp",
+    "statewatch.cpp",
+    "vmcache.cpp",
+    "vmstate.cpp",
+}
+
+filter {}
+define_exe("bench")
+    targetname("hypervtray_bench")
+    files(portable_files)
+    files("alloccount.cpp")
+    files("bench/*.cpp")
+
+define_exe("tests")
+    targetname("hypervtray_tests")
+    files(portable_files)
+    files("alloccount.cpp")
+    files("tests/*.cpp")
+
 
 
 --------------------------------------------------------------------------------
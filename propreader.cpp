@@ -0,0 +1,171 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "main.h"
+#include "propreader.h"
+
+PropertyReader::PropertyReader(const PropDef* table, size_t count)
+: m_table(table)
+, m_count(count)
+, m_handles(count)
+, m_values(count)
+{
+}
+
+// Property handles are the same for every instance of a class, so they're
+// looked up once, from the first object.
+void PropertyReader::ResolveHandles(IWbemObjectAccess* pAccess)
+{
+    m_resolved = true;
+
+    for (size_t i = 0; i < m_count; ++i)
+    {
+        // System properties such as __PATH are computed, so they go through
+        // Get.
+        if (m_table[i].name[0] == '_' && m_table[i].name[1] == '_')
+            continue;
+
+        CIMTYPE type;
+        long handle;
+        if (FAILED(pAccess->GetPropertyHandle(m_table[i].name, &type, &handle)))
+            continue;
+
+        // Anything else (arrays, datetimes, embedded objects) goes through Get.
+        bool usable;
+        switch (type)
+        {
+        case CIM_STRING:
+            usable = (m_table[i].type == PropType::String);
+            break;
+        case CIM_SINT8:
+        case CIM_UINT8:
+        case CIM_SINT16:
+        case CIM_UINT16:
+        case CIM_SINT32:
+        case CIM_UINT32:
+        case CIM_SINT64:
+        case CIM_UINT64:
+            usable = (m_table[i].type == PropType::Integer);
+            break;
+        default:
+            usable = false;
+            break;
+        }
+
+        m_handles[i].usable = usable;
+        m_handles[i].handle = handle;
+    }
+}
+
+bool PropertyReader::ReadByHandle(IWbemObjectAccess* pAccess, size_t index)
+{
+    const long handle = m_handles[index].handle;
+
+    if (m_table[index].type == PropType::Integer)
+    {
+        // Only as many bytes as the property's type are written, in
+        // little-endian order.
+        ULONGLONG value = 0;
+        long consumed = 0;
+        const HRESULT hr = pAccess->ReadPropertyValue(handle, sizeof(value), &consumed, reinterpret_cast<BYTE*>(&value));
+        if (hr != WBEM_S_NO_ERROR || consumed <= 0)
+            return false;
+        m_values.SetInteger(index, value);
+        return true;
+    }
+
+    // The value includes its terminating NUL; WBEM_S_FALSE means it's NULL.
+    return m_values.ReadString(index, [&](WCHAR* buffer, size_t room) -> size_t
+    {
+        long consumed = 0;
+        const HRESULT hr = pAccess->ReadPropertyValue(handle, long(room * sizeof(WCHAR)), &consumed, reinterpret_cast<BYTE*>(buffer));
+        if (hr != WBEM_S_NO_ERROR && hr != WBEM_E_BUFFER_TOO_SMALL)
+            return 0;
+        return size_t(consumed) / sizeof(WCHAR);
+    });
+}
+
+bool PropertyReader::ReadByName(IWbemClassObject* pObject, size_t index)
+{
+    const PropDef& def = m_table[index];
+    bool ok = false;
+
+    VARIANT vt;
+    VariantInit(&vt);
+
+    const HRESULT hr = pObject->Get(def.name, 0, &vt, 0, 0);
+    if (SUCCEEDED(hr))
+    {
+        if (def.type == PropType::String)
+        {
+            if (V_VT(&vt) == VT_BSTR && V_BSTR(&vt))
+            {
+                m_values.SetString(index, V_BSTR(&vt), SysStringLen(V_BSTR(&vt)));
+                ok = true;
+            }
+        }
+        else
+        {
+            ULONGLONG value = 0;
+            ok = true;
+            switch (V_VT(&vt))
+            {
+            case VT_BSTR:
+                // WMI passes uint64 and sint64 values as strings.
+                value = V_BSTR(&vt) ? _wcstoui64(V_BSTR(&vt), nullptr, 10) : 0;
+                ok = !!V_BSTR(&vt);
+                break;
+            case VT_I8:
+            case VT_UI8:
+                value = V_UI8(&vt);
+                break;
+            case VT_I4:
+            case VT_UI4:
+            case VT_INT:
+            case VT_UINT:
+                value = V_UI4(&vt);
+                break;
+            case VT_I2:
+            case VT_UI2:
+                value = V_UI2(&vt);
+                break;
+            case VT_I1:
+            case VT_UI1:
+                value = V_UI1(&vt);
+                break;
+            default:
+                ok = false;
+                break;
+            }
+            if (ok)
+                m_values.SetInteger(index, value);
+        }
+    }
+
+    VariantClear(&vt);
+    return ok;
+}
+
+bool PropertyReader::Read(IWbemClassObject* pObject)
+{
+    m_values.Clear();
+
+    SPQI<IWbemObjectAccess> spAccess;
+    spAccess.HrQuery(pObject);
+    if (spAccess && !m_resolved)
+        ResolveHandles(spAccess);
+
+    bool ok = true;
+    for (size_t i = 0; i < m_count; ++i)
+    {
+        bool present;
+        if (spAccess && m_handles[i].usable)
+            present = ReadByHandle(spAccess, i);
+        else
+            present = ReadByName(pObject, i);
+
+        if (!present && m_table[i].required)
+            ok = false;
+    }
+    return ok;
+}
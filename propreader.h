@@ -0,0 +1,61 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "main.h"
+#include "propvalues.h"
+#include <wbemidl.h>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Table-driven property reads.
+//
+// The properties to read from a class are listed in a constexpr table of
+// PropDef, and Read() fetches each of them exactly once per object, into
+// PropertyValues (see propvalues.h).  When the object supports
+// IWbemObjectAccess, values are copied straight out of it by property
+// handle, with no VARIANT or BSTR, and strings go straight into the arena;
+// otherwise IWbemClassObject::Get is used, which costs a VARIANT per value.
+// System properties such as __PATH always go through Get, so tables read in
+// a hot path leave them out.  A reader is meant to be used for one class, on
+// one thread, e.g. for the duration of an enumeration.
+
+class PropertyReader
+{
+public:
+    template<size_t N>
+    explicit        PropertyReader(const PropDef (&table)[N]) : PropertyReader(table, N) {}
+                    PropertyReader(const PropDef* table, size_t count);
+
+    // Returns false if a required property is missing.
+    bool            Read(IWbemClassObject* pObject);
+
+    bool            Has(size_t index) const { return m_values.Has(index); }
+    ULONGLONG       GetInteger(size_t index) const { return m_values.GetInteger(index); }
+
+    // The pointer is into the arena, and is valid until the next Read().
+    LPCWSTR         GetString(size_t index, size_t* pLength=nullptr) const { return m_values.GetString(index, pLength); }
+    // Assigns into out, reusing its capacity.
+    bool            GetString(size_t index, std::wstring& out) const { return m_values.GetString(index, out); }
+
+private:
+    struct Handle
+    {
+        bool        usable = false;
+        long        handle = 0;
+    };
+
+    void            ResolveHandles(IWbemObjectAccess* pAccess);
+    bool            ReadByHandle(IWbemObjectAccess* pAccess, size_t index);
+    bool            ReadByName(IWbemClassObject* pObject, size_t index);
+
+    const PropDef* const m_table;
+    const size_t    m_count;
+    std::vector<Handle> m_handles;
+    PropertyValues  m_values;
+    bool            m_resolved = false;
+
+    PropertyReader(const PropertyReader&) = delete;
+    PropertyReader& operator=(const PropertyReader&) = delete;
+};
@@ -0,0 +1,45 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "propvalues.h"
+
+void PropertyValues::Clear()
+{
+    // Clearing keeps the capacity.
+    m_arena.clear();
+    for (auto& slot : m_slots)
+        slot = Slot();
+}
+
+void PropertyValues::SetInteger(size_t index, unsigned long long value)
+{
+    Slot& slot = m_slots[index];
+    slot.present = true;
+    slot.value = value;
+}
+
+void PropertyValues::SetString(size_t index, const wchar_t* value, size_t length)
+{
+    Slot& slot = m_slots[index];
+    slot.present = true;
+    slot.offset = m_arena.length();
+    slot.length = length;
+    m_arena.append(value, length);
+    m_arena.push_back('\0');
+}
+
+const wchar_t* PropertyValues::GetString(size_t index, size_t* pLength) const
+{
+    const Slot& slot = m_slots[index];
+    if (pLength)
+        *pLength = slot.length;
+    return slot.present ? m_arena.c_str() + slot.offset : L"";
+}
+
+bool PropertyValues::GetString(size_t index, std::wstring& out) const
+{
+    size_t length;
+    const wchar_t* value = GetString(index, &length);
+    out.assign(value, length);
+    return m_slots[index].present;
+}
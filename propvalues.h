@@ -0,0 +1,104 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Property values read from one object, per a table of PropDef.
+//
+// Strings are stored back to back in an arena that's cleared, not freed,
+// from one object to the next, and ReadString() fills the arena in place.
+// Once the arena has grown to fit the longest object, reading another object
+// allocates nothing, and neither does copying its strings into ones that
+// already have room (see GetString(size_t, std::wstring&)).
+//
+// PropertyReader (propreader.h) fills these from WMI objects.
+
+enum class PropType { String, Integer };
+
+struct PropDef
+{
+    const wchar_t* name;
+    PropType type;
+    bool required;
+};
+
+class PropertyValues
+{
+public:
+    explicit        PropertyValues(size_t count) : m_slots(count) {}
+
+    // Starts the next object:  every value is missing until it's set.
+    void            Clear();
+
+    void            SetInteger(size_t index, unsigned long long value);
+    void            SetString(size_t index, const wchar_t* value, size_t length);
+
+    // Reads a string straight into the arena.  fill(buffer, room) is given
+    // room for room characters; it returns the number of characters the
+    // value needs including its terminating NUL (having written them if they
+    // fit), or 0 if the value is missing.  A value that doesn't fit is read
+    // again with exactly enough room.
+    template<class Fill>
+    bool            ReadString(size_t index, Fill fill);
+
+    bool            Has(size_t index) const { return m_slots[index].present; }
+    unsigned long long GetInteger(size_t index) const { return m_slots[index].value; }
+
+    // The pointer is into the arena, and is valid until the next Clear().
+    const wchar_t*  GetString(size_t index, size_t* pLength=nullptr) const;
+    // Assigns into out, reusing its capacity.
+    bool            GetString(size_t index, std::wstring& out) const;
+
+private:
+    // Room for a string whose length isn't known yet.
+    static constexpr size_t c_minStringRoom = 64;
+
+    struct Slot
+    {
+        bool        present = false;
+        size_t      offset = 0;
+        size_t      length = 0;
+        unsigned long long value = 0;
+    };
+
+    std::vector<Slot> m_slots;
+    std::wstring    m_arena;
+};
+
+template<class Fill>
+bool PropertyValues::ReadString(size_t index, Fill fill)
+{
+    Slot& slot = m_slots[index];
+    slot.present = false;
+    slot.offset = m_arena.length();
+    slot.length = 0;
+
+    // Read into whatever room the arena already has, so it grows only while
+    // it's still warming up.
+    size_t room = m_arena.capacity() - slot.offset;
+    if (room < c_minStringRoom)
+        room = c_minStringRoom;
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        m_arena.resize(slot.offset + room);
+        const size_t needed = fill(&m_arena[slot.offset], room);
+        if (!needed)
+            break;
+        if (needed <= room)
+        {
+            slot.present = true;
+            slot.length = needed - 1;
+            m_arena.resize(slot.offset + needed);
+            return true;
+        }
+        room = needed;
+    }
+
+    m_arena.resize(slot.offset);
+    return false;
+}
@@ -0,0 +1,51 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Refills a list in place.
+//
+// Next() hands out the elements left over from the last fill before adding
+// any, so whatever they own (e.g. a string's capacity) is reused by the
+// caller's assignments.  When the refill ends, the list is trimmed to what
+// was handed out.  Every field of an element must be assigned, since it may
+// still hold a value from the last fill.
+//
+//      Refill<T> refill(list);
+//      for (...each item)
+//      {
+//          T& t = refill.Next();
+//          if (!...fill t)
+//              refill.Unfill();
+//      }
+
+template<class T>
+class Refill
+{
+public:
+    explicit Refill(std::vector<T>& list) : m_list(list) {}
+    ~Refill() { m_list.resize(m_used); }
+
+    T& Next()
+    {
+        if (m_used == m_list.size())
+            m_list.emplace_back();
+        return m_list[m_used++];
+    }
+
+    // Gives back the element from the last Next(), e.g. if filling it failed.
+    void Unfill() { --m_used; }
+
+    size_t Count() const { return m_used; }
+
+private:
+    std::vector<T>& m_list;
+    size_t m_used = 0;
+
+    Refill(const Refill&) = delete;
+    Refill& operator=(const Refill&) = delete;
+};
@@ -0,0 +1,56 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <atomic>
+
+//----------------------------------------------------------------------------
+// Coalesces refresh requests for one host.
+//
+// At most one refresh of a host runs at a time.  A request that arrives while
+// one is running makes it go around once more, since its result may already
+// be stale; any number of such requests cost a single extra pass.  Each host
+// has its own gate, so a host that stalls never holds up the others.
+//
+//      if (gate.Request())
+//          ...start a refresh, which does:
+//          do
+//              ...refresh the host
+//          while (gate.Finish());
+
+class RefreshGate
+{
+public:
+    // True if the caller must start a refresh.
+    bool Request()
+    {
+        if (!m_running.exchange(true))
+            return true;
+        m_again.store(true);
+        return false;
+    }
+
+    // After each pass:  true if the refresh must go again.
+    bool Finish()
+    {
+        if (m_again.exchange(false))
+            return true;
+
+        m_running.store(false);
+
+        // A request that arrived just before running was cleared saw it set
+        // and only asked for another pass, so take that pass here, unless a
+        // new refresh has already started.
+        return m_again.exchange(false) && !m_running.exchange(true);
+    }
+
+    // Undoes Request() when the refresh couldn't be started.
+    void Abandon() { m_running.store(false); }
+
+    bool IsRunning() const { return m_running.load(); }
+
+private:
+    std::atomic<bool> m_running{ false };
+    std::atomic<bool> m_again{ false };
+};
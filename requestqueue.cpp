@@ -0,0 +1,69 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "requestqueue.h"
+#include <cassert>
+
+void RequestQueue::SetLimit(unsigned limit)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_limit = limit ? limit : 1;
+    }
+    Pump();
+}
+
+void RequestQueue::Push(void* request)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_pending.push_back(request);
+    }
+    Pump();
+}
+
+void RequestQueue::Finished()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        assert(m_inFlight);
+        --m_inFlight;
+    }
+    Pump();
+}
+
+unsigned RequestQueue::InFlight()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_inFlight;
+}
+
+size_t RequestQueue::Pending()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_pending.size();
+}
+
+// Requests are issued outside the lock, since issuing one may finish it
+// right away (e.g. if it can't be submitted).
+void RequestQueue::Pump()
+{
+    while (true)
+    {
+        void* request = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (m_inFlight < m_limit && !m_pending.empty())
+            {
+                request = m_pending.front();
+                m_pending.pop_front();
+                ++m_inFlight;
+            }
+        }
+
+        if (!request)
+            break;
+
+        m_issue(request, m_context);
+    }
+}
@@ -0,0 +1,46 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+
+//----------------------------------------------------------------------------
+// Queue of requests that are issued concurrently, with at most a limit in
+// flight at once.
+//
+// Push() queues a request, and issue(request, context) is called for it as
+// soon as there's room, possibly on the calling thread.  Issuing should only
+// start the request (e.g. submit it to a thread pool); whoever finishes it
+// must call Finished(), from any thread, which issues the next one.  Requests
+// are opaque to the queue, so this builds without Win32 and the tests can
+// issue them to a fake service.
+
+class RequestQueue
+{
+public:
+    typedef void (*IssueFunc)(void* request, void* context);
+
+                    RequestQueue(IssueFunc issue, void* context) : m_issue(issue), m_context(context) {}
+
+    void            SetLimit(unsigned limit);
+    void            Push(void* request);
+    void            Finished();
+
+    unsigned        InFlight();
+    size_t          Pending();
+
+private:
+    void            Pump();
+
+    const IssueFunc m_issue;
+    void* const     m_context;
+    std::mutex      m_lock;
+    std::deque<void*> m_pending;
+    unsigned        m_inFlight = 0;
+    unsigned        m_limit = 4;
+
+    RequestQueue(const RequestQueue&) = delete;
+    RequestQueue& operator=(const RequestQueue&) = delete;
+};
@@ -13,5 +13,10 @@
 
 #define IDM_EXIT                100
 #define IDM_MANAGER             101
-#define IDM_FIRSTVM             200
+#define IDM_STARTALL            102
+#define IDM_SAVEALL             103
+#define IDM_SHUTDOWNALL         104
+#define IDM_CLEARSELECTION      105
+#define IDM_FIRSTCHECKPOINT     1000    // Through IDM_FIRSTVM - 1.
+#define IDM_FIRSTVM             2000
 
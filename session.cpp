@@ -0,0 +1,75 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "session.h"
+
+SessionResult Session::GetConnection(Connection& out)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    // Only one caller connects, and not while holding the lock; the others
+    // wait for it and share its outcome rather than each trying in turn.
+    while (m_connecting)
+    {
+        const unsigned attempt = m_connectAttempts;
+        m_connected.wait(lock, [&]() { return m_connectAttempts != attempt; });
+        if (!m_connection && m_connectResult < 0)
+        {
+            out.reset();
+            return m_connectResult;
+        }
+    }
+
+    if (m_connection)
+    {
+        out = m_connection;
+        return 0;
+    }
+
+    m_connecting = true;
+    lock.unlock();
+
+    Connection connection;
+    const SessionResult result = m_backend.Connect(connection);
+
+    lock.lock();
+    m_connecting = false;
+    ++m_connectAttempts;
+    m_connectResult = result;
+    if (result >= 0)
+        m_connection = std::move(connection);
+    out = m_connection;
+    m_connected.notify_all();
+    return result;
+}
+
+void Session::Disconnect(const void* failed)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    // Only drop the connection if it's the one that failed; another thread
+    // may have already reconnected.
+    if (!failed || failed == m_connection.get())
+        m_connection.reset();
+}
+
+bool Session::IsResponding()
+{
+    std::lock_guard<std::mutex> lock(m_breakerLock);
+    return !m_breaker.IsOpen();
+}
+
+bool Session::AllowCall()
+{
+    std::lock_guard<std::mutex> lock(m_breakerLock);
+    return m_breaker.Allow(m_backend.Now());
+}
+
+void Session::RecordResult(SessionResult result)
+{
+    std::lock_guard<std::mutex> lock(m_breakerLock);
+    if (m_backend.TripsBreaker(result))
+        m_breaker.Failed(m_backend.Now());
+    else
+        m_breaker.Succeeded();
+}
@@ -0,0 +1,110 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "breaker.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+//----------------------------------------------------------------------------
+// Long-lived session with a service that can go away or stop responding.
+//
+// The connection is made on first use and then shared by every caller; one
+// caller connects while any others wait for it.  If a
+// call fails because the connection was lost (e.g. the service restarted),
+// the connection is discarded and the call is retried once on a fresh one.
+// Calls that don't respond trip a circuit breaker (see breaker.h); while it's
+// open, Call() fails immediately instead of waiting on the service.
+//
+// The service itself is behind SessionBackend:  WmiSession connects to WMI,
+// and the tests drive the session with a scripted fake.  Results are
+// HRESULTs (negative means failure), so this builds without Win32.
+
+typedef long SessionResult;
+
+class SessionBackend
+{
+public:
+    // Opaque to the session; the backend supplies the deleter.
+    typedef std::shared_ptr<void> Connection;
+
+    // Called without the session lock held; it should give up on its own
+    // rather than wait indefinitely, since other callers wait for it.
+    virtual SessionResult Connect(Connection& out) = 0;
+
+    // The connection was lost; reconnect and retry.
+    virtual bool    LostConnection(SessionResult result) const = 0;
+    // The service isn't responding; counts against the circuit breaker.
+    virtual bool    TripsBreaker(SessionResult result) const = 0;
+    // What Call() returns while the circuit breaker is open.
+    virtual SessionResult Refused() const = 0;
+
+    virtual unsigned long long Now() const = 0;
+
+protected:
+    ~SessionBackend() = default;
+};
+
+class Session
+{
+public:
+    typedef SessionBackend::Connection Connection;
+
+    explicit        Session(SessionBackend& backend) : m_backend(backend) {}
+
+    SessionResult   GetConnection(Connection& out);
+    void            Disconnect(const void* failed=nullptr);
+
+    template<class F>
+    SessionResult   Call(F&& func);
+
+    bool            IsResponding();
+
+private:
+    bool            AllowCall();
+    void            RecordResult(SessionResult result);
+
+private:
+    SessionBackend& m_backend;
+    std::mutex      m_lock;
+    Connection      m_connection;
+    std::condition_variable m_connected;
+    bool            m_connecting = false;
+    unsigned        m_connectAttempts = 0;
+    SessionResult   m_connectResult = 0;
+    std::mutex      m_breakerLock;
+    CircuitBreaker  m_breaker;
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+};
+
+// Runs func(const Connection&) -> SessionResult, reconnecting and retrying
+// once if the connection was lost.  A failure to connect is recorded like a
+// failed call, so a trial call that can't reconnect reopens the breaker.
+template<class F>
+SessionResult Session::Call(F&& func)
+{
+    if (!AllowCall())
+        return m_backend.Refused();
+
+    SessionResult result;
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        Connection connection;
+        result = GetConnection(connection);
+        if (result < 0)
+            break;
+
+        result = func(static_cast<const Connection&>(connection));
+        if (!m_backend.LostConnection(result))
+            break;
+
+        Disconnect(connection.get());
+    }
+
+    RecordResult(result);
+    return result;
+}
@@ -0,0 +1,63 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "statewatch.h"
+
+void StateWatcher::Watch(const std::wstring& id, const std::wstring& name, VmState original, VmState target, unsigned long long now)
+{
+    Watched& w = m_watching[id];
+    w.name = name;
+    w.seen = original;
+    w.target = target;
+    w.changed = false;
+    m_polls.Watch(id, original, target, now);
+}
+
+StateWatcher::Observed StateWatcher::Observe(const std::wstring& id, const std::wstring& name, VmState state, unsigned long long now)
+{
+    Observed observed;
+
+    Watched* const w = m_watching.Find(id);
+    if (!w)
+    {
+        observed.finished = true;
+        return observed;
+    }
+
+    w->name = name;
+
+    if (w->seen != state)
+    {
+        w->seen = state;
+        w->changed = true;
+        observed.changed = true;
+        observed.finished = (state == w->target);
+    }
+    else if (w->changed && IsStableState(state))
+    {
+        // It settled somewhere other than the target (e.g. the request
+        // failed partway).
+        observed.finished = true;
+    }
+
+    if (observed.finished)
+        Unwatch(id, true/*finished*/, now);
+    return observed;
+}
+
+void StateWatcher::Unwatch(const std::wstring& id, bool finished, unsigned long long now)
+{
+    m_polls.Unwatch(id, finished, now);
+    m_watching.Erase(id);
+}
+
+unsigned long long StateWatcher::NextPoll() const
+{
+    return m_subscribed ? 0 : m_polls.NextDue();
+}
+
+void StateWatcher::TakeDue(unsigned long long now, std::vector<std::wstring>& due)
+{
+    if (!m_subscribed)
+        m_polls.TakeDue(now, due);
+}
@@ -0,0 +1,65 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "vmstate.h"
+#include "flatmap.h"
+#include "pollsched.h"
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// Watches VMs through the state changes requested from the menu, to notify
+// as each one changes state and finishes.
+//
+// States are observed from WMI events while subscribed, and otherwise by
+// polling on the PollScheduler's schedule.  The scheduler also learns how
+// long each kind of transition takes, even when events make polling
+// unnecessary.
+//
+// VMs are keyed by their Name GUID, which is unique and immutable (unlike the
+// ElementName, which can be duplicated or renamed mid-operation).  All times
+// are caller-supplied milliseconds, and nothing here reads a clock, so the
+// event source can be simulated.
+
+class StateWatcher
+{
+public:
+    struct Observed
+    {
+        bool        changed = false;    // Notify about the new state.
+        bool        finished = false;   // No longer watched.
+    };
+
+    void            Watch(const std::wstring& id, const std::wstring& name, VmState original, VmState target, unsigned long long now);
+    Observed        Observe(const std::wstring& id, const std::wstring& name, VmState state, unsigned long long now);
+    // Stops watching; only a finished transition teaches the scheduler.
+    void            Unwatch(const std::wstring& id, bool finished, unsigned long long now);
+
+    bool            IsWatching(const std::wstring& id) const { return m_watching.Contains(id); }
+    bool            Empty() const { return m_watching.Empty(); }
+
+    // While subscribed to events, nothing is polled.
+    void            SetSubscribed(bool subscribed) { m_subscribed = subscribed; }
+    bool            IsSubscribed() const { return m_subscribed; }
+    bool            NeedsPolling() const { return !m_subscribed && !m_watching.Empty(); }
+
+    // Time of the next poll, or 0 if none is needed.  TakeDue() appends the
+    // VMs to query now.
+    unsigned long long NextPoll() const;
+    void            TakeDue(unsigned long long now, std::vector<std::wstring>& due);
+
+private:
+    struct Watched
+    {
+        std::wstring    name;           // Latest ElementName, for messages.
+        VmState         seen = VmState::Unknown;
+        VmState         target = VmState::Unknown;
+        bool            changed = false;
+    };
+
+    FlatMap<std::wstring, Watched> m_watching;
+    PollScheduler   m_polls;
+    bool            m_subscribed = false;
+};
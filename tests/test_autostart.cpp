@@ -0,0 +1,273 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../autostart.h"
+#include <algorithm>
+#include <random>
+
+// The simulation advances in steps of this long, like the app's refreshes.
+constexpr unsigned long long c_step = 1000;
+
+// A simulated VM.  Once started it's running after bootTime, and its
+// heartbeat is OK heartbeatTime after that.
+struct SimVm
+{
+    std::wstring name;
+    unsigned long long bootTime = 0;
+    unsigned long long heartbeatTime = 0;
+    bool startFails = false;        // The start request is rejected.
+
+    bool started = false;
+    unsigned long long startedAt = 0;
+    bool ready = false;
+    unsigned long long readyAt = 0;
+};
+
+static const AutostartVm& Find(const AutostartPlan& plan, const std::wstring& name)
+{
+    for (const auto& vm : plan.GetVms())
+    {
+        if (vm.name == name)
+            return vm;
+    }
+    static const AutostartVm c_none;
+    return c_none;
+}
+
+static SimVm& Find(std::vector<SimVm>& vms, const std::wstring& name)
+{
+    for (auto& vm : vms)
+    {
+        if (vm.name == name)
+            return vm;
+    }
+    static SimVm s_none;
+    return s_none;
+}
+
+// Drives the plan the way the app does:  report what each started VM is
+// doing, start whatever is startable, then let the plan time things out.
+// Returns when the plan is done, or at the limit.
+static unsigned long long Run(AutostartPlan& plan, std::vector<SimVm>& vms, unsigned long long limit)
+{
+    unsigned long long now = 0;
+    for (; now <= limit && !plan.Done(); now += c_step)
+    {
+        for (const auto& vm : vms)
+        {
+            if (!vm.started)
+                continue;
+            const bool running = (now >= vm.startedAt + vm.bootTime);
+            const bool heartbeat = (now >= vm.startedAt + vm.bootTime + vm.heartbeatTime);
+            plan.Observe(vm.name, running, heartbeat, now);
+        }
+
+        std::vector<std::wstring> startable;
+        plan.GetStartable(now, startable);
+        for (const auto& name : startable)
+        {
+            SimVm& vm = Find(vms, name);
+            CHECK(!vm.started);
+            plan.Start(name, now);
+            if (vm.startFails)
+            {
+                plan.Fail(name, L"Start failed.", now);
+                continue;
+            }
+            vm.started = true;
+            vm.startedAt = now;
+        }
+
+        plan.Tick(now);
+
+        for (auto& vm : vms)
+        {
+            if (!vm.ready && Find(plan, vm.name).step == AutostartStep::Ready)
+            {
+                vm.ready = true;
+                vm.readyAt = now;
+            }
+        }
+    }
+    return now;
+}
+
+static AutostartGroup MakeGroup(const std::wstring& name, const std::wstring& after=std::wstring())
+{
+    AutostartGroup group;
+    group.name = name;
+    if (!after.empty())
+        group.after.push_back(after);
+    return group;
+}
+
+// Adds a VM to the profile's last group and to the simulation.
+static SimVm& AddVm(AutostartProfile& profile, std::vector<SimVm>& vms, const std::wstring& name, unsigned long long bootTime, unsigned long long heartbeatTime)
+{
+    profile.back().vms.push_back(name);
+    SimVm vm;
+    vm.name = name;
+    vm.bootTime = bootTime;
+    vm.heartbeatTime = heartbeatTime;
+    vms.push_back(vm);
+    return vms.back();
+}
+
+// A chain of tiers, each after the one before, with random boot times well
+// within the timeout.  tiers[i] lists the simulated VMs in tier i.
+static AutostartProfile MakeRandomTiers(std::mt19937& rng, std::vector<SimVm>& vms, std::vector<std::vector<size_t>>& tiers)
+{
+    std::uniform_int_distribution<unsigned> tierCount(2, 5);
+    std::uniform_int_distribution<unsigned> vmCount(1, 6);
+    std::uniform_int_distribution<unsigned> boot(1000, 60000);
+    std::uniform_int_distribution<unsigned> heartbeat(0, 30000);
+    std::uniform_int_distribution<unsigned> coin(0, 1);
+
+    AutostartProfile profile;
+    const unsigned count = tierCount(rng);
+    for (unsigned t = 0; t < count; ++t)
+    {
+        const std::wstring name = L"tier" + std::to_wstring(t);
+        profile.push_back(MakeGroup(name, t ? profile.back().name : std::wstring()));
+        if (coin(rng))
+            profile.back().wait = AutostartWait::Running;
+
+        tiers.emplace_back();
+        const unsigned n = vmCount(rng);
+        for (unsigned i = 0; i < n; ++i)
+        {
+            tiers.back().push_back(vms.size());
+            AddVm(profile, vms, name + L"-vm" + std::to_wstring(i), boot(rng), heartbeat(rng));
+        }
+    }
+    return profile;
+}
+
+TEST(autostart, RandomTiersStartInOrder)
+{
+    for (unsigned seed = 0; seed < 50; ++seed)
+    {
+        std::mt19937 rng(seed);
+        std::vector<SimVm> vms;
+        std::vector<std::vector<size_t>> tiers;
+        AutostartPlan plan(MakeRandomTiers(rng, vms, tiers));
+
+        Run(plan, vms, 60 * 60 * 1000);
+
+        CHECK(plan.Done());
+        CHECK(plan.GetProgress().ready == vms.size());
+        CHECK(plan.GetProgress().failed == 0);
+
+        // No VM in a tier starts before every VM in the tier before it is
+        // ready, and VMs in one tier start together.
+        for (size_t t = 1; t < tiers.size(); ++t)
+        {
+            unsigned long long lastReady = 0;
+            for (size_t i : tiers[t - 1])
+                lastReady = std::max<unsigned long long>(lastReady, vms[i].readyAt);
+            for (size_t i : tiers[t])
+                CHECK(vms[i].started && vms[i].startedAt == lastReady);
+        }
+
+        // A group that only waits for running doesn't wait for heartbeats.
+        for (size_t t = 0; t < tiers.size(); ++t)
+        {
+            const bool running = (plan.GetProfile()[t].wait == AutostartWait::Running);
+            for (size_t i : tiers[t])
+            {
+                const unsigned long long wait = vms[i].bootTime + (running ? 0 : vms[i].heartbeatTime);
+                CHECK(vms[i].readyAt >= vms[i].startedAt + wait);
+                CHECK(vms[i].readyAt < vms[i].startedAt + wait + c_step);
+            }
+        }
+    }
+}
+
+TEST(autostart, SlowVmTimesOut)
+{
+    AutostartProfile profile;
+    std::vector<SimVm> vms;
+    profile.push_back(MakeGroup(L"a"));
+    profile.back().timeout = 60000;
+    AddVm(profile, vms, L"never-runs", 90000, 0);
+    AddVm(profile, vms, L"no-heartbeat", 10000, 90000);
+    AddVm(profile, vms, L"fine", 10000, 10000);
+
+    AutostartPlan plan(profile);
+    const unsigned long long finished = Run(plan, vms, 60 * 60 * 1000);
+
+    CHECK(plan.Done());
+    CHECK(finished <= 60000 + 2 * c_step);
+    CHECK(Find(plan, L"never-runs").step == AutostartStep::Failed);
+    CHECK(Find(plan, L"never-runs").reason == L"Didn't start in time.");
+    CHECK(Find(plan, L"no-heartbeat").step == AutostartStep::Failed);
+    CHECK(Find(plan, L"no-heartbeat").reason == L"The heartbeat wasn't OK in time.");
+    CHECK(Find(plan, L"fine").step == AutostartStep::Ready);
+}
+
+TEST(autostart, FailedDependencySkipsEverythingAfterIt)
+{
+    AutostartProfile profile;
+    std::vector<SimVm> vms;
+    profile.push_back(MakeGroup(L"a"));
+    AddVm(profile, vms, L"a1", 5000, 5000);
+    AddVm(profile, vms, L"a2", 5000, 5000).startFails = true;
+    profile.push_back(MakeGroup(L"b", L"a"));
+    AddVm(profile, vms, L"b1", 5000, 5000);
+    profile.push_back(MakeGroup(L"c", L"b"));
+    AddVm(profile, vms, L"c1", 5000, 5000);
+    profile.push_back(MakeGroup(L"other"));
+    AddVm(profile, vms, L"o1", 5000, 5000);
+
+    AutostartPlan plan(profile);
+    Run(plan, vms, 60 * 60 * 1000);
+
+    CHECK(plan.Done());
+    CHECK(Find(plan, L"a1").step == AutostartStep::Ready);
+    CHECK(Find(plan, L"a2").step == AutostartStep::Failed);
+    CHECK(Find(plan, L"b1").step == AutostartStep::Skipped);
+    CHECK(Find(plan, L"b1").reason == L"[a] failed.");
+    CHECK(Find(plan, L"c1").step == AutostartStep::Skipped);
+    CHECK(Find(plan, L"o1").step == AutostartStep::Ready);
+    CHECK(!Find(vms, L"b1").started);
+    CHECK(!Find(vms, L"c1").started);
+}
+
+TEST(autostart, RandomTimeoutSkipsLaterTiers)
+{
+    for (unsigned seed = 0; seed < 50; ++seed)
+    {
+        std::mt19937 rng(seed);
+        std::vector<SimVm> vms;
+        std::vector<std::vector<size_t>> tiers;
+        AutostartProfile profile = MakeRandomTiers(rng, vms, tiers);
+
+        // One VM somewhere never finishes booting.
+        const size_t slowTier = std::uniform_int_distribution<size_t>(0, tiers.size() - 1)(rng);
+        const size_t slow = tiers[slowTier][std::uniform_int_distribution<size_t>(0, tiers[slowTier].size() - 1)(rng)];
+        vms[slow].bootTime = profile[slowTier].timeout * 2;
+
+        // A group with no dependencies isn't held up by it.
+        profile.push_back(MakeGroup(L"independent"));
+        AddVm(profile, vms, L"independent-vm", 5000, 5000);
+
+        AutostartPlan plan(profile);
+        Run(plan, vms, 60 * 60 * 1000);
+
+        CHECK(plan.Done());
+        CHECK(Find(plan, vms[slow].name).step == AutostartStep::Failed);
+        CHECK(Find(plan, L"independent-vm").step == AutostartStep::Ready);
+        for (size_t t = 0; t < tiers.size(); ++t)
+        {
+            for (size_t i : tiers[t])
+            {
+                const AutostartStep step = Find(plan, vms[i].name).step;
+                if (t < slowTier || (t == slowTier && i != slow))
+                    CHECK(step == AutostartStep::Ready);
+                else if (t > slowTier)
+                    CHECK(step == AutostartStep::Skipped && !vms[i].started);
+            }
+        }
+    }
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../breaker.h"
+
+// Fails enough times in a row to open a closed breaker.
+static void Trip(CircuitBreaker& breaker, unsigned long long now)
+{
+    for (unsigned i = 0; i < CircuitBreaker::c_threshold; ++i)
+        breaker.Failed(now);
+}
+
+TEST(breaker, ClosedAllowsCalls)
+{
+    CircuitBreaker breaker;
+    CHECK(!breaker.IsOpen());
+    CHECK(breaker.Allow(0));
+    CHECK(breaker.Allow(0));
+}
+
+TEST(breaker, OpensAfterThresholdFailures)
+{
+    CircuitBreaker breaker;
+    for (unsigned i = 0; i + 1 < CircuitBreaker::c_threshold; ++i)
+        breaker.Failed(1000);
+    CHECK(!breaker.IsOpen());
+    CHECK(breaker.Allow(1000));
+
+    breaker.Failed(1000);
+    CHECK(breaker.IsOpen());
+    CHECK(!breaker.Allow(1000));
+}
+
+TEST(breaker, SuccessResetsFailureCount)
+{
+    CircuitBreaker breaker;
+    for (unsigned i = 0; i + 1 < CircuitBreaker::c_threshold; ++i)
+        breaker.Failed(1000);
+    breaker.Succeeded();
+    for (unsigned i = 0; i + 1 < CircuitBreaker::c_threshold; ++i)
+        breaker.Failed(1000);
+    CHECK(!breaker.IsOpen());
+}
+
+TEST(breaker, RefusesUntilBackoffPasses)
+{
+    CircuitBreaker breaker;
+    Trip(breaker, 1000);
+
+    CHECK(!breaker.Allow(1000 + CircuitBreaker::c_minBackoff - 1));
+    CHECK(breaker.Allow(1000 + CircuitBreaker::c_minBackoff));
+    CHECK(breaker.IsOpen());
+}
+
+TEST(breaker, OnlyOneTrialWhenHalfOpen)
+{
+    CircuitBreaker breaker;
+    Trip(breaker, 0);
+
+    const unsigned long long later = CircuitBreaker::c_minBackoff;
+    CHECK(breaker.Allow(later));
+    CHECK(!breaker.Allow(later));
+    CHECK(!breaker.Allow(later + CircuitBreaker::c_maxBackoff));
+}
+
+TEST(breaker, TrialSuccessCloses)
+{
+    CircuitBreaker breaker;
+    Trip(breaker, 0);
+
+    CHECK(breaker.Allow(CircuitBreaker::c_minBackoff));
+    breaker.Succeeded();
+    CHECK(!breaker.IsOpen());
+    CHECK(breaker.Allow(CircuitBreaker::c_minBackoff));
+
+    // It takes the full threshold to open again, with the initial backoff.
+    for (unsigned i = 0; i + 1 < CircuitBreaker::c_threshold; ++i)
+        breaker.Failed(10000);
+    CHECK(!breaker.IsOpen());
+    breaker.Failed(10000);
+    CHECK(!breaker.Allow(10000 + CircuitBreaker::c_minBackoff - 1));
+    CHECK(breaker.Allow(10000 + CircuitBreaker::c_minBackoff));
+}
+
+TEST(breaker, TrialFailureDoublesBackoffUpToMax)
+{
+    CircuitBreaker breaker;
+    unsigned long long now = 0;
+    Trip(breaker, now);
+
+    unsigned long long backoff = CircuitBreaker::c_minBackoff;
+    for (int i = 0; i < 20; ++i)
+    {
+        CHECK(!breaker.Allow(now + backoff - 1));
+        now += backoff;
+        CHECK(breaker.Allow(now));
+        breaker.Failed(now);
+        CHECK(breaker.IsOpen());
+
+        backoff *= 2;
+        if (backoff > CircuitBreaker::c_maxBackoff)
+            backoff = CircuitBreaker::c_maxBackoff;
+    }
+    CHECK(backoff == CircuitBreaker::c_maxBackoff);
+}
+
+TEST(breaker, LateFailuresDontExtendBackoff)
+{
+    CircuitBreaker breaker;
+    Trip(breaker, 0);
+
+    // Calls that were in flight when it opened fail afterwards.
+    breaker.Failed(4000);
+    breaker.Failed(4500);
+    CHECK(breaker.Allow(CircuitBreaker::c_minBackoff));
+}
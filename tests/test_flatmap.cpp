@@ -0,0 +1,163 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../flatmap.h"
+#include <cwchar>
+#include <map>
+#include <string>
+
+static std::wstring MakeId(unsigned i)
+{
+    wchar_t tmp[64];
+    swprintf(tmp, 64, L"%08X-0000-0000-0000-%012u", i * 2654435761u, i);
+    return tmp;
+}
+
+// Puts every key in one of a few homes, so probe runs are long and wrap
+// around the end of the table.
+struct CollidingHash
+{
+    size_t operator()(unsigned key) const { return (key % 3) * 5 + 13; }
+};
+
+// Small deterministic generator, so failures reproduce.
+static unsigned Random(unsigned& seed)
+{
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 8;
+}
+
+TEST(flatmap, InsertFindErase)
+{
+    FlatMap<std::wstring, int> map;
+    CHECK(map.Empty());
+    CHECK(!map.Find(L"a"));
+    CHECK(!map.Erase(L"a"));
+
+    map[L"a"] = 1;
+    map[L"b"] = 2;
+    CHECK(map.Size() == 2);
+    CHECK(*map.Find(L"a") == 1);
+    CHECK(map.Contains(L"b"));
+
+    CHECK(map.Erase(L"a"));
+    CHECK(!map.Contains(L"a"));
+    CHECK(map.Size() == 1);
+
+    map.Clear();
+    CHECK(map.Empty());
+    CHECK(!map.Find(L"b"));
+}
+
+TEST(flatmap, DuplicateKeysShareOneEntry)
+{
+    FlatMap<std::wstring, int> map;
+    map[L"same"] = 1;
+    map[L"same"] += 1;
+    CHECK(map.Size() == 1);
+    CHECK(*map.Find(L"same") == 2);
+}
+
+TEST(flatmap, VmsWithDuplicateNamesKeyedById)
+{
+    // Names can repeat; ids can't.  A map from id to name keeps both VMs.
+    FlatMap<std::wstring, std::wstring> names;
+    for (unsigned i = 0; i < 100; ++i)
+        names[MakeId(i)] = L"Same Name";
+    CHECK(names.Size() == 100);
+
+    unsigned count = 0;
+    names.ForEach([&](const std::wstring&, const std::wstring& name) {
+        count += (name == L"Same Name");
+    });
+    CHECK(count == 100);
+}
+
+TEST(flatmap, ThousandsOfVms)
+{
+    constexpr unsigned c_count = 5000;
+
+    FlatMap<std::wstring, unsigned> map;
+    for (unsigned i = 0; i < c_count; ++i)
+        map[MakeId(i)] = i;
+    CHECK(map.Size() == c_count);
+
+    unsigned found = 0;
+    for (unsigned i = 0; i < c_count; ++i)
+    {
+        const unsigned* value = map.Find(MakeId(i));
+        found += (value && *value == i);
+    }
+    CHECK(found == c_count);
+
+    // Erase every other VM; the rest are still found.
+    for (unsigned i = 0; i < c_count; i += 2)
+        CHECK(map.Erase(MakeId(i)));
+    CHECK(map.Size() == c_count / 2);
+
+    unsigned wrong = 0;
+    for (unsigned i = 0; i < c_count; ++i)
+        wrong += (map.Contains(MakeId(i)) != (i % 2 == 1));
+    CHECK(wrong == 0);
+}
+
+TEST(flatmap, EraseKeepsCollidingKeysReachable)
+{
+    FlatMap<unsigned, unsigned, CollidingHash> map;
+    for (unsigned i = 0; i < 10; ++i)
+        map[i] = i * 10;
+
+    // Erasing from the middle of a probe run must not cut it short.
+    CHECK(map.Erase(3));
+    CHECK(map.Erase(0));
+    for (unsigned i = 0; i < 10; ++i)
+    {
+        const unsigned* value = map.Find(i);
+        if (i == 0 || i == 3)
+            CHECK(!value);
+        else
+            CHECK(value && *value == i * 10);
+    }
+}
+
+TEST(flatmap, MatchesStdMapUnderChurn)
+{
+    FlatMap<unsigned, unsigned, CollidingHash> colliding;
+    FlatMap<unsigned, unsigned> map;
+    std::map<unsigned, unsigned> reference;
+
+    unsigned seed = 1;
+    unsigned mismatches = 0;
+    for (unsigned step = 0; step < 20000; ++step)
+    {
+        const unsigned key = Random(seed) % 200;
+        if (Random(seed) % 3)
+        {
+            map[key] = step;
+            colliding[key] = step;
+            reference[key] = step;
+        }
+        else
+        {
+            const bool erased = (reference.erase(key) != 0);
+            mismatches += (map.Erase(key) != erased);
+            mismatches += (colliding.Erase(key) != erased);
+        }
+    }
+
+    CHECK(mismatches == 0);
+    CHECK(map.Size() == reference.size());
+    CHECK(colliding.Size() == reference.size());
+    for (unsigned key = 0; key < 200; ++key)
+    {
+        const auto it = reference.find(key);
+        const unsigned* value = map.Find(key);
+        const unsigned* value2 = colliding.Find(key);
+        if (it == reference.end())
+            mismatches += (value != nullptr) + (value2 != nullptr);
+        else
+            mismatches += !(value && *value == it->second) + !(value2 && *value2 == it->second);
+    }
+    CHECK(mismatches == 0);
+}
@@ -0,0 +1,162 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../menumodel.h"
+
+static VmMenuEntry MakeEntry(const wchar_t* id, const wchar_t* name, VmState state, const wchar_t* group=L"")
+{
+    VmMenuEntry entry;
+    entry.id = id;
+    entry.name = name;
+    entry.state = state;
+    entry.enabled = GetEnabledOps(state);
+    entry.group = group;
+    return entry;
+}
+
+static MenuModel MakeModel()
+{
+    return {
+        MakeEntry(L"1", L"alpha", VmState::Running),
+        MakeEntry(L"2", L"beta", VmState::Stopped),
+        MakeEntry(L"3", L"gamma", VmState::Saved),
+    };
+}
+
+TEST(menumodel, DiffIdenticalHasNoChanges)
+{
+    const MenuModel model = MakeModel();
+    std::vector<MenuChange> changes(1);
+    CHECK(DiffMenuModel(model, model, changes));
+    CHECK(changes.empty());
+}
+
+TEST(menumodel, DiffReportsOnlyChangedEntries)
+{
+    const MenuModel before = MakeModel();
+    MenuModel after = before;
+    after[1].state = VmState::Starting;
+    after[1].enabled = GetEnabledOps(VmState::Starting);
+    after[2].detail = L"2 GB";
+
+    std::vector<MenuChange> changes;
+    CHECK(DiffMenuModel(before, after, changes));
+    CHECK(changes.size() == 2);
+    CHECK(changes[0].index == 1);
+    CHECK(changes[0].text);
+    CHECK(changes[0].enabled == (GetEnabledOps(VmState::Stopped) ^ GetEnabledOps(VmState::Starting)));
+    CHECK(changes[1].index == 2);
+    CHECK(changes[1].text);
+    CHECK(changes[1].enabled == 0);
+}
+
+TEST(menumodel, DiffEnableOnlyChange)
+{
+    const MenuModel before = MakeModel();
+    MenuModel after = before;
+    after[0].enabled &= ~OpBit(VmOp::Checkpoint);
+
+    std::vector<MenuChange> changes;
+    CHECK(DiffMenuModel(before, after, changes));
+    CHECK(changes.size() == 1);
+    CHECK(!changes[0].text);
+    CHECK(changes[0].enabled == OpBit(VmOp::Checkpoint));
+}
+
+TEST(menumodel, DiffRenameChangesText)
+{
+    const MenuModel before = MakeModel();
+    MenuModel after = before;
+    after[0].name = L"alpha2";
+
+    std::vector<MenuChange> changes;
+    CHECK(DiffMenuModel(before, after, changes));
+    CHECK(changes.size() == 1);
+    CHECK(changes[0].text);
+}
+
+TEST(menumodel, DiffFailsWhenVmsChange)
+{
+    const MenuModel before = MakeModel();
+    std::vector<MenuChange> changes;
+
+    // Added.
+    MenuModel after = before;
+    after.push_back(MakeEntry(L"4", L"delta", VmState::Running));
+    CHECK(!DiffMenuModel(before, after, changes));
+    CHECK(changes.empty());
+
+    // Removed.
+    after = before;
+    after.pop_back();
+    CHECK(!DiffMenuModel(before, after, changes));
+
+    // Reordered, with a change before the difference; nothing is reported.
+    after = before;
+    after[0].state = VmState::Saving;
+    std::swap(after[1], after[2]);
+    CHECK(!DiffMenuModel(before, after, changes));
+    CHECK(changes.empty());
+}
+
+TEST(menumodel, DiffSameNamesDifferentIds)
+{
+    // Two VMs may share a name; they're told apart by id.
+    const MenuModel before = { MakeEntry(L"1", L"same", VmState::Running), MakeEntry(L"2", L"same", VmState::Stopped) };
+    MenuModel after = { MakeEntry(L"2", L"same", VmState::Stopped), MakeEntry(L"1", L"same", VmState::Running) };
+
+    std::vector<MenuChange> changes;
+    CHECK(!DiffMenuModel(before, after, changes));
+}
+
+TEST(menumodel, GroupSortsLabelsWithUnlabeledLast)
+{
+    MenuModel model = {
+        MakeEntry(L"1", L"a", VmState::Running, L"web"),
+        MakeEntry(L"2", L"b", VmState::Running, L""),
+        MakeEntry(L"3", L"c", VmState::Running, L"Db"),
+        MakeEntry(L"4", L"d", VmState::Running, L"web"),
+    };
+
+    const std::vector<MenuGroup> groups = GroupMenuModel(model, true/*grouped*/);
+    CHECK(groups.size() == 3);
+    CHECK(groups[0].label == L"Db");
+    CHECK(groups[1].label == L"web");
+    CHECK(groups[2].label.empty());
+    CHECK(groups[1].entries == std::vector<size_t>({ 0, 3 }));
+    CHECK(model[0].position == 0);
+    CHECK(model[3].position == 1);
+    CHECK(model[1].position == 0);
+}
+
+TEST(menumodel, UngroupedIsOneGroup)
+{
+    MenuModel model = MakeModel();
+    model[0].group = L"x";
+
+    const std::vector<MenuGroup> groups = GroupMenuModel(model, false/*grouped*/);
+    CHECK(groups.size() == 1);
+    CHECK(groups[0].label.empty());
+    CHECK(groups[0].entries.size() == model.size());
+    CHECK(model[2].position == 2);
+}
+
+TEST(menumodel, SlotsAreStableAndReused)
+{
+    CommandSlots slots(2);
+    const unsigned a = slots.Get(L"a");
+    const unsigned b = slots.Get(L"b");
+    CHECK(a != b);
+    CHECK(slots.Get(L"a") == a);
+    CHECK(slots.Get(L"c") == CommandSlots::c_none);
+    CHECK(*slots.Lookup(b) == L"b");
+
+    // Dropping "a" frees its slot for "c".
+    MenuModel model = { MakeEntry(L"b", L"b", VmState::Running) };
+    model[0].slot = b;
+    slots.Retain(model);
+    CHECK(!slots.Lookup(a));
+    CHECK(slots.Get(L"c") == a);
+    CHECK(slots.Get(L"b") == b);
+}
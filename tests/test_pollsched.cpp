@@ -0,0 +1,174 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../pollsched.h"
+#include <map>
+
+// Polls due at exactly now.
+static std::vector<std::wstring> Take(PollScheduler& polls, unsigned long long now)
+{
+    std::vector<std::wstring> due;
+    polls.TakeDue(now, due);
+    return due;
+}
+
+TEST(pollsched, EmptyHasNothingDue)
+{
+    PollScheduler polls;
+    CHECK(polls.Empty());
+    CHECK(polls.NextDue() == 0);
+    CHECK(Take(polls, 1000000).empty());
+
+    // Unwatching something that isn't watched is harmless.
+    polls.Unwatch(L"a", true/*reachedTarget*/, 0);
+    CHECK(polls.Empty());
+}
+
+TEST(pollsched, FirstPollIsBeforeExpectedFinish)
+{
+    PollScheduler polls;
+    const unsigned long long expected = polls.GetExpected(VmState::Running, VmState::Saved);
+    polls.Watch(L"a", VmState::Running, VmState::Saved, 1000);
+
+    const unsigned long long first = 1000 + expected * 3 / 4;
+    CHECK(polls.NextDue() == first);
+    CHECK(Take(polls, first - 1).empty());
+    CHECK(Take(polls, first) == std::vector<std::wstring>({ L"a" }));
+    CHECK(polls.NextDue() == first + expected / 4);
+}
+
+TEST(pollsched, BacksOffToTheMaximum)
+{
+    PollScheduler polls;
+    polls.Watch(L"a", VmState::Running, VmState::Saved, 0);
+
+    // Follow the schedule with a simulated clock; the gaps between polls
+    // double until they reach c_maxInterval.
+    unsigned long long last = 0;
+    unsigned long long gap = 0;
+    for (int i = 0; i < 20; ++i)
+    {
+        const unsigned long long now = polls.NextDue();
+        CHECK(Take(polls, now).size() == 1);
+        if (i >= 2)
+        {
+            const unsigned long long expectedGap = (gap * 2 < PollScheduler::c_maxInterval) ? gap * 2 : PollScheduler::c_maxInterval;
+            CHECK(now - last == expectedGap);
+        }
+        if (i)
+            gap = now - last;
+        last = now;
+    }
+    CHECK(gap == PollScheduler::c_maxInterval);
+}
+
+TEST(pollsched, IntervalsAreClamped)
+{
+    PollScheduler polls;
+
+    // Pausing is expected to take 500 ms: the first poll is at 375 ms, and
+    // the next one no sooner than c_minInterval after it.
+    polls.Watch(L"a", VmState::Running, VmState::Paused, 0);
+    CHECK(polls.NextDue() == 375);
+    Take(polls, 375);
+    CHECK(polls.NextDue() == 375 + PollScheduler::c_minInterval);
+
+    // A transition learned to take very long still polls at least every
+    // c_maxInterval.
+    polls.Unwatch(L"a", false, 0);
+    polls.Watch(L"b", VmState::Running, VmState::Saved, 0);
+    polls.Unwatch(L"b", true/*reachedTarget*/, 10 * 60 * 1000);
+    polls.Watch(L"b", VmState::Running, VmState::Saved, 0);
+    CHECK(polls.NextDue() == PollScheduler::c_maxInterval);
+}
+
+TEST(pollsched, LearnsMovingAverage)
+{
+    PollScheduler polls;
+
+    polls.Watch(L"a", VmState::Running, VmState::Saved, 1000);
+    polls.Unwatch(L"a", true/*reachedTarget*/, 9000);
+    CHECK(polls.GetExpected(VmState::Running, VmState::Saved) == 8000);
+
+    polls.Watch(L"a", VmState::Running, VmState::Saved, 20000);
+    polls.Unwatch(L"a", true/*reachedTarget*/, 24000);
+    CHECK(polls.GetExpected(VmState::Running, VmState::Saved) == 7000);
+
+    // Other transitions keep their own averages.
+    CHECK(polls.GetExpected(VmState::Paused, VmState::Saved) != 7000);
+}
+
+TEST(pollsched, OnlyFinishedTransitionsAreLearned)
+{
+    PollScheduler polls;
+    const unsigned long long before = polls.GetExpected(VmState::Stopped, VmState::Running);
+
+    polls.Watch(L"a", VmState::Stopped, VmState::Running, 0);
+    polls.Unwatch(L"a", false/*reachedTarget*/, 60000);
+    CHECK(polls.GetExpected(VmState::Stopped, VmState::Running) == before);
+
+    // Nor a sample from a clock that went backwards.
+    polls.Watch(L"a", VmState::Stopped, VmState::Running, 5000);
+    polls.Unwatch(L"a", true/*reachedTarget*/, 4000);
+    CHECK(polls.GetExpected(VmState::Stopped, VmState::Running) == before);
+}
+
+TEST(pollsched, DueVmsAreTakenTogether)
+{
+    PollScheduler polls;
+    polls.Watch(L"a", VmState::Running, VmState::Saved, 0);
+    polls.Watch(L"b", VmState::Running, VmState::Saved, 0);
+    polls.Watch(L"c", VmState::Running, VmState::Paused, 0);
+
+    // Late enough that all three are due, so they go in one query.
+    CHECK(Take(polls, 60000).size() == 3);
+    CHECK(Take(polls, 60000).empty());
+}
+
+TEST(pollsched, SimulatedClockNeverPollsEarly)
+{
+    PollScheduler polls;
+
+    // 200 VMs, watched at staggered times with assorted transitions and
+    // finishing at staggered times.  Each poll must come at or after the
+    // VM's scheduled time, and each VM's polls must be spaced at least
+    // c_minInterval apart.
+    static const VmState c_targets[] = { VmState::Running, VmState::Saved, VmState::Paused, VmState::Stopped };
+    std::map<std::wstring, unsigned long long> finishes;
+    std::map<std::wstring, unsigned long long> lastPoll;
+    for (unsigned i = 0; i < 200; ++i)
+    {
+        const std::wstring id = L"vm" + std::to_wstring(i);
+        polls.Watch(id, VmState::Running, c_targets[i % 4], i * 37);
+        finishes[id] = i * 37 + 1000 + (i * 7919) % 40000;
+    }
+
+    unsigned early = 0;
+    unsigned tooClose = 0;
+    unsigned long long now = 0;
+    std::vector<std::wstring> due;
+    while (!polls.Empty())
+    {
+        const unsigned long long next = polls.NextDue();
+        early += (next < now);
+        now = (next > now) ? next : now;
+
+        due.clear();
+        polls.TakeDue(now, due);
+        for (const auto& id : due)
+        {
+            auto last = lastPoll.find(id);
+            if (last != lastPoll.end())
+                tooClose += (now - last->second < PollScheduler::c_minInterval);
+            lastPoll[id] = now;
+
+            if (now >= finishes[id])
+                polls.Unwatch(id, true/*reachedTarget*/, now);
+        }
+    }
+
+    CHECK(early == 0);
+    CHECK(tooClose == 0);
+    CHECK(lastPoll.size() == 200);
+}
@@ -0,0 +1,256 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../propvalues.h"
+#include "../refill.h"
+#include "../alloccount.h"
+#include <cwchar>
+
+enum { c_id, c_name, c_state, c_health, c_count };
+static constexpr PropDef c_props[] =
+{
+    { L"Name",          PropType::String,   true },
+    { L"ElementName",   PropType::String,   true },
+    { L"EnabledState",  PropType::Integer,  true },
+    { L"HealthState",   PropType::Integer,  false },
+};
+
+// An object from a fake source.  A null string or a zero integer is missing.
+// Strings are read the way IWbemObjectAccess::ReadPropertyValue reads them:
+// copied with their NUL if they fit, and otherwise only sized.
+struct FakeObject
+{
+    const wchar_t* strings[c_count] = {};
+    unsigned long long integers[c_count] = {};
+    const wchar_t* path = nullptr;      // Only available through Get.
+};
+
+struct FakeSource
+{
+    std::vector<FakeObject> objects;
+    unsigned gets = 0;                  // Paths read, each a Get in the app.
+};
+
+// Reads an object the way PropertyReader::Read does.
+static bool Read(PropertyValues& values, const FakeObject& object)
+{
+    values.Clear();
+
+    bool ok = true;
+    for (size_t i = 0; i < c_count; ++i)
+    {
+        bool present;
+        if (c_props[i].type == PropType::String)
+        {
+            const wchar_t* value = object.strings[i];
+            present = values.ReadString(i, [&](wchar_t* buffer, size_t room) -> size_t
+            {
+                if (!value)
+                    return 0;
+                const size_t needed = wcslen(value) + 1;
+                if (needed <= room)
+                    wmemcpy(buffer, value, needed);
+                return needed;
+            });
+        }
+        else
+        {
+            present = !!object.integers[i];
+            if (present)
+                values.SetInteger(i, object.integers[i]);
+        }
+
+        if (!present && c_props[i].required)
+            ok = false;
+    }
+    return ok;
+}
+
+// The fields of a VmSnapshot that come from the object, filled the way
+// ReadSnapshot fills them.
+struct FakeSnapshot
+{
+    std::wstring id;
+    std::wstring name;
+    std::wstring path;
+    unsigned long long state = 0;
+    unsigned long long health = 0;
+};
+
+static bool ReadSnapshot(PropertyValues& values, FakeSource& source, const FakeObject& object, FakeSnapshot& snapshot)
+{
+    if (!Read(values, object))
+        return false;
+
+    size_t idLength;
+    const wchar_t* id = values.GetString(c_id, &idLength);
+    if (snapshot.path.empty() || snapshot.id.length() != idLength || wmemcmp(snapshot.id.c_str(), id, idLength))
+    {
+        ++source.gets;
+        snapshot.path = object.path;
+        snapshot.id.assign(id, idLength);
+    }
+
+    values.GetString(c_name, snapshot.name);
+    snapshot.state = values.GetInteger(c_state);
+    snapshot.health = values.Has(c_health) ? values.GetInteger(c_health) : 0;
+    return true;
+}
+
+// Enumerates the source into list the way EnumerateVirtualMachines does.
+static void Enumerate(PropertyValues& values, FakeSource& source, std::vector<FakeSnapshot>& list)
+{
+    Refill<FakeSnapshot> refill(list);
+    for (const auto& object : source.objects)
+    {
+        if (!ReadSnapshot(values, source, object, refill.Next()))
+            refill.Unfill();
+    }
+}
+
+static const wchar_t* const c_ids[] =
+{
+    L"0B9A6A4C-4D43-4C36-9C1B-0B6F3F6A2E01",
+    L"1C2E7B5D-5E54-4D47-8D2C-1C7F4F7B3F12",
+    L"2D3F8C6E-6F65-4E58-9E3D-2D8F5F8C4F23",
+    L"3E4F9D7F-7F76-4F69-AF4E-3E9F6F9D5F34",
+    L"4F5FAE8F-8F87-4F7A-BF5F-4FAF7FAE6F45",
+    L"5F6FBF9F-9F98-4F8B-CF6F-5FBF8FBF7F56",
+};
+static const wchar_t* const c_names[] =
+{
+    L"dc01",
+    L"A build agent with a name well past the arena's first guess of room",
+    L"sql",
+    L"web-frontend-staging-02",
+    L"x",
+    L"Windows 11 test machine",
+};
+static const wchar_t* const c_paths[] =
+{
+    L"\\\\HOST\\root\\virtualization\\v2:Msvm_ComputerSystem.Name=\"0B9A6A4C\"",
+    L"\\\\HOST\\root\\virtualization\\v2:Msvm_ComputerSystem.Name=\"1C2E7B5D\"",
+    L"\\\\HOST\\root\\virtualization\\v2:Msvm_ComputerSystem.Name=\"2D3F8C6E\"",
+    L"\\\\HOST\\root\\virtualization\\v2:Msvm_ComputerSystem.Name=\"3E4F9D7F\"",
+    L"\\\\HOST\\root\\virtualization\\v2:Msvm_ComputerSystem.Name=\"4F5FAE8F\"",
+    L"\\\\HOST\\root\\virtualization\\v2:Msvm_ComputerSystem.Name=\"5F6FBF9F\"",
+};
+
+static FakeSource MakeSource()
+{
+    FakeSource source;
+    for (size_t i = 0; i < sizeof(c_ids) / sizeof(c_ids[0]); ++i)
+    {
+        FakeObject object;
+        object.strings[c_id] = c_ids[i];
+        object.strings[c_name] = c_names[i];
+        object.integers[c_state] = 2;
+        object.integers[c_health] = (i % 2) ? 5 : 0;
+        object.path = c_paths[i];
+        source.objects.push_back(object);
+    }
+    return source;
+}
+
+TEST(propvalues, StringsAndIntegers)
+{
+    PropertyValues values(c_count);
+    FakeObject object;
+    object.strings[c_id] = c_ids[0];
+    object.strings[c_name] = c_names[1];
+    object.integers[c_state] = 3;
+    CHECK(Read(values, object));
+
+    size_t length;
+    CHECK(std::wstring(values.GetString(c_id, &length)) == c_ids[0]);
+    CHECK(length == wcslen(c_ids[0]));
+    std::wstring name;
+    CHECK(values.GetString(c_name, name) && name == c_names[1]);
+    CHECK(values.Has(c_state) && values.GetInteger(c_state) == 3);
+    CHECK(!values.Has(c_health));
+
+    // A missing value reads as empty, and clearing forgets everything.
+    object.strings[c_name] = nullptr;
+    CHECK(!Read(values, object));
+    CHECK(!values.Has(c_name));
+    CHECK(!values.GetString(c_name, name) && name.empty());
+    CHECK(*values.GetString(c_name) == 0);
+    CHECK(std::wstring(values.GetString(c_id)) == c_ids[0]);
+    values.Clear();
+    CHECK(!values.Has(c_id) && !values.Has(c_state));
+}
+
+TEST(propvalues, SetStringAppends)
+{
+    PropertyValues values(c_count);
+    values.Clear();
+    values.SetString(c_id, L"abcdef", 3);
+    values.SetString(c_name, L"", 0);
+    CHECK(std::wstring(values.GetString(c_id)) == L"abc");
+    CHECK(values.Has(c_name) && *values.GetString(c_name) == 0);
+}
+
+TEST(propvalues, SteadyStateAllocatesNothing)
+{
+    FakeSource source = MakeSource();
+    PropertyValues values(c_count);
+    std::vector<FakeSnapshot> list;
+
+    // The first pass grows the arena and the snapshots' strings.
+    Enumerate(values, source, list);
+    CHECK(list.size() == source.objects.size());
+    CHECK(source.gets == source.objects.size());
+
+    // Refreshing the same VMs allocates nothing, even as their states and
+    // names change, as long as nothing gets longer than it's been.
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        source.gets = 0;
+        source.objects[2].integers[c_state] = 3 + pass;
+        source.objects[1].strings[c_name] = pass % 2 ? c_names[4] : c_names[1];
+
+        BeginCountingAllocs();
+        Enumerate(values, source, list);
+        const unsigned long long allocs = EndCountingAllocs();
+
+        CHECK(allocs == 0);
+        CHECK(source.gets == 0);
+        CHECK(list.size() == source.objects.size());
+        CHECK(list[2].state == unsigned(3 + pass));
+        CHECK(list[1].name == (pass % 2 ? c_names[4] : c_names[1]));
+    }
+
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        CHECK(list[i].id == c_ids[i]);
+        CHECK(list[i].path == c_paths[i]);
+        CHECK(list[i].health == ((i % 2) ? 5u : 0u));
+    }
+}
+
+TEST(propvalues, ChangedVmsGetTheirOwnPaths)
+{
+    FakeSource source = MakeSource();
+    PropertyValues values(c_count);
+    std::vector<FakeSnapshot> list;
+    Enumerate(values, source, list);
+
+    // One VM goes away, so everything after it lands in a snapshot that held
+    // a different VM, and needs its path read.
+    source.objects.erase(source.objects.begin() + 3);
+    source.gets = 0;
+    Enumerate(values, source, list);
+    CHECK(list.size() == source.objects.size());
+    CHECK(source.gets == 2);
+    CHECK(list[3].id == c_ids[4] && list[3].path == c_paths[4]);
+    CHECK(list[4].id == c_ids[5] && list[4].path == c_paths[5]);
+    CHECK(list[2].id == c_ids[2] && list[2].path == c_paths[2]);
+
+    // One that's missing a required property is left out.
+    source.objects[0].strings[c_name] = nullptr;
+    source.gets = 0;
+    Enumerate(values, source, list);
+    CHECK(list.size() == source.objects.size() - 1);
+    CHECK(list[0].id == c_ids[1] && list[0].path == c_paths[1]);
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../refill.h"
+#include "../alloccount.h"
+#include <string>
+
+static void Fill(std::vector<std::wstring>& list, const std::vector<std::wstring>& values)
+{
+    Refill<std::wstring> refill(list);
+    for (const auto& value : values)
+    {
+        std::wstring& s = refill.Next();
+        if (value.empty())
+            refill.Unfill();
+        else
+            s.assign(value);
+    }
+}
+
+TEST(refill, GrowsAndTrims)
+{
+    std::vector<std::wstring> list;
+    Fill(list, { L"a", L"b", L"c" });
+    CHECK(list == std::vector<std::wstring>({ L"a", L"b", L"c" }));
+
+    Fill(list, { L"d" });
+    CHECK(list == std::vector<std::wstring>({ L"d" }));
+
+    Fill(list, { L"e", L"f", L"g", L"h" });
+    CHECK(list == std::vector<std::wstring>({ L"e", L"f", L"g", L"h" }));
+}
+
+TEST(refill, UnfillGivesTheElementBack)
+{
+    std::vector<std::wstring> list;
+    Fill(list, { L"a", L"", L"b", L"" });
+    CHECK(list == std::vector<std::wstring>({ L"a", L"b" }));
+
+    Refill<std::wstring> refill(list);
+    refill.Next();
+    CHECK(refill.Count() == 1);
+    refill.Unfill();
+    CHECK(refill.Count() == 0);
+}
+
+TEST(refill, ReusesWhatTheElementsOwn)
+{
+    const std::vector<std::wstring> values =
+    {
+        L"long enough that it isn't stored inline in the string",
+        L"another one that needs its own heap allocation, too",
+    };
+    const std::vector<std::wstring> shorter =
+    {
+        L"shorter, but still not stored inline",
+        L"x",
+    };
+
+    std::vector<std::wstring> list;
+    Fill(list, values);
+
+    BeginCountingAllocs();
+    Fill(list, shorter);
+    Fill(list, values);
+    const unsigned long long allocs = EndCountingAllocs();
+
+    CHECK(allocs == 0);
+    CHECK(list == values);
+}
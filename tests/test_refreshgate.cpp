@@ -0,0 +1,151 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../refreshgate.h"
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+TEST(refreshgate, CoalescesRequests)
+{
+    RefreshGate gate;
+    CHECK(gate.Request());
+    CHECK(!gate.Request());
+    CHECK(!gate.Request());
+
+    // Two requests during the first pass cost one more pass.
+    CHECK(gate.Finish());
+    CHECK(!gate.Finish());
+    CHECK(!gate.IsRunning());
+
+    CHECK(gate.Request());
+    gate.Abandon();
+    CHECK(gate.Request());
+}
+
+// A host whose refresh runs on its own thread, like a pool callback.  Each
+// request carries a generation number; a pass records the newest generation
+// it started after, so a lost request shows up as a generation that no pass
+// ever covers.  Refreshes can be stalled, as if the host stopped answering.
+class FakeHost
+{
+public:
+    ~FakeHost()
+    {
+        for (auto& thread : m_threads)
+            thread.join();
+    }
+
+    void Request(unsigned generation)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (generation > m_requested)
+                m_requested = generation;
+        }
+        if (m_gate.Request())
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_threads.emplace_back([this]() { Run(); });
+        }
+    }
+
+    void Stall(bool stall)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stalled = stall;
+        }
+        m_changed.notify_all();
+    }
+
+    // Waits until a finished pass has covered every request so far.
+    bool WaitCaughtUp()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        return m_changed.wait_for(lock, std::chrono::seconds(10), [this]() {
+            return m_covered == m_requested;
+        });
+    }
+
+    unsigned Passes()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        return m_passes;
+    }
+
+private:
+    void Run()
+    {
+        do
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            const unsigned generation = m_requested;
+            m_changed.wait(lock, [this]() { return !m_stalled; });
+            ++m_passes;
+            m_covered = generation;
+            lock.unlock();
+            m_changed.notify_all();
+        }
+        while (m_gate.Finish());
+    }
+
+    RefreshGate m_gate;
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    std::vector<std::thread> m_threads;
+    unsigned m_requested = 0;
+    unsigned m_covered = 0;
+    unsigned m_passes = 0;
+    bool m_stalled = false;
+};
+
+TEST(refreshgate, StalledHostDoesNotHoldUpOthers)
+{
+    std::vector<std::unique_ptr<FakeHost>> hosts;
+    for (int i = 0; i < 4; ++i)
+        hosts.emplace_back(new FakeHost);
+
+    hosts[0]->Stall(true);
+
+    // Ten rounds of refreshing every host: the others keep up each round
+    // while host 0 sits in its first pass.
+    bool caughtUp = true;
+    for (unsigned generation = 1; generation <= 10; ++generation)
+    {
+        for (auto& host : hosts)
+            host->Request(generation);
+        for (size_t i = 1; i < hosts.size(); ++i)
+            caughtUp = hosts[i]->WaitCaughtUp() && caughtUp;
+    }
+    CHECK(caughtUp);
+    CHECK(hosts[0]->Passes() == 0);
+
+    // Once it answers, the nine requests it missed cost a single pass.
+    hosts[0]->Stall(false);
+    CHECK(hosts[0]->WaitCaughtUp());
+    CHECK(hosts[0]->Passes() == 2);
+}
+
+TEST(refreshgate, NoRequestIsLost)
+{
+    FakeHost host;
+
+    // Several threads request at once, racing the end of each pass.
+    std::vector<std::thread> requesters;
+    for (unsigned t = 0; t < 4; ++t)
+    {
+        requesters.emplace_back([&host, t]() {
+            for (unsigned i = 0; i < 2000; ++i)
+                host.Request(i * 4 + t + 1);
+        });
+    }
+    for (auto& thread : requesters)
+        thread.join();
+
+    CHECK(host.WaitCaughtUp());
+}
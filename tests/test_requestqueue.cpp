@@ -0,0 +1,173 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../requestqueue.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Records what's issued; the test finishes requests by hand.
+struct Recorder
+{
+    std::vector<int> issued;
+    RequestQueue* queue = nullptr;
+    bool finishAtOnce = false;      // As if it couldn't be submitted.
+};
+
+static void IssueToRecorder(void* request, void* context)
+{
+    Recorder* const recorder = static_cast<Recorder*>(context);
+    recorder->issued.push_back(*static_cast<int*>(request));
+    if (recorder->finishAtOnce)
+        recorder->queue->Finished();
+}
+
+TEST(requestqueue, IssuesUpToTheLimitInOrder)
+{
+    Recorder recorder;
+    RequestQueue queue(IssueToRecorder, &recorder);
+    recorder.queue = &queue;
+    queue.SetLimit(3);
+
+    int requests[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    for (int& request : requests)
+        queue.Push(&request);
+
+    CHECK(recorder.issued == std::vector<int>({ 0, 1, 2 }));
+    CHECK(queue.InFlight() == 3);
+    CHECK(queue.Pending() == 5);
+
+    // Each one that finishes makes room for the next.
+    queue.Finished();
+    CHECK(recorder.issued == std::vector<int>({ 0, 1, 2, 3 }));
+    queue.Finished();
+    queue.Finished();
+    CHECK(recorder.issued == std::vector<int>({ 0, 1, 2, 3, 4, 5 }));
+
+    // Raising the limit issues more right away.
+    queue.SetLimit(10);
+    CHECK(recorder.issued.size() == 8);
+    CHECK(queue.InFlight() == 5);
+    CHECK(queue.Pending() == 0);
+
+    for (int i = 0; i < 5; ++i)
+        queue.Finished();
+    CHECK(queue.InFlight() == 0);
+}
+
+TEST(requestqueue, ZeroLimitMeansOne)
+{
+    Recorder recorder;
+    RequestQueue queue(IssueToRecorder, &recorder);
+    recorder.queue = &queue;
+    queue.SetLimit(0);
+
+    int requests[2] = { 0, 1 };
+    queue.Push(&requests[0]);
+    queue.Push(&requests[1]);
+    CHECK(recorder.issued == std::vector<int>({ 0 }));
+    queue.Finished();
+    CHECK(recorder.issued == std::vector<int>({ 0, 1 }));
+    queue.Finished();
+}
+
+TEST(requestqueue, FinishingWhileIssuingDrainsTheQueue)
+{
+    Recorder recorder;
+    recorder.finishAtOnce = true;
+    RequestQueue queue(IssueToRecorder, &recorder);
+    recorder.queue = &queue;
+    queue.SetLimit(1);
+
+    std::vector<int> requests(100);
+    for (size_t i = 0; i < requests.size(); ++i)
+    {
+        requests[i] = int(i);
+        queue.Push(&requests[i]);
+    }
+
+    CHECK(recorder.issued.size() == requests.size());
+    CHECK(queue.InFlight() == 0);
+    CHECK(queue.Pending() == 0);
+}
+
+// A service where every request takes the same time, each on its own thread,
+// like a state change issued from the thread pool.
+class FakeService
+{
+public:
+    FakeService(unsigned limit, std::chrono::milliseconds latency)
+    : m_queue(Issue, this)
+    , m_latency(latency)
+    {
+        m_queue.SetLimit(limit);
+    }
+
+    // Issues count requests and waits for them all to finish.
+    std::chrono::milliseconds Run(unsigned count)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < count; ++i)
+            m_queue.Push(this);
+        while (finished < count)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        const auto end = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> lock(m_lock);
+        for (auto& thread : m_threads)
+            thread.join();
+        m_threads.clear();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(end - begin);
+    }
+
+    std::atomic<unsigned> inFlight { 0 };
+    std::atomic<unsigned> maxInFlight { 0 };
+    std::atomic<unsigned> finished { 0 };
+
+private:
+    static void Issue(void* /*request*/, void* context)
+    {
+        FakeService* const service = static_cast<FakeService*>(context);
+
+        const unsigned now = ++service->inFlight;
+        unsigned max = service->maxInFlight;
+        while (now > max && !service->maxInFlight.compare_exchange_weak(max, now))
+            ;
+
+        std::lock_guard<std::mutex> lock(service->m_lock);
+        service->m_threads.emplace_back([service]() {
+            std::this_thread::sleep_for(service->m_latency);
+            --service->inFlight;
+            ++service->finished;
+            service->m_queue.Finished();
+        });
+    }
+
+    RequestQueue m_queue;
+    const std::chrono::milliseconds m_latency;
+    std::mutex m_lock;
+    std::vector<std::thread> m_threads;
+};
+
+TEST(requestqueue, ConcurrentIssueBeatsSerial)
+{
+    constexpr unsigned c_count = 12;
+    constexpr unsigned c_limit = 4;
+    const std::chrono::milliseconds latency(30);
+
+    FakeService serial(1, latency);
+    const auto serialTime = serial.Run(c_count);
+    CHECK(serial.maxInFlight == 1);
+    CHECK(serialTime >= latency * c_count);
+
+    // ceil(N / limit) rounds of the latency, not N.
+    FakeService concurrent(c_limit, latency);
+    const auto concurrentTime = concurrent.Run(c_count);
+    const unsigned rounds = (c_count + c_limit - 1) / c_limit;
+    CHECK(concurrent.maxInFlight == c_limit);
+    CHECK(concurrentTime >= latency * rounds);
+    CHECK(concurrentTime < latency * c_count / 2);
+    CHECK(concurrentTime * 2 < serialTime);
+}
@@ -0,0 +1,318 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../session.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <thread>
+#include <vector>
+
+// Results the fake service gives.
+constexpr SessionResult c_ok = 0;
+constexpr SessionResult c_lost = -1;        // Connection lost.
+constexpr SessionResult c_timeout = -2;     // Not responding.
+constexpr SessionResult c_error = -3;       // Any other failure.
+constexpr SessionResult c_refused = -4;
+
+// Scripted service.  Connections are numbered from 1, so tests can tell
+// which one a call ran on.
+class FakeBackend final : public SessionBackend
+{
+public:
+    SessionResult Connect(Connection& out) override
+    {
+        const int id = ++connects;
+        if (onConnect)
+            onConnect();
+
+        SessionResult result = c_ok;
+        if (!connectResults.empty())
+        {
+            result = connectResults.front();
+            connectResults.pop_front();
+        }
+        if (result >= 0)
+            out = std::make_shared<int>(id);
+        return result;
+    }
+
+    bool LostConnection(SessionResult result) const override { return result == c_lost; }
+    bool TripsBreaker(SessionResult result) const override { return result == c_lost || result == c_timeout; }
+    SessionResult Refused() const override { return c_refused; }
+    unsigned long long Now() const override { return now; }
+
+    std::deque<SessionResult> connectResults;   // Then c_ok.
+    std::function<void()> onConnect;           // Runs inside Connect().
+    std::atomic<int> connects { 0 };
+    unsigned long long now = 1000;
+};
+
+static int Id(const Session::Connection& connection)
+{
+    return *static_cast<const int*>(connection.get());
+}
+
+TEST(session, ReusesConnection)
+{
+    FakeBackend backend;
+    Session session(backend);
+
+    std::vector<int> seen;
+    for (int i = 0; i < 3; ++i)
+    {
+        CHECK(session.Call([&](const Session::Connection& c) {
+            seen.push_back(Id(c));
+            return c_ok;
+        }) == c_ok);
+    }
+
+    CHECK(backend.connects == 1);
+    CHECK(seen == std::vector<int>({ 1, 1, 1 }));
+}
+
+TEST(session, ReconnectsOnceWhenLost)
+{
+    FakeBackend backend;
+    Session session(backend);
+
+    std::vector<int> seen;
+    const SessionResult result = session.Call([&](const Session::Connection& c) {
+        seen.push_back(Id(c));
+        return (seen.size() == 1) ? c_lost : c_ok;
+    });
+
+    CHECK(result == c_ok);
+    CHECK(seen == std::vector<int>({ 1, 2 }));
+    CHECK(session.IsResponding());
+
+    // Later calls use the new connection.
+    session.Call([&](const Session::Connection& c) { seen.push_back(Id(c)); return c_ok; });
+    CHECK(seen.back() == 2);
+    CHECK(backend.connects == 2);
+}
+
+TEST(session, GivesUpAfterSecondLoss)
+{
+    FakeBackend backend;
+    Session session(backend);
+
+    int calls = 0;
+    const SessionResult result = session.Call([&](const Session::Connection&) {
+        ++calls;
+        return c_lost;
+    });
+
+    CHECK(result == c_lost);
+    CHECK(calls == 2);
+    CHECK(backend.connects == 2);
+}
+
+TEST(session, OtherFailuresAreNotRetried)
+{
+    FakeBackend backend;
+    Session session(backend);
+
+    int calls = 0;
+    CHECK(session.Call([&](const Session::Connection&) { ++calls; return c_error; }) == c_error);
+    CHECK(calls == 1);
+    CHECK(backend.connects == 1);
+    CHECK(session.IsResponding());
+}
+
+TEST(session, StaleDisconnectKeepsNewConnection)
+{
+    FakeBackend backend;
+    Session session(backend);
+
+    Session::Connection first;
+    CHECK(session.GetConnection(first) == c_ok);
+    session.Disconnect(first.get());
+
+    Session::Connection second;
+    CHECK(session.GetConnection(second) == c_ok);
+    CHECK(Id(second) == 2);
+
+    // A late report about the first connection doesn't drop the second.
+    session.Disconnect(first.get());
+    Session::Connection again;
+    CHECK(session.GetConnection(again) == c_ok);
+    CHECK(again == second);
+}
+
+TEST(session, ConnectFailureIsReturned)
+{
+    FakeBackend backend;
+    backend.connectResults = { c_error };
+    Session session(backend);
+
+    int calls = 0;
+    auto func = [&](const Session::Connection&) { ++calls; return c_ok; };
+
+    CHECK(session.Call(func) == c_error);
+    CHECK(calls == 0);
+
+    // The next call connects again.
+    CHECK(session.Call(func) == c_ok);
+    CHECK(calls == 1);
+    CHECK(backend.connects == 2);
+}
+
+TEST(session, BreakerRefusesCallsUntilBackoff)
+{
+    FakeBackend backend;
+    Session session(backend);
+
+    for (unsigned i = 0; i < CircuitBreaker::c_threshold; ++i)
+        CHECK(session.Call([](const Session::Connection&) { return c_timeout; }) == c_timeout);
+    CHECK(!session.IsResponding());
+
+    // Refused without reaching the service.
+    int calls = 0;
+    auto func = [&](const Session::Connection&) { ++calls; return c_ok; };
+    CHECK(session.Call(func) == c_refused);
+    CHECK(calls == 0);
+
+    backend.now += CircuitBreaker::c_minBackoff;
+    CHECK(session.Call(func) == c_ok);
+    CHECK(calls == 1);
+    CHECK(session.IsResponding());
+}
+
+TEST(session, ThreadsShareOneConnection)
+{
+    FakeBackend backend;
+    Session session(backend);
+
+    std::vector<std::thread> threads;
+    std::vector<int> wrong(8);
+    for (size_t t = 0; t < wrong.size(); ++t)
+    {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < 1000; ++i)
+            {
+                session.Call([&](const Session::Connection& c) {
+                    wrong[t] += (Id(c) != 1);
+                    return c_ok;
+                });
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    CHECK(backend.connects == 1);
+    for (int count : wrong)
+        CHECK(count == 0);
+}
+
+TEST(session, ConnectFailuresTripBreaker)
+{
+    FakeBackend backend;
+    backend.connectResults.assign(CircuitBreaker::c_threshold, c_timeout);
+    Session session(backend);
+
+    int calls = 0;
+    auto func = [&](const Session::Connection&) { ++calls; return c_ok; };
+    for (unsigned i = 0; i < CircuitBreaker::c_threshold; ++i)
+        CHECK(session.Call(func) == c_timeout);
+    CHECK(!session.IsResponding());
+    CHECK(session.Call(func) == c_refused);
+    CHECK(calls == 0);
+}
+
+TEST(session, HalfOpenTrialThatCantReconnectReopens)
+{
+    FakeBackend backend;
+    Session session(backend);
+
+    // The service goes away; every call loses its connection.
+    for (unsigned i = 0; i < CircuitBreaker::c_threshold; ++i)
+        CHECK(session.Call([](const Session::Connection&) { return c_lost; }) == c_lost);
+    CHECK(!session.IsResponding());
+
+    int calls = 0;
+    auto func = [&](const Session::Connection&) { ++calls; return c_ok; };
+
+    // The trial call can't reconnect, so the breaker opens again with twice
+    // the backoff instead of staying half open.
+    backend.now += CircuitBreaker::c_minBackoff;
+    backend.connectResults = { c_timeout };
+    CHECK(session.Call(func) == c_timeout);
+    CHECK(!session.IsResponding());
+    CHECK(session.Call(func) == c_refused);
+
+    backend.now += CircuitBreaker::c_minBackoff;
+    CHECK(session.Call(func) == c_refused);
+
+    // The next trial reconnects and the breaker closes.
+    backend.now += CircuitBreaker::c_minBackoff;
+    CHECK(session.Call(func) == c_ok);
+    CHECK(calls == 1);
+    CHECK(session.IsResponding());
+}
+
+TEST(session, ConnectRunsWithoutTheLock)
+{
+    FakeBackend backend;
+    Session session(backend);
+
+    std::promise<void> entered;
+    std::promise<void> release;
+    std::shared_future<void> released(release.get_future());
+    backend.onConnect = [&]() {
+        entered.set_value();
+        released.wait();
+    };
+
+    std::thread caller([&]() {
+        Session::Connection connection;
+        CHECK(session.GetConnection(connection) == c_ok);
+    });
+    entered.get_future().wait();
+
+    // A slow connect doesn't hold up the rest of the session.
+    session.Disconnect();
+    CHECK(session.IsResponding());
+
+    release.set_value();
+    caller.join();
+    CHECK(backend.connects == 1);
+}
+
+TEST(session, CallersWaitForOneConnect)
+{
+    FakeBackend backend;
+    backend.connectResults = { c_timeout };
+    Session session(backend);
+
+    std::atomic<int> connecting { 0 };
+    std::atomic<int> overlapped { 0 };
+    backend.onConnect = [&]() {
+        overlapped += (++connecting > 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        --connecting;
+    };
+
+    std::vector<std::thread> threads;
+    std::vector<SessionResult> results(8);
+    for (size_t t = 0; t < results.size(); ++t)
+    {
+        threads.emplace_back([&, t]() {
+            Session::Connection connection;
+            results[t] = session.GetConnection(connection);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    // The failed connect is shared by whoever waited for it; anyone later
+    // gets the second, successful one.
+    CHECK(overlapped == 0);
+    CHECK(backend.connects <= 2);
+    for (SessionResult result : results)
+        CHECK(result == c_timeout || result == c_ok);
+}
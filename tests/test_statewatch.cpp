@@ -0,0 +1,242 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../statewatch.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Simulated VM service.  VMs change state on a script; each change is
+// delivered as an event while the subscription is up, and polls read the
+// current states.  The subscription can drop and come back on the script
+// too.
+class FakeEventSource
+{
+public:
+    void Change(unsigned long long when, const std::wstring& id, VmState state)
+    {
+        m_script.push_back({ when, id, state, Kind::Change });
+    }
+    void Drop(unsigned long long when) { m_script.push_back({ when, std::wstring(), VmState::Unknown, Kind::Drop }); }
+    void Resubscribe(unsigned long long when) { m_script.push_back({ when, std::wstring(), VmState::Unknown, Kind::Subscribe }); }
+
+    // Runs the watcher against the service in 50 ms steps.
+    void Run(StateWatcher& watcher, unsigned long long from, unsigned long long until)
+    {
+        std::stable_sort(m_script.begin(), m_script.end(), [](const Step& a, const Step& b) {
+            return a.when < b.when;
+        });
+
+        for (unsigned long long now = from; now <= until; now += 50)
+        {
+            while (m_next < m_script.size() && m_script[m_next].when <= now)
+            {
+                const Step& step = m_script[m_next++];
+                switch (step.kind)
+                {
+                case Kind::Change:
+                    m_states[step.id] = step.state;
+                    if (watcher.IsSubscribed())
+                        Notice(watcher, step.id, now);
+                    break;
+                case Kind::Drop:
+                    watcher.SetSubscribed(false);
+                    break;
+                case Kind::Subscribe:
+                    watcher.SetSubscribed(true);
+                    break;
+                }
+            }
+
+            const unsigned long long next = watcher.NextPoll();
+            if (next && next <= now)
+            {
+                std::vector<std::wstring> due;
+                watcher.TakeDue(now, due);
+                for (const auto& id : due)
+                {
+                    ++polls;
+                    Notice(watcher, id, now);
+                }
+            }
+        }
+    }
+
+    struct Notification
+    {
+        unsigned long long when;
+        std::wstring id;
+        VmState state;
+    };
+
+    std::vector<Notification> notified;
+    std::vector<std::wstring> finished;
+    unsigned polls = 0;
+
+private:
+    enum class Kind { Change, Drop, Subscribe };
+    struct Step
+    {
+        unsigned long long when;
+        std::wstring id;
+        VmState state;
+        Kind kind;
+    };
+
+    void Notice(StateWatcher& watcher, const std::wstring& id, unsigned long long now)
+    {
+        const VmState state = m_states[id];
+        const StateWatcher::Observed observed = watcher.Observe(id, id, state, now);
+        if (observed.changed)
+            notified.push_back({ now, id, state });
+        if (observed.finished)
+            finished.push_back(id);
+    }
+
+    std::vector<Step> m_script;
+    size_t m_next = 0;
+    FlatMap<std::wstring, VmState> m_states;
+};
+
+TEST(statewatch, EventsNotifyUntilTarget)
+{
+    StateWatcher watcher;
+    watcher.SetSubscribed(true);
+    watcher.Watch(L"a", L"a", VmState::Stopped, VmState::Running, 0);
+
+    FakeEventSource source;
+    source.Change(100, L"a", VmState::Starting);
+    source.Change(900, L"a", VmState::Running);
+    source.Run(watcher, 0, 2000);
+
+    CHECK(source.notified.size() == 2);
+    CHECK(source.notified[0].state == VmState::Starting);
+    CHECK(source.notified[1].state == VmState::Running);
+    CHECK(source.notified[1].when == 900);
+    CHECK(source.finished == std::vector<std::wstring>({ L"a" }));
+    CHECK(source.polls == 0);
+    CHECK(watcher.Empty());
+}
+
+TEST(statewatch, SettlingElsewhereFinishes)
+{
+    StateWatcher watcher;
+    watcher.Watch(L"a", L"a", VmState::Running, VmState::Saved, 0);
+
+    // Saving fails partway and the VM goes back to running.
+    CHECK(watcher.Observe(L"a", L"a", VmState::Saving, 100).changed);
+    StateWatcher::Observed observed = watcher.Observe(L"a", L"a", VmState::Running, 200);
+    CHECK(observed.changed);
+    CHECK(!observed.finished);
+
+    observed = watcher.Observe(L"a", L"a", VmState::Running, 300);
+    CHECK(!observed.changed);
+    CHECK(observed.finished);
+    CHECK(watcher.Empty());
+}
+
+TEST(statewatch, UnchangedIsNotNotified)
+{
+    StateWatcher watcher;
+    watcher.Watch(L"a", L"a", VmState::Running, VmState::Saved, 0);
+
+    // Before anything changes, a stable state doesn't end the watch.
+    const StateWatcher::Observed observed = watcher.Observe(L"a", L"a", VmState::Running, 100);
+    CHECK(!observed.changed);
+    CHECK(!observed.finished);
+    CHECK(watcher.IsWatching(L"a"));
+}
+
+TEST(statewatch, UnwatchedIsFinished)
+{
+    StateWatcher watcher;
+    const StateWatcher::Observed observed = watcher.Observe(L"a", L"a", VmState::Running, 0);
+    CHECK(!observed.changed);
+    CHECK(observed.finished);
+}
+
+TEST(statewatch, NoPollingWhileSubscribed)
+{
+    StateWatcher watcher;
+    watcher.Watch(L"a", L"a", VmState::Running, VmState::Saved, 0);
+    CHECK(watcher.NeedsPolling());
+    CHECK(watcher.NextPoll() != 0);
+
+    watcher.SetSubscribed(true);
+    CHECK(!watcher.NeedsPolling());
+    CHECK(watcher.NextPoll() == 0);
+
+    std::vector<std::wstring> due;
+    watcher.TakeDue(60 * 1000, due);
+    CHECK(due.empty());
+}
+
+TEST(statewatch, PollsAfterSubscriptionDrops)
+{
+    StateWatcher watcher;
+    watcher.SetSubscribed(true);
+    watcher.Watch(L"a", L"a", VmState::Running, VmState::Saved, 0);
+    watcher.Watch(L"b", L"b", VmState::Stopped, VmState::Running, 0);
+
+    // The subscription drops before either change is delivered, so both are
+    // found by polling.
+    FakeEventSource source;
+    source.Drop(50);
+    source.Change(100, L"b", VmState::Starting);
+    source.Change(2000, L"b", VmState::Running);
+    source.Change(4000, L"a", VmState::Saving);
+    source.Change(9000, L"a", VmState::Saved);
+    source.Run(watcher, 0, 60 * 1000);
+
+    CHECK(watcher.Empty());
+    CHECK(source.polls > 0);
+    CHECK(source.finished.size() == 2);
+
+    // Each VM is notified of its final state, after it happened.
+    bool aSaved = false;
+    bool bRunning = false;
+    for (const auto& n : source.notified)
+    {
+        if (n.id == L"a" && n.state == VmState::Saved)
+            aSaved = (n.when >= 9000);
+        if (n.id == L"b" && n.state == VmState::Running)
+            bRunning = (n.when >= 2000);
+    }
+    CHECK(aSaved);
+    CHECK(bRunning);
+}
+
+TEST(statewatch, EventsResumeAfterResubscribing)
+{
+    StateWatcher watcher;
+    watcher.SetSubscribed(true);
+    watcher.Watch(L"a", L"a", VmState::Running, VmState::Saved, 0);
+
+    FakeEventSource source;
+    source.Drop(100);
+    source.Resubscribe(200);
+    source.Change(5000, L"a", VmState::Saving);
+    source.Change(7000, L"a", VmState::Saved);
+    source.Run(watcher, 0, 10 * 1000);
+
+    // The polls due between 100 and 200 (if any) found nothing, and the
+    // events after resubscribing were delivered as they happened.
+    CHECK(source.notified.size() == 2);
+    CHECK(source.notified[0].when == 5000);
+    CHECK(source.notified[1].when == 7000);
+    CHECK(watcher.Empty());
+}
+
+TEST(statewatch, LearnsTransitionTimes)
+{
+    StateWatcher watcher;
+
+    // Pausing is expected to be nearly instant until it's seen to take 8s.
+    watcher.Watch(L"a", L"a", VmState::Running, VmState::Paused, 0);
+    const unsigned long long firstPoll = watcher.NextPoll();
+    watcher.Observe(L"a", L"a", VmState::Paused, 8000);
+
+    watcher.Watch(L"a", L"a", VmState::Running, VmState::Paused, 10000);
+    CHECK(watcher.NextPoll() - 10000 > firstPoll);
+}
@@ -0,0 +1,181 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../vmcache.h"
+
+static std::vector<CachedVm> MakeVms()
+{
+    std::vector<CachedVm> vms(3);
+    vms[0].host = L"";
+    vms[0].id = L"6A3E3B6E-0000-0000-0000-000000000001";
+    vms[0].name = L"Local";
+    vms[0].state = VmState::Running;
+    vms[1].host = L"server";
+    vms[1].id = L"6A3E3B6E-0000-0000-0000-000000000002";
+    vms[1].name = L"Caf\u00e9 \u65e5\u672c";
+    vms[1].state = VmState::Saved;
+    vms[2].host = L"server";
+    vms[2].id = L"6A3E3B6E-0000-0000-0000-000000000003";
+    vms[2].name = L"";
+    vms[2].state = VmState::Stopping;
+    return vms;
+}
+
+static bool Equal(const std::vector<CachedVm>& a, const std::vector<CachedVm>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (a[i].host != b[i].host || a[i].id != b[i].id || a[i].name != b[i].name || a[i].state != b[i].state)
+            return false;
+    }
+    return true;
+}
+
+static void Put(std::vector<unsigned char>& file, size_t offset, unsigned long long value, unsigned bytes)
+{
+    for (unsigned i = 0; i < bytes; ++i)
+        file[offset + i] = (unsigned char)(value >> (i * 8));
+}
+
+// Recomputes the checksum after a test edits the file, so that the edit
+// itself is what the reader sees.  FNV-1a over everything but the checksum.
+static void Reseal(std::vector<unsigned char>& file)
+{
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < file.size(); ++i)
+    {
+        if (i >= 24 && i < 28)
+            continue;
+        hash ^= file[i];
+        hash *= 16777619u;
+    }
+    Put(file, 24, hash, 4);
+}
+
+TEST(vmcache, RoundTrip)
+{
+    const std::vector<CachedVm> vms = MakeVms();
+    std::vector<unsigned char> file;
+    WriteVmCache(vms, 0x0123456789abcdefull, file);
+
+    std::vector<CachedVm> read;
+    unsigned long long saved = 0;
+    CHECK(ReadVmCache(file.data(), file.size(), read, &saved));
+    CHECK(Equal(vms, read));
+    CHECK(saved == 0x0123456789abcdefull);
+}
+
+TEST(vmcache, EmptyListRoundTrips)
+{
+    std::vector<unsigned char> file;
+    WriteVmCache(std::vector<CachedVm>(), 1, file);
+    CHECK(file.size() == 32);
+
+    std::vector<CachedVm> read = MakeVms();
+    CHECK(ReadVmCache(file.data(), file.size(), read));
+    CHECK(read.empty());
+}
+
+TEST(vmcache, LongStringsAreTruncated)
+{
+    std::vector<CachedVm> vms(1);
+    vms[0].name.assign(70000, L'x');
+
+    std::vector<unsigned char> file;
+    WriteVmCache(vms, 0, file);
+
+    std::vector<CachedVm> read;
+    CHECK(ReadVmCache(file.data(), file.size(), read));
+    CHECK(read.size() == 1 && read[0].name.length() == 0xffff);
+}
+
+TEST(vmcache, EveryChangedByteIsRejected)
+{
+    std::vector<unsigned char> file;
+    WriteVmCache(MakeVms(), 42, file);
+
+    unsigned accepted = 0;
+    for (size_t i = 0; i < file.size(); ++i)
+    {
+        for (unsigned bit = 0; bit < 8; ++bit)
+        {
+            std::vector<unsigned char> corrupt = file;
+            corrupt[i] ^= (unsigned char)(1 << bit);
+            std::vector<CachedVm> read;
+            if (ReadVmCache(corrupt.data(), corrupt.size(), read))
+                ++accepted;
+        }
+    }
+    CHECK(accepted == 0);
+}
+
+TEST(vmcache, TruncatedOrExtendedIsRejected)
+{
+    std::vector<unsigned char> file;
+    WriteVmCache(MakeVms(), 42, file);
+
+    unsigned accepted = 0;
+    std::vector<CachedVm> read;
+    for (size_t size = 0; size < file.size(); ++size)
+        accepted += ReadVmCache(file.data(), size, read);
+    CHECK(accepted == 0);
+
+    file.push_back(0);
+    CHECK(!ReadVmCache(file.data(), file.size(), read));
+}
+
+TEST(vmcache, OtherVersionsAreRejected)
+{
+    std::vector<unsigned char> file;
+    WriteVmCache(MakeVms(), 42, file);
+
+    // Even with a valid checksum.
+    for (unsigned version : { 0u, c_vmCacheVersion + 1u, 0xffffu })
+    {
+        std::vector<unsigned char> other = file;
+        Put(other, 4, version, 2);
+        Reseal(other);
+        std::vector<CachedVm> read;
+        CHECK(!ReadVmCache(other.data(), other.size(), read));
+    }
+}
+
+TEST(vmcache, AppendedHeaderFieldsAreSkipped)
+{
+    const std::vector<CachedVm> vms = MakeVms();
+    std::vector<unsigned char> file;
+    WriteVmCache(vms, 42, file);
+
+    // A later writer of the same version adds 8 bytes to the header.
+    file.insert(file.begin() + 32, 8, (unsigned char)0xcc);
+    Put(file, 6, 40, 2);
+    Reseal(file);
+
+    std::vector<CachedVm> read;
+    CHECK(ReadVmCache(file.data(), file.size(), read));
+    CHECK(Equal(vms, read));
+
+    // But not a header that claims to be smaller than version 1's.
+    Put(file, 6, 24, 2);
+    Reseal(file);
+    CHECK(!ReadVmCache(file.data(), file.size(), read));
+}
+
+TEST(vmcache, BadCountsAreRejected)
+{
+    std::vector<unsigned char> file;
+    WriteVmCache(MakeVms(), 42, file);
+
+    std::vector<CachedVm> read;
+    for (unsigned long long count : { 2ull, 4ull, 0xffffffffull })
+    {
+        std::vector<unsigned char> bad = file;
+        Put(bad, 8, count, 4);
+        Reseal(bad);
+        CHECK(!ReadVmCache(bad.data(), bad.size(), read));
+        CHECK(read.empty());
+    }
+}
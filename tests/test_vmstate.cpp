@@ -0,0 +1,152 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include "../vmstate.h"
+
+// What each state is expected to look like, written out independently of
+// c_stateTable so that a change to the table has to be made here too.
+struct ExpectedState
+{
+    VmState state;
+    VmStateKind kind;
+    VmState settlesTo;
+    unsigned ops;
+};
+
+constexpr unsigned c_running = c_opsAlways | OpBit(VmOp::Stop) | OpBit(VmOp::ShutDown) |
+                               OpBit(VmOp::Save) | OpBit(VmOp::Pause) | OpBit(VmOp::Checkpoint);
+constexpr unsigned c_off = c_opsAlways | OpBit(VmOp::Start) | OpBit(VmOp::Checkpoint) | OpBit(VmOp::ApplyCheckpoint);
+constexpr unsigned c_paused = c_opsAlways | OpBit(VmOp::Start) | OpBit(VmOp::Save) | OpBit(VmOp::Checkpoint);
+
+static const ExpectedState c_expected[] =
+{
+    { VmState::Unknown,     VmStateKind::Indeterminate, VmState::Unknown,   c_opsAll },
+    { VmState::Other,       VmStateKind::Indeterminate, VmState::Unknown,   c_opsAll },
+    { VmState::Running,     VmStateKind::Stable,        VmState::Running,   c_running },
+    { VmState::Stopped,     VmStateKind::Stable,        VmState::Stopped,   c_off },
+    { VmState::ShutDown,    VmStateKind::Transitioning, VmState::Stopped,   c_opsAlways },
+    { VmState::Saved,       VmStateKind::Stable,        VmState::Saved,     c_off },
+    { VmState::Test,        VmStateKind::Indeterminate, VmState::Unknown,   c_opsAll },
+    { VmState::Defer,       VmStateKind::Indeterminate, VmState::Unknown,   c_opsAll },
+    { VmState::Paused,      VmStateKind::Stable,        VmState::Paused,    c_paused },
+    { VmState::Starting,    VmStateKind::Transitioning, VmState::Running,   c_opsAlways },
+    { VmState::Reset,       VmStateKind::Transitioning, VmState::Running,   c_opsAlways },
+    { VmState::_Starting,   VmStateKind::Transitioning, VmState::Running,   c_opsAlways },
+    { VmState::Saving,      VmStateKind::Transitioning, VmState::Saved,     c_opsAlways },
+    { VmState::Stopping,    VmStateKind::Transitioning, VmState::Stopped,   c_opsAlways },
+    { VmState::Pausing,     VmStateKind::Transitioning, VmState::Paused,    c_opsAlways },
+    { VmState::Resuming,    VmStateKind::Transitioning, VmState::Running,   c_opsAlways },
+};
+
+// Values Hyper-V doesn't report, including ones between listed states.
+static const VmState c_unlisted[] =
+{
+    VmState(5), VmState(12), VmState(32768), VmState(32771), VmState(32775), VmState(32778), VmState(0xffffffff),
+};
+
+TEST(vmstate, EveryStateIsExpected)
+{
+    CHECK(sizeof(c_expected) / sizeof(c_expected[0]) == sizeof(c_stateTable) / sizeof(c_stateTable[0]));
+
+    for (const auto& expected : c_expected)
+    {
+        const VmStateInfo* info = FindStateInfo(expected.state);
+        CHECK(info && info->state == expected.state);
+        if (!info)
+            continue;
+
+        CHECK(info->kind == expected.kind);
+        CHECK(GetSettledState(expected.state) == expected.settlesTo);
+        CHECK(GetEnabledOps(expected.state) == expected.ops);
+        CHECK(IsStableState(expected.state) == (expected.kind == VmStateKind::Stable));
+        CHECK(IsTransitioningState(expected.state) == (expected.kind == VmStateKind::Transitioning));
+    }
+}
+
+TEST(vmstate, UnlistedStatesAreIndeterminate)
+{
+    for (VmState state : c_unlisted)
+    {
+        CHECK(!FindStateInfo(state));
+        CHECK(GetEnabledOps(state) == c_opsAll);
+        CHECK(!IsStableState(state));
+        CHECK(!IsTransitioningState(state));
+        CHECK(GetSettledState(state) == VmState::Unknown);
+    }
+}
+
+TEST(vmstate, TransitionsSettleInStableStates)
+{
+    for (const auto& expected : c_expected)
+    {
+        const VmState settled = GetSettledState(expected.state);
+        if (IsTransitioningState(expected.state))
+            CHECK(IsStableState(settled) && GetSettledState(settled) == settled);
+        else if (IsStableState(expected.state))
+            CHECK(settled == expected.state);
+    }
+}
+
+TEST(vmstate, OpsLeadSomewhereElse)
+{
+    for (const auto& expected : c_expected)
+    {
+        const unsigned ops = GetEnabledOps(expected.state);
+        CHECK((ops & c_opsAlways) == c_opsAlways);
+        CHECK(!(ops & ~c_opsAll));
+        if (!IsStableState(expected.state))
+            continue;
+
+        // Nothing enabled in a stable state asks for the state it's in.
+        for (unsigned op = 0; op < unsigned(VmOp::Max); ++op)
+        {
+            if (ops & OpBit(VmOp(op)))
+                CHECK(GetSettledState(GetOpTarget(VmOp(op))) != expected.state);
+        }
+    }
+}
+
+TEST(vmstate, OpTargets)
+{
+    CHECK(GetOpTarget(VmOp::Start) == VmState::Running);
+    CHECK(GetOpTarget(VmOp::Stop) == VmState::Stopped);
+    CHECK(GetOpTarget(VmOp::ShutDown) == VmState::ShutDown);
+    CHECK(GetOpTarget(VmOp::Save) == VmState::Saved);
+    CHECK(GetOpTarget(VmOp::Pause) == VmState::Paused);
+    CHECK(GetOpTarget(VmOp::Connect) == VmState::Unknown);
+    CHECK(GetOpTarget(VmOp::Select) == VmState::Unknown);
+    CHECK(GetOpTarget(VmOp::Checkpoint) == VmState::Unknown);
+    CHECK(GetOpTarget(VmOp::ApplyCheckpoint) == VmState::Unknown);
+}
+
+TEST(vmstate, StateStrings)
+{
+    std::wstring text;
+    AppendStateString(text, VmState::Running, false/*brackets*/);
+    CHECK(text == L"Running");
+
+    text = L"VM";
+    AppendStateString(text, VmState::Saving, false/*brackets*/);
+    CHECK(text == L"VM Saving");
+
+    text = L"VM";
+    AppendStateString(text, VmState::Paused, true/*brackets*/);
+    CHECK(text == L"VM  [Paused]");
+
+    text.clear();
+    AppendStateString(text, VmState::Stopped, true/*brackets*/);
+    CHECK(text == L"[Stopped]");
+
+    // Both spellings of Starting read the same.
+    std::wstring other;
+    text.clear();
+    AppendStateString(text, VmState::Starting, false/*brackets*/);
+    AppendStateString(other, VmState::_Starting, false/*brackets*/);
+    CHECK(text == other);
+
+    // Unlisted states show their number.
+    text = L"VM";
+    AppendStateString(text, VmState(12), false/*brackets*/);
+    CHECK(text == L"VM  [12]");
+}
@@ -0,0 +1,32 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+//----------------------------------------------------------------------------
+// Minimal test harness for the Win32-free modules.
+//
+// TEST(Suite, Name) { ... } defines a test, and CHECK(expr) records a failure
+// and carries on.  hypervtray_tests runs the suites named on its command
+// line, or all of them.
+
+class TestCase
+{
+public:
+                    TestCase(const char* suite, const char* name, void (*func)());
+
+    const char*     m_suite;
+    const char*     m_name;
+    void            (*m_func)();
+    TestCase*       m_next = nullptr;
+};
+
+void ReportFailure(const char* file, int line, const char* expr);
+
+#define TEST(suite, name) \
+    static void Test_##suite##_##name(); \
+    static TestCase s_test_##suite##_##name(#suite, #name, Test_##suite##_##name); \
+    static void Test_##suite##_##name()
+
+#define CHECK(expr) \
+    do { if (!(expr)) ReportFailure(__FILE__, __LINE__, #expr); } while (false)
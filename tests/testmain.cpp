@@ -0,0 +1,64 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "testing.h"
+#include <cstdio>
+#include <cstring>
+
+static TestCase* s_first = nullptr;
+static TestCase* s_last = nullptr;
+static unsigned s_failures = 0;
+
+TestCase::TestCase(const char* suite, const char* name, void (*func)())
+: m_suite(suite)
+, m_name(name)
+, m_func(func)
+{
+    // Keep the order of each file.
+    if (s_last)
+        s_last->m_next = this;
+    else
+        s_first = this;
+    s_last = this;
+}
+
+void ReportFailure(const char* file, int line, const char* expr)
+{
+    printf("%s(%d): CHECK(%s) failed\n", file, line, expr);
+    ++s_failures;
+}
+
+static bool IsSelected(const TestCase* test, int argc, char** argv)
+{
+    if (argc < 2)
+        return true;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(test->m_suite, argv[i]))
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned run = 0;
+    unsigned failed = 0;
+    for (const TestCase* test = s_first; test; test = test->m_next)
+    {
+        if (!IsSelected(test, argc, argv))
+            continue;
+
+        const unsigned before = s_failures;
+        test->m_func();
+        ++run;
+
+        const bool ok = (s_failures == before);
+        if (!ok)
+            ++failed;
+        printf("%-6s %s.%s\n", ok ? "ok" : "FAILED", test->m_suite, test->m_name);
+    }
+
+    printf("\n%u tests, %u failed\n", run, failed);
+    return (run && !failed) ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "main.h"
+#include "trace.h"
+#include <stdio.h>
+
+bool g_tracing = false;
+
+struct TraceEvent
+{
+    const char* name;
+    LONGLONG begin;
+    LONGLONG end;
+    DWORD tid;
+};
+
+constexpr LONGLONG c_traceCapacity = 64 * 1024; // Must be a power of 2.
+static_assert((c_traceCapacity & (c_traceCapacity - 1)) == 0, "capacity must be a power of 2");
+
+static TraceEvent* s_events = nullptr;
+static volatile LONGLONG s_nextEvent = 0;
+static LONGLONG s_origin = 0;
+
+void EnableTracing()
+{
+    if (g_tracing)
+        return;
+
+    s_events = new TraceEvent[c_traceCapacity];
+    ZeroMemory(s_events, sizeof(*s_events) * c_traceCapacity);
+
+    LARGE_INTEGER origin;
+    QueryPerformanceCounter(&origin);
+    s_origin = origin.QuadPart;
+
+    g_tracing = true;
+}
+
+void RecordSpan(const char* name, LONGLONG begin)
+{
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+
+    // Claim a slot; once the buffer wraps, the oldest events are overwritten.
+    const LONGLONG index = InterlockedIncrement64(&s_nextEvent) - 1;
+    TraceEvent& event = s_events[index & (c_traceCapacity - 1)];
+    event.name = name;
+    event.begin = begin;
+    event.end = end.QuadPart;
+    event.tid = GetCurrentThreadId();
+}
+
+bool WriteTrace(LPCWSTR file)
+{
+    if (!g_tracing)
+        return false;
+
+    FILE* f = nullptr;
+    if (_wfopen_s(&f, file, L"w") || !f)
+        return false;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    const double toMicroseconds = 1000000.0 / double(freq.QuadPart);
+
+    const LONGLONG next = s_nextEvent;
+    const LONGLONG first = (next > c_traceCapacity) ? next - c_traceCapacity : 0;
+
+    fputs("{\"traceEvents\":[\n", f);
+    bool comma = false;
+    for (LONGLONG i = first; i < next; ++i)
+    {
+        const TraceEvent& event = s_events[i & (c_traceCapacity - 1)];
+        if (!event.name)
+            continue;
+
+        fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}\n",
+                comma ? "," : "",
+                event.name,
+                GetCurrentProcessId(),
+                event.tid,
+                double(event.begin - s_origin) * toMicroseconds,
+                double(event.end - event.begin) * toMicroseconds);
+        comma = true;
+    }
+    fputs("],\"displayTimeUnit\":\"ms\"}\n", f);
+
+    fclose(f);
+    return true;
+}
@@ -0,0 +1,44 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "main.h"
+
+//----------------------------------------------------------------------------
+// Lightweight span tracing.
+//
+// Spans are recorded into a fixed size in-memory ring buffer without taking
+// locks, and can be written out in Chrome trace-event JSON format (load it in
+// chrome://tracing or https://ui.perfetto.dev).  When tracing is disabled, a
+// TraceSpan costs one load and one branch.  Span names must be string
+// literals (or otherwise outlive the trace).
+
+extern bool g_tracing;
+
+void EnableTracing();
+void RecordSpan(const char* name, LONGLONG begin);
+bool WriteTrace(LPCWSTR file);
+
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char* name)
+    : m_name(g_tracing ? name : nullptr)
+    {
+        if (m_name)
+        {
+            LARGE_INTEGER begin;
+            QueryPerformanceCounter(&begin);
+            m_begin = begin.QuadPart;
+        }
+    }
+    ~TraceSpan() { if (m_name) RecordSpan(m_name, m_begin); }
+
+private:
+    const char* const m_name;
+    LONGLONG m_begin = 0;
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
@@ -0,0 +1,178 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "vmcache.h"
+
+constexpr unsigned c_magic = 0x43545648;        // "HVTC"
+constexpr unsigned short c_headerSize = 32;
+
+constexpr size_t c_checksumOffset = 24;
+
+static unsigned Checksum(const unsigned char* data, size_t size, unsigned hash=2166136261u)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Covers the whole file except the checksum field itself.
+static unsigned FileChecksum(const unsigned char* header, size_t headerSize, const unsigned char* payload, size_t payloadSize)
+{
+    unsigned hash = Checksum(header, c_checksumOffset);
+    hash = Checksum(header + c_checksumOffset + 4, headerSize - c_checksumOffset - 4, hash);
+    return Checksum(payload, payloadSize, hash);
+}
+
+static void Put(std::vector<unsigned char>& out, unsigned long long value, unsigned bytes)
+{
+    for (unsigned i = 0; i < bytes; ++i)
+        out.push_back((unsigned char)(value >> (i * 8)));
+}
+
+static void PutString(std::vector<unsigned char>& out, const std::wstring& s)
+{
+    const size_t len = s.length() < 0xffff ? s.length() : 0xffff;
+    Put(out, len, 2);
+    for (size_t i = 0; i < len; ++i)
+        Put(out, (unsigned short)s[i], 2);
+}
+
+void WriteVmCache(const std::vector<CachedVm>& vms, unsigned long long savedTime, std::vector<unsigned char>& out)
+{
+    std::vector<unsigned char> payload;
+    for (const auto& vm : vms)
+    {
+        PutString(payload, vm.host);
+        PutString(payload, vm.id);
+        PutString(payload, vm.name);
+        Put(payload, unsigned(vm.state), 2);
+    }
+
+    out.clear();
+    out.reserve(c_headerSize + payload.size());
+    Put(out, c_magic, 4);
+    Put(out, c_vmCacheVersion, 2);
+    Put(out, c_headerSize, 2);
+    Put(out, vms.size(), 4);
+    Put(out, payload.size(), 4);
+    Put(out, savedTime, 8);
+    Put(out, 0, 4);                     // Checksum, filled in below.
+    Put(out, 0, 4);
+    out.insert(out.end(), payload.begin(), payload.end());
+
+    const unsigned checksum = FileChecksum(out.data(), c_headerSize, out.data() + c_headerSize, payload.size());
+    for (unsigned i = 0; i < 4; ++i)
+        out[c_checksumOffset + i] = (unsigned char)(checksum >> (i * 8));
+}
+
+// Bounds-checked little-endian reader; once anything is out of range, every
+// later read fails too.
+class CacheReader
+{
+public:
+    CacheReader(const unsigned char* data, size_t size) : m_data(data), m_size(size) {}
+
+    bool Get(unsigned long long& value, unsigned bytes)
+    {
+        if (m_size - m_pos < bytes)
+        {
+            m_pos = m_size;
+            m_ok = false;
+        }
+        if (!m_ok)
+            return false;
+
+        value = 0;
+        for (unsigned i = 0; i < bytes; ++i)
+            value |= (unsigned long long)m_data[m_pos + i] << (i * 8);
+        m_pos += bytes;
+        return true;
+    }
+
+    bool GetString(std::wstring& s)
+    {
+        unsigned long long len;
+        if (!Get(len, 2))
+            return false;
+        if (m_size - m_pos < len * 2)
+        {
+            m_pos = m_size;
+            m_ok = false;
+            return false;
+        }
+
+        s.clear();
+        s.reserve(size_t(len));
+        for (size_t i = 0; i < len; ++i)
+        {
+            s.push_back(wchar_t(m_data[m_pos] | (m_data[m_pos + 1] << 8)));
+            m_pos += 2;
+        }
+        return true;
+    }
+
+    size_t Remaining() const { return m_size - m_pos; }
+
+private:
+    const unsigned char* const m_data;
+    const size_t m_size;
+    size_t m_pos = 0;
+    bool m_ok = true;
+};
+
+bool ReadVmCache(const unsigned char* data, size_t size, std::vector<CachedVm>& out, unsigned long long* pSavedTime)
+{
+    out.clear();
+
+    CacheReader header(data, size);
+    unsigned long long magic, version, headerSize, count, payloadSize, savedTime, checksum;
+    if (!header.Get(magic, 4) ||
+        !header.Get(version, 2) ||
+        !header.Get(headerSize, 2) ||
+        !header.Get(count, 4) ||
+        !header.Get(payloadSize, 4) ||
+        !header.Get(savedTime, 8) ||
+        !header.Get(checksum, 4))
+        return false;
+
+    if (magic != c_magic || version != c_vmCacheVersion)
+        return false;
+    if (headerSize < c_headerSize || headerSize > size || payloadSize != size - headerSize)
+        return false;
+
+    const unsigned char* const payload = data + headerSize;
+    if (FileChecksum(data, size_t(headerSize), payload, size_t(payloadSize)) != checksum)
+        return false;
+
+    // Each record is at least 8 bytes, so a bogus count can't make the
+    // reserve huge.
+    if (count > payloadSize / 8)
+        return false;
+
+    std::vector<CachedVm> vms;
+    vms.reserve(size_t(count));
+
+    CacheReader reader(payload, size_t(payloadSize));
+    for (unsigned long long i = 0; i < count; ++i)
+    {
+        CachedVm vm;
+        unsigned long long state;
+        if (!reader.GetString(vm.host) ||
+            !reader.GetString(vm.id) ||
+            !reader.GetString(vm.name) ||
+            !reader.Get(state, 2))
+            return false;
+        vm.state = VmState(state);
+        vms.emplace_back(std::move(vm));
+    }
+    if (reader.Remaining())
+        return false;
+
+    out = std::move(vms);
+    if (pSavedTime)
+        *pSavedTime = savedTime;
+    return true;
+}
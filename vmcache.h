@@ -0,0 +1,39 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include "vmstate.h"
+#include <string>
+#include <vector>
+
+//----------------------------------------------------------------------------
+// File format for the last-known VM list.
+//
+// The file is a header (32 bytes in version 1) and one record per VM.  All
+// integers are little-endian, and strings are a 16-bit count of UTF-16 code
+// units followed by the code units, so the format doesn't depend on the
+// compiler or platform.  (Where wchar_t is wider than 16 bits, characters
+// outside the BMP don't round trip.)
+//
+//  Header:     u32 magic, u16 version, u16 header size, u32 count,
+//              u32 payload size, u64 saved time, u32 checksum, u32 reserved.
+//  Record:     str host, str id, str name, u16 state.
+//
+// The checksum is FNV-1a over the rest of the file.  A reader rejects a file
+// with a bad magic, a different version, a bad checksum, or any record that
+// doesn't fit.  Fields may be appended to the header without changing the
+// version, since readers skip to the header size.
+
+struct CachedVm
+{
+    std::wstring host;
+    std::wstring id;
+    std::wstring name;
+    VmState state = VmState::Unknown;
+};
+
+constexpr unsigned short c_vmCacheVersion = 1;
+
+void WriteVmCache(const std::vector<CachedVm>& vms, unsigned long long savedTime, std::vector<unsigned char>& out);
+bool ReadVmCache(const unsigned char* data, size_t size, std::vector<CachedVm>& out, unsigned long long* pSavedTime=nullptr);
@@ -3,8 +3,16 @@
 
 #include "main.h"
 #include "vms.h"
+#include "trace.h"
+#include "flatmap.h"
+#include "vmcache.h"
+#include "propreader.h"
+#include "refill.h"
+#include "refreshgate.h"
+#include "requestqueue.h"
 #include <atlcomcli.h>
 #include <algorithm>
+#include <map>
 #include <shellapi.h>
 
 void LaunchManager(HWND hwnd)
@@ -54,7 +62,7 @@ void LaunchManager(HWND hwnd)
     CloseHandle(sei.hProcess);
 }
 
-void VmConnect(IWbemClassObject* pObject)
+void VmConnect(const VmSnapshot& vm)
 {
     WCHAR appname[1024] = { 0 };
     DWORD dw = GetEnvironmentVariableW(L"SYSTEMROOT", appname, _countof(appname));
@@ -63,12 +71,8 @@ void VmConnect(IWbemClassObject* pObject)
     if (wcscat_s(appname, L"\\System32\\vmconnect.exe"))
         return;
 
-    std::wstring name;
-    if (!GetStringProp(pObject, L"ElementName", name))
-        return;
-
     WCHAR command[1024];
-    if (swprintf_s(command, L"\"%s\" localhost \"%s\"", appname, name.c_str()) < 0)
+    if (swprintf_s(command, L"\"%s\" %s \"%s\"", appname, vm.host.empty() ? L"localhost" : vm.host.c_str(), vm.name.c_str()) < 0)
         return;
 
     const DWORD dwCreationFlags = 0;
@@ -89,216 +93,1589 @@ void VmConnect(IWbemClassObject* pObject)
     CloseHandle(pi.hProcess);
 }
 
-static HRESULT GetShutdownComponent(IWbemServices* pServices, IWbemClassObject* pObject, IWbemClassObject** ppShutdownComponent)
+WmiSession::WmiSession(LPCWSTR ns)
+: m_namespace(ns)
+, m_session(*this)
+{
+}
+
+HRESULT WmiSession::GetServices(IWbemServices** ppServices)
+{
+    Session::Connection connection;
+    const HRESULT hr = m_session.GetConnection(connection);
+    *ppServices = static_cast<IWbemServices*>(connection.get());
+    if (*ppServices)
+        (*ppServices)->AddRef();
+    return hr;
+}
+
+bool WmiSession::TripsBreaker(SessionResult result) const
+{
+    // A cancelled call counts as a failure, so a trial call that's cancelled
+    // doesn't leave the breaker half open forever.
+    return IsNotResponding(result) || result == HRESULT_FROM_WIN32(ERROR_CANCELLED);
+}
+
+bool WmiSession::IsNotResponding(HRESULT hr)
+{
+    return hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT) || IsDisconnected(hr);
+}
+
+bool WmiSession::IsDisconnected(HRESULT hr)
+{
+    switch (hr)
+    {
+    case RPC_E_DISCONNECTED:
+    case RPC_E_SERVER_DIED:
+    case RPC_E_SERVER_DIED_DNE:
+    case HRESULT_FROM_WIN32(RPC_S_SERVER_UNAVAILABLE):
+    case HRESULT_FROM_WIN32(RPC_S_CALL_FAILED):
+    case HRESULT_FROM_WIN32(RPC_S_CALL_FAILED_DNE):
+    case WBEM_E_TRANSPORT_FAILURE:
+    case WBEM_E_SHUTTING_DOWN:
+        return true;
+    }
+    return false;
+}
+
+// Waits are sliced so that cancellation is noticed within this long.
+constexpr long c_waitSlice = 250;
+
+// How long a query, or a method call (which can take longer, e.g. a synchronous
+// shutdown), may take before it's abandoned as not responding.
+constexpr ULONGLONG c_callTimeout = 10000;
+constexpr ULONGLONG c_methodTimeout = 30000;
+
+WmiDeadline::WmiDeadline(const WmiSession& session, ULONGLONG timeout)
+: m_session(session)
+, m_due(GetTickCount64() + timeout)
+, m_generation(session.GetGeneration())
+{
+}
+
+long WmiDeadline::Slice() const
+{
+    const ULONGLONG now = GetTickCount64();
+    if (now >= m_due || m_session.GetGeneration() != m_generation)
+        return 0;
+    return long(std::min<ULONGLONG>(m_due - now, c_waitSlice));
+}
+
+bool WmiDeadline::Expired() const
+{
+    return GetTickCount64() >= m_due || m_session.GetGeneration() != m_generation;
+}
+
+HRESULT WmiDeadline::Status() const
+{
+    if (m_session.GetGeneration() != m_generation)
+        return HRESULT_FROM_WIN32(ERROR_CANCELLED);
+    return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+}
+
+HRESULT NextObjects(IEnumWbemClassObject* pEnum, const WmiDeadline& deadline, ULONG count, IWbemClassObject** objects, ULONG* pReturned)
+{
+    while (true)
+    {
+        *pReturned = 0;
+        const HRESULT hr = pEnum->Next(deadline.Slice(), count, objects, pReturned);
+        if (hr != WBEM_S_TIMEDOUT || *pReturned)
+            return hr;
+        if (deadline.Expired())
+            return deadline.Status();
+    }
+}
+
+HRESULT WaitForCallResult(IWbemCallResult* pCallResult, const WmiDeadline& deadline)
+{
+    while (true)
+    {
+        HRESULT hrCall = S_OK;
+        const HRESULT hr = pCallResult->GetCallStatus(deadline.Slice(), &hrCall);
+        if (hr == WBEM_S_NO_ERROR)
+            return hrCall;
+        if (hr != WBEM_S_TIMEDOUT)
+            return hr;
+        if (deadline.Expired())
+            return deadline.Status();
+    }
+}
+
+// ConnectServer can't be cancelled and may wait a long time for a host that
+// doesn't answer, so it runs on a pool thread while the caller waits under a
+// deadline.  Whichever of the two finishes last frees the attempt.
+struct ConnectAttempt
+{
+    std::wstring ns;
+    SHandle done;
+    HRESULT hr = E_FAIL;
+    SPI<IWbemServices> spServices;
+    volatile LONG refs = 2;
+
+    void Release()
+    {
+        if (!InterlockedDecrement(&refs))
+            delete this;
+    }
+};
+
+static void CALLBACK ConnectCallback(PTP_CALLBACK_INSTANCE /*instance*/, void* context)
+{
+    ConnectAttempt* const pAttempt = static_cast<ConnectAttempt*>(context);
+
+    const HRESULT hrInit = CoInitializeEx(0, COINIT_MULTITHREADED);
+
+    HRESULT hr;
+    SPI<IWbemLocator> spLocator;
+    {
+        TraceSpan span("CoCreateInstance(WbemLocator)");
+        hr = CoCreateInstance(CLSID_WbemLocator, 0, CLSCTX_INPROC_SERVER, IID_IWbemLocator, (void**)&spLocator);
+    }
+    if (SUCCEEDED(hr))
+    {
+        TraceSpan span("ConnectServer");
+        hr = spLocator->ConnectServer(BSTR(pAttempt->ns.c_str()), 0, 0, 0, WBEM_FLAG_CONNECT_USE_MAX_WAIT, 0, 0, &pAttempt->spServices);
+    }
+
+    pAttempt->hr = hr;
+    spLocator.Release();
+    SetEvent(pAttempt->done);
+    pAttempt->Release();
+
+    if (SUCCEEDED(hrInit))
+        CoUninitialize();
+}
+
+SessionResult WmiSession::Connect(Connection& out)
 {
     HRESULT hr;
 
+    ConnectAttempt* const pAttempt = new ConnectAttempt;
+    pAttempt->ns = m_namespace;
+    pAttempt->done = CreateEvent(nullptr, true, false, nullptr);
+    if (!pAttempt->done)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        delete pAttempt;
+        return hr;
+    }
+
+    if (!TrySubmitThreadpoolCallback(ConnectCallback, pAttempt, nullptr))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        delete pAttempt;
+        return hr;
+    }
+
+    SPI<IWbemServices> spServices;
+    const WmiDeadline deadline(*this, c_callTimeout);
+    while (true)
+    {
+        if (WaitForSingleObject(pAttempt->done, deadline.Slice()) == WAIT_OBJECT_0)
+        {
+            hr = pAttempt->hr;
+            spServices = pAttempt->spServices.Transfer();
+            break;
+        }
+        if (deadline.Expired())
+        {
+            // Abandon the attempt; the pool thread frees it when it's done.
+            hr = deadline.Status();
+            break;
+        }
+    }
+
+    pAttempt->Release();
+    if (FAILED(hr))
+        return hr;
+
+    {
+        TraceSpan span("CoSetProxyBlanket");
+        hr = CoSetProxyBlanket(spServices, RPC_C_AUTHN_WINNT, RPC_C_AUTHZ_NONE, 0, RPC_C_AUTHN_LEVEL_CALL, RPC_C_IMP_LEVEL_IMPERSONATE, 0, EOAC_NONE);
+    }
+    if (FAILED(hr))
+        return hr;
+
+    out = Connection(spServices.Transfer(), [](void* p) {
+        static_cast<IWbemServices*>(p)->Release();
+    });
+    return S_OK;
+}
+
+HRESULT InitCom()
+{
+    HRESULT hr = CoInitializeEx(0, COINIT_MULTITHREADED);
+    if (SUCCEEDED(hr))
+        hr = InitComSecurity();
+    return hr;
+}
+
+HRESULT InitComSecurity()
+{
+    TraceSpan span("CoInitializeSecurity");
+    return CoInitializeSecurity(
+        NULL,                        // Security descriptor
+        -1,                          // COM negotiates authentication service
+        NULL,                        // Authentication services
+        NULL,                        // Reserved
+        RPC_C_AUTHN_LEVEL_DEFAULT,   // Default authentication level for proxies
+        RPC_C_IMP_LEVEL_IMPERSONATE, // Default Impersonation level for proxies
+        NULL,                        // Authentication info
+        EOAC_NONE,                   // Additional capabilities of the client or server
+        NULL);                       // Reserved
+}
+
+// Sink for a subscription, which notes when the subscription has ended.
+class SubscriptionSink : public ObjectSink
+{
+public:
+    bool IsEnded() const { return m_ended != 0; }
+
+protected:
+    void SetEnded() { InterlockedExchange(&m_ended, 1); }
+
+private:
+    volatile LONG m_ended = 0;
+};
+
+// Per-host state.  The list of hosts is fixed by SetHosts() before any
+// background work starts, so it can be read without a lock.
+
+static const WCHAR c_namespace[] = L"ROOT\\Virtualization\\V2";
+
+static std::wstring GetNamespace(const std::wstring& host)
+{
+    if (host.empty())
+        return c_namespace;
+
+    std::wstring ns(L"\\\\");
+    ns.append(host);
+    ns.append(L"\\");
+    ns.append(c_namespace);
+    return ns;
+}
+
+struct HostState
+{
+    HostState(const std::wstring& _host) : host(_host), session(GetNamespace(_host).c_str()) {}
+
+    const std::wstring host;
+    WmiSession session;
+
+    // Lets only one refresh of the host run at a time.
+    RefreshGate refresh;
+
+    // Only touched by the host's refresh, which never runs concurrently with
+    // itself.
+    std::wstring managementService;
+    FlatMap<std::wstring, VmStats> stats;
+    ULONGLONG statsTime = 0;
+    VirtualMachines spare;      // The list before last, for the next refresh to refill.
+
+    // Guarded by s_cacheLock.
+    VirtualMachines vms;
+    HRESULT hr = S_OK;
+    bool reported = false;
+
+    // Event subscription.  Subscribing happens on pool threads and
+    // unsubscribing on the UI thread, so these are swapped under eventLock
+    // and the calls are cancelled outside it.
+    SRWLOCK eventLock = SRWLOCK_INIT;
+    SPI<IWbemServices> spEventServices;
+    SPI<SubscriptionSink> spEventSink;
+    bool eventsClosed = false;      // Unsubscribed for good.
+};
+
+static std::vector<std::unique_ptr<HostState>> s_hosts;
+
+void SetHosts(const std::vector<std::wstring>& hosts)
+{
+    assert(s_hosts.empty());
+
+    for (const auto& host : hosts)
+    {
+        const bool local = (host.empty() || host == L".");
+        s_hosts.emplace_back(new HostState(local ? std::wstring() : host));
+    }
+    if (s_hosts.empty())
+        s_hosts.emplace_back(new HostState(std::wstring()));
+}
+
+size_t GetHostCount()
+{
+    return s_hosts.size();
+}
+
+WmiSession& GetSession(const std::wstring& host)
+{
+    for (const auto& state : s_hosts)
+    {
+        if (state->host == host)
+            return state->session;
+    }
+
+    // Headless commands don't call SetHosts().
+    assert(host.empty());
+    static WmiSession s_local(c_namespace);
+    return s_local;
+}
+
+// The in-parameter definitions for methods and the shutdown component for
+// each VM essentially never change, so they're cached to reduce a state
+// change to a single ExecMethod round trip.  Class definitions are local
+// objects (not proxies), so they survive reconnecting.
+
+struct ShutdownComponentEntry
+{
+    std::wstring vmPath;        // Detects a VM that was re-created with the same GUID.
     std::wstring path;
-    if (!GetStringProp(pObject, L"__RELPATH", path))
-        return E_FAIL;
+};
+
+static SRWLOCK s_methodCacheLock = SRWLOCK_INIT;
+static std::map<std::wstring, SPI<IWbemClassObject>> s_inParamsDefinitions;
+static std::map<std::wstring, ShutdownComponentEntry> s_shutdownComponents;
+
+static HRESULT GetShutdownComponentPath(IWbemServices* pServices, const WmiDeadline& deadline, const VmSnapshot& vm, std::wstring& out)
+{
+    HRESULT hr;
+
+    AcquireSRWLockShared(&s_methodCacheLock);
+    const auto cached = s_shutdownComponents.find(vm.id);
+    const bool found = (cached != s_shutdownComponents.end() && cached->second.vmPath == vm.path);
+    if (found)
+        out = cached->second.path;
+    ReleaseSRWLockShared(&s_methodCacheLock);
+    if (found)
+        return S_OK;
 
     WCHAR query[1024];
-    swprintf_s(query, L"associators of {%s} where AssocClass=Msvm_SystemDevice ResultClass=Msvm_ShutdownComponent", BSTR(path.c_str()));
+    if (swprintf_s(query, L"associators of {%s} where AssocClass=Msvm_SystemDevice ResultClass=Msvm_ShutdownComponent", vm.path.c_str()) < 0)
+        return E_FAIL;
 
     SPI<IEnumWbemClassObject> spEnum;
-    const long flags = WBEM_FLAG_FORWARD_ONLY;
-    hr = pServices->ExecQuery(BSTR(L"WQL"), BSTR(query), flags, 0, &spEnum);
+    const long flags = WBEM_FLAG_FORWARD_ONLY|WBEM_FLAG_RETURN_IMMEDIATELY;
+    {
+        TraceSpan span("ExecQuery(ShutdownComponent)");
+        hr = pServices->ExecQuery(BSTR(L"WQL"), BSTR(query), flags, 0, &spEnum);
+    }
     if (FAILED(hr))
         return hr;
 
     ULONG uReturned = 0;
-    hr = spEnum->Next(WBEM_INFINITE, 1, ppShutdownComponent, &uReturned);
+    SPI<IWbemClassObject> spShutdownComponent;
+    {
+        TraceSpan span("Next(ShutdownComponent)");
+        hr = NextObjects(spEnum, deadline, 1, &spShutdownComponent, &uReturned);
+    }
     if (FAILED(hr))
         return hr;
     if (!uReturned)
         return E_FAIL;
 
+    if (!GetStringProp(spShutdownComponent, L"__PATH", out))
+        return E_FAIL;
+
+    AcquireSRWLockExclusive(&s_methodCacheLock);
+    auto& entry = s_shutdownComponents[vm.id];
+    entry.vmPath = vm.path;
+    entry.path = out;
+    ReleaseSRWLockExclusive(&s_methodCacheLock);
+
     return S_OK;
 }
 
-static HRESULT GetMethodParams(IWbemServices* pServices, LPCWSTR objectPath, LPCWSTR methodName, IWbemClassObject** ppInParams)
+static void InvalidateShutdownComponent(const std::wstring& id)
+{
+    AcquireSRWLockExclusive(&s_methodCacheLock);
+    s_shutdownComponents.erase(id);
+    ReleaseSRWLockExclusive(&s_methodCacheLock);
+}
+
+// Drops cached shutdown components for VMs that no longer exist.
+static void PruneShutdownComponents(const VirtualMachines& vms)
+{
+    AcquireSRWLockExclusive(&s_methodCacheLock);
+    for (auto iter = s_shutdownComponents.begin(); iter != s_shutdownComponents.end();)
+    {
+        const auto vm = std::find_if(vms.begin(), vms.end(), [&](const VmSnapshot& vm) {
+            return vm.id == iter->first;
+        });
+        if (vm == vms.end() || vm->path != iter->second.vmPath)
+            iter = s_shutdownComponents.erase(iter);
+        else
+            ++iter;
+    }
+    ReleaseSRWLockExclusive(&s_methodCacheLock);
+}
+
+HRESULT GetServicePath(IWbemServices* pServices, const WmiDeadline& deadline, LPCWSTR className, std::wstring& out)
 {
     HRESULT hr;
 
-    SPI<IWbemClassObject> spClass;
-    hr = pServices->GetObject(BSTR(objectPath), 0, 0, &spClass, 0);
-    if (FAILED(hr))
-        return hr;
+    std::wstring query(L"SELECT * FROM ");
+    query.append(className);
 
-    SPI<IWbemClassObject> spInParamsDefinition;
-    hr = spClass->GetMethod(methodName, 0, &spInParamsDefinition, NULL);
+    SPI<IEnumWbemClassObject> spEnum;
+    const long flags = WBEM_FLAG_FORWARD_ONLY|WBEM_FLAG_RETURN_IMMEDIATELY;
+    {
+        TraceSpan span("ExecQuery(service)");
+        hr = pServices->ExecQuery(BSTR(L"WQL"), BSTR(query.c_str()), flags, 0, &spEnum);
+    }
     if (FAILED(hr))
         return hr;
 
-    hr = spInParamsDefinition->SpawnInstance(0, ppInParams);
+    ULONG uReturned = 0;
+    SPI<IWbemClassObject> spService;
+    {
+        TraceSpan span("Next(service)");
+        hr = NextObjects(spEnum, deadline, 1, &spService, &uReturned);
+    }
     if (FAILED(hr))
         return hr;
+    if (!uReturned)
+        return E_FAIL;
+
+    if (!GetStringProp(spService, L"__PATH", out))
+        return E_FAIL;
 
     return S_OK;
 }
 
-static HRESULT ExecMethod(IWbemServices* pServices, IWbemClassObject* pObject, LPCWSTR methodName, IWbemClassObject* pInParams, IWbemClassObject** ppOutParams)
+HRESULT GetMethodParams(IWbemServices* pServices, const WmiDeadline& deadline, LPCWSTR className, LPCWSTR methodName, IWbemClassObject** ppInParams)
 {
     HRESULT hr;
 
-    std::wstring path;
-    if (!GetStringProp(pObject, L"__PATH", path))
-        return E_FAIL;
+    std::wstring key(className);
+    key.append(L".");
+    key.append(methodName);
+
+    SPI<IWbemClassObject> spInParamsDefinition;
+
+    AcquireSRWLockShared(&s_methodCacheLock);
+    const auto cached = s_inParamsDefinitions.find(key);
+    if (cached != s_inParamsDefinitions.end())
+        spInParamsDefinition.Set(cached->second);
+    ReleaseSRWLockShared(&s_methodCacheLock);
+
+    if (!spInParamsDefinition)
+    {
+        SPI<IWbemCallResult> spCallResult;
+        {
+            TraceSpan span("GetObject(class)");
+            hr = pServices->GetObject(BSTR(className), WBEM_FLAG_RETURN_IMMEDIATELY, 0, nullptr, &spCallResult);
+            if (SUCCEEDED(hr))
+                hr = WaitForCallResult(spCallResult, deadline);
+        }
+        if (FAILED(hr))
+            return hr;
+
+        SPI<IWbemClassObject> spClass;
+        hr = spCallResult->GetResultObject(0, &spClass);
+        if (FAILED(hr))
+            return hr;
+
+        {
+            TraceSpan span("GetMethod");
+            hr = spClass->GetMethod(methodName, 0, &spInParamsDefinition, NULL);
+        }
+        if (FAILED(hr))
+            return hr;
+
+        AcquireSRWLockExclusive(&s_methodCacheLock);
+        s_inParamsDefinitions[key].Set(spInParamsDefinition);
+        ReleaseSRWLockExclusive(&s_methodCacheLock);
+    }
 
-    hr = pServices->ExecMethod(BSTR(path.c_str()), BSTR(methodName), 0, 0, pInParams, ppOutParams, 0);
+    hr = spInParamsDefinition->SpawnInstance(0, ppInParams);
     if (FAILED(hr))
         return hr;
 
     return S_OK;
 }
 
-void ChangeVmState(IWbemClassObject* pObject, VmState requestedState)
+HRESULT ExecMethod(IWbemServices* pServices, const WmiDeadline& deadline, LPCWSTR objectPath, LPCWSTR methodName, IWbemClassObject* pInParams, IWbemClassObject** ppOutParams)
 {
-    auto vms = GetVirtualMachines();
+    HRESULT hr;
 
-    SPI<IWbemLocator> spLocator;
-    if (FAILED(CoCreateInstance(CLSID_WbemLocator, 0, CLSCTX_INPROC_SERVER, IID_IWbemLocator, (void**)&spLocator)))
-        return;
+    SPI<IWbemCallResult> spCallResult;
+    {
+        TraceSpan span("ExecMethod");
+        hr = pServices->ExecMethod(BSTR(objectPath), BSTR(methodName), WBEM_FLAG_RETURN_IMMEDIATELY, 0, pInParams, nullptr, &spCallResult);
+        if (SUCCEEDED(hr))
+            hr = WaitForCallResult(spCallResult, deadline);
+    }
+    if (FAILED(hr))
+        return hr;
 
-    SPI<IWbemServices> spServices;
-    if (FAILED(spLocator->ConnectServer(BSTR(L"ROOT\\Virtualization\\V2"), 0, 0, 0, 0, 0, 0, &spServices)))
-        return;
+    // For ExecMethod, the result object is the output parameters.
+    return spCallResult->GetResultObject(0, ppOutParams);
+}
+
+// Resolves the target object path, method name, and input parameters for a
+// state change request.
+static HRESULT PrepareStateChange(IWbemServices* pServices, const WmiDeadline& deadline, const VmSnapshot& vm, VmState requestedState, std::wstring& path, LPCWSTR& method, IWbemClassObject** ppInParams)
+{
+    HRESULT hr;
 
     SPI<IWbemClassObject> spInParams;
     if (requestedState == VmState::Stopped)
     {
-        if (FAILED(GetMethodParams(spServices, L"Msvm_ShutdownComponent", L"InitiateShutdown", &spInParams)))
-            return;
+        method = L"InitiateShutdown";
+        hr = GetMethodParams(pServices, deadline, L"Msvm_ShutdownComponent", method, &spInParams);
+        if (FAILED(hr))
+            return hr;
 
-        if (FAILED(spInParams->Put(L"Force", 0, &CComVariant(true), 0)))
-            return;
-        if (FAILED(spInParams->Put(L"Reason", 0, &CComVariant(L"Shutdown"), 0)))
-            return;
+        if (FAILED(hr = spInParams->Put(L"Force", 0, &CComVariant(true), 0)))
+            return hr;
+        if (FAILED(hr = spInParams->Put(L"Reason", 0, &CComVariant(L"Shutdown"), 0)))
+            return hr;
 
-        SPI<IWbemClassObject> spShutdownComponent;
-        if (FAILED(GetShutdownComponent(spServices, pObject, &spShutdownComponent)))
-            return;
-        if (FAILED(ExecMethod(spServices, spShutdownComponent, L"InitiateShutdown", spInParams, 0)))
-            return;
+        hr = GetShutdownComponentPath(pServices, deadline, vm, path);
+        if (FAILED(hr))
+            return hr;
     }
     else
     {
-        if (FAILED(GetMethodParams(spServices, L"Msvm_ComputerSystem", L"RequestStateChange", &spInParams)))
-            return;
+        method = L"RequestStateChange";
+        hr = GetMethodParams(pServices, deadline, L"Msvm_ComputerSystem", method, &spInParams);
+        if (FAILED(hr))
+            return hr;
 
         VARIANT vt;
         VariantInit(&vt);
         vt.vt = VT_I4;
-        vt.iVal = INT(requestedState);
-        if (FAILED(spInParams->Put(L"RequestedState", 0, &vt, 0)))
-        {
-            VariantClear(&vt);
-            return;
-        }
+        vt.lVal = INT(requestedState);
+        hr = spInParams->Put(L"RequestedState", 0, &vt, 0);
         VariantClear(&vt);
+        if (FAILED(hr))
+            return hr;
 
-        SPI<IWbemClassObject> spOutParams;
-        if (FAILED(ExecMethod(spServices, pObject, L"RequestStateChange", spInParams, &spOutParams)))
-            return;
-
-        // TODO: handle response from request to change.
-        // https://docs.microsoft.com/en-us/windows/desktop/hyperv_v2/requeststatechange-msvm-computersystem
+        path = vm.path;
     }
+
+    *ppInParams = spInParams.Transfer();
+    return S_OK;
 }
 
-VirtualMachines GetVirtualMachines()
+HRESULT ChangeVmState(const VmSnapshot& vm, VmState requestedState, std::wstring* job)
 {
-    HRESULT hr;
-    VirtualMachines vms;
+    if (job)
+        job->clear();
 
+    WmiSession& session = GetSession(vm.host);
+    return session.Call([&](IWbemServices* pServices) -> HRESULT
     {
-        SPI<IWbemLocator> spLocator;
-        hr = CoCreateInstance(CLSID_WbemLocator, 0, CLSCTX_INPROC_SERVER, IID_IWbemLocator, (void**)&spLocator);
-        if (FAILED(hr))
-            goto LOut;
+        HRESULT hr;
 
-        SPI<IWbemServices> spServices;
-        hr = spLocator->ConnectServer(BSTR(L"ROOT\\Virtualization\\V2"), 0, 0, 0, 0, 0, 0, &spServices);
+        const WmiDeadline deadline(session, c_methodTimeout);
+
+        std::wstring path;
+        LPCWSTR method;
+        SPI<IWbemClassObject> spInParams;
+        hr = PrepareStateChange(pServices, deadline, vm, requestedState, path, method, &spInParams);
         if (FAILED(hr))
-            goto LOut;
+            return hr;
 
-        hr = CoSetProxyBlanket(spServices, RPC_C_AUTHN_WINNT, RPC_C_AUTHZ_NONE, 0, RPC_C_AUTHN_LEVEL_CALL, RPC_C_IMP_LEVEL_IMPERSONATE, 0, EOAC_NONE);
+        SPI<IWbemClassObject> spOutParams;
+        hr = ExecMethod(pServices, deadline, path.c_str(), method, spInParams, &spOutParams);
+        if (hr == WBEM_E_NOT_FOUND || hr == WBEM_E_INVALID_OBJECT_PATH)
+            InvalidateShutdownComponent(vm.id);
         if (FAILED(hr))
-            goto LOut;
+            return hr;
 
-        // Enumerate the available virtual machines.
+        // 0 means completed and 4096 means a job was started; anything else
+        // is an error.  QueueStateChange() reports the job for tracking.
+        // https://docs.microsoft.com/en-us/windows/desktop/hyperv_v2/requeststatechange-msvm-computersystem
+        ULONG returnValue = 0;
+        if (spOutParams)
+            GetIntegerProp(spOutParams, L"ReturnValue", returnValue);
+        if (returnValue != 0 && returnValue != 4096)
+            return WBEM_E_FAILED;
 
-        SPI<IEnumWbemClassObject> spEnum;
-        const long flags = WBEM_FLAG_FORWARD_ONLY;//WBEM_FLAG_RETURN_IMMEDIATELY|WBEM_FLAG_FORWARD_ONLY;
-        hr = spServices->ExecQuery(BSTR(L"WQL"), L"SELECT * FROM Msvm_ComputerSystem WHERE Caption=\"Virtual Machine\"", flags, 0, &spEnum);
-        if (FAILED(hr))
-            goto LOut;
+        if (returnValue == 4096 && job)
+            GetStringProp(spOutParams, L"Job", *job);
+        return S_OK;
+    });
+}
 
-        while (spEnum)
-        {
-            ULONG uReturned = 0;
-            SPI<IWbemClassObject> spObject;
-            hr = spEnum->Next(WBEM_INFINITE, 1, &spObject, &uReturned);
-            if (FAILED(hr) || !uReturned)
-                break;
+// Asynchronous state changes.  Requests are queued and issued from pool
+// threads, with at most --concurrency in flight at once (see RequestQueue).
+// Each completion is posted to the UI thread as a VmRequestResult.
 
-            std::wstring name;
-            if (!GetStringProp(spObject, L"ElementName", name))
-                continue;
+struct VmRequest
+{
+    VmSnapshot vm;
+    VmState requestedState;
+    LONGLONG queued = 0;        // For tracing.
+};
 
-            vms.emplace_back(std::move(spObject), std::move(name));
-        }
-    }
+static void IssueRequest(void* request, void* context);
 
-    std::sort(vms.begin(), vms.end(), &VmEntry::less);
+static HWND s_hwndRequests = 0;
+static UINT s_msgRequests = 0;
+static RequestQueue s_requests(IssueRequest, nullptr);
 
-LOut:
-    return vms;
+static void CompleteStateChange(VmRequest* pRequest, HRESULT hr, ULONG returnValue, std::wstring&& job)
+{
+    if (hr == WBEM_E_NOT_FOUND || hr == WBEM_E_INVALID_OBJECT_PATH)
+        InvalidateShutdownComponent(pRequest->vm.id);
+
+    if (g_tracing)
+        RecordSpan("StateChange(queued to complete)", pRequest->queued);
+
+    VmRequestResult* pResult = new VmRequestResult;
+    pResult->host = std::move(pRequest->vm.host);
+    pResult->id = std::move(pRequest->vm.id);
+    pResult->name = std::move(pRequest->vm.name);
+    pResult->requestedState = pRequest->requestedState;
+    pResult->hr = hr;
+    pResult->returnValue = returnValue;
+    pResult->job = std::move(job);
+    delete pRequest;
+
+    if (!PostMessage(s_hwndRequests, s_msgRequests, 0, LPARAM(pResult)))
+        delete pResult;
+
+    s_requests.Finished();
 }
 
-void AppendStateString(std::wstring& inout, VmState state, bool brackets)
-{
-    static const struct { VmState state; LPCWSTR text; } c_states[] =
-    {
-        { VmState::Unknown,     L"Unknown" },
-        { VmState::Other,       L"Other" },
-        { VmState::Running,     L"Running" },
-        { VmState::Stopped,     L"Stopped" },
-        { VmState::ShutDown,    L"ShutDown" },
-        { VmState::Saved,       L"Saved" },
-        { VmState::Test,        L"Test" },
-        { VmState::Defer,       L"Defer" },
-        { VmState::Paused,      L"Paused" },
-        { VmState::Starting,    L"Starting" },
-        { VmState::Reset,       L"Reset" },
-        { VmState::_Starting,   L"Starting" },
-        { VmState::Saving,      L"Saving" },
-        { VmState::Stopping,    L"Stopping" },
-        { VmState::Pausing,     L"Pausing" },
-        { VmState::Resuming,    L"Resuming" },
-    };
+static void CALLBACK IssueStateChange(PTP_CALLBACK_INSTANCE /*instance*/, void* context)
+{
+    VmRequest* const pRequest = static_cast<VmRequest*>(context);
 
-    for (const auto& s : c_states)
+    const HRESULT hrInit = CoInitializeEx(0, COINIT_MULTITHREADED);
+
+    // The call is semisynchronous under a deadline, so a host that never
+    // answers can't hold the request's slot forever.
+    ULONG returnValue = 0;
+    std::wstring job;
+    WmiSession& session = GetSession(pRequest->vm.host);
+    const HRESULT hr = session.Call([&](IWbemServices* pServices) -> HRESULT
     {
-        if (s.state == state)
-        {
-            if (!inout.empty())
-                inout.append(brackets ? L"  [" : L" ");
-            else if (brackets)
-                inout.append(L"[");
-            inout.append(s.text);
-            if (brackets)
-                inout.append(L"]");
-            return;
-        }
+        HRESULT hr;
+
+        const WmiDeadline deadline(session, c_methodTimeout);
+
+        std::wstring path;
+        LPCWSTR method;
+        SPI<IWbemClassObject> spInParams;
+        hr = PrepareStateChange(pServices, deadline, pRequest->vm, pRequest->requestedState, path, method, &spInParams);
+        if (FAILED(hr))
+            return hr;
+
+        SPI<IWbemClassObject> spOutParams;
+        hr = ExecMethod(pServices, deadline, path.c_str(), method, spInParams, &spOutParams);
+        if (FAILED(hr))
+            return hr;
+
+        if (spOutParams)
+        {
+            GetIntegerProp(spOutParams, L"ReturnValue", returnValue);
+            GetStringProp(spOutParams, L"Job", job);
+        }
+        return S_OK;
+    });
+
+    CompleteStateChange(pRequest, hr, returnValue, std::move(job));
+
+    if (SUCCEEDED(hrInit))
+        CoUninitialize();
+}
+
+static void IssueRequest(void* request, void* /*context*/)
+{
+    VmRequest* const pRequest = static_cast<VmRequest*>(request);
+    if (!TrySubmitThreadpoolCallback(IssueStateChange, pRequest, nullptr))
+        CompleteStateChange(pRequest, HRESULT_FROM_WIN32(GetLastError()), 0, std::wstring());
+}
+
+void InitStateChanges(HWND hwnd, UINT msg, ULONG limit)
+{
+    s_hwndRequests = hwnd;
+    s_msgRequests = msg;
+    s_requests.SetLimit(limit);
+}
+
+void QueueStateChange(const VmSnapshot& vm, VmState requestedState)
+{
+    VmRequest* const pRequest = new VmRequest;
+    pRequest->vm = vm;
+    pRequest->requestedState = requestedState;
+    if (g_tracing)
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        pRequest->queued = now.QuadPart;
+    }
+
+    s_requests.Push(pRequest);
+}
+
+// The Msvm_ComputerSystem properties in a VmSnapshot, besides __PATH.  Only
+// properties that can be read by handle are listed, so reading them costs no
+// allocations; __PATH is a system property, which only Get can read.
+enum { c_vmId, c_vmName, c_vmState, c_vmHealth, c_vmPropCount };
+static constexpr PropDef c_vmProps[] =
+{
+    { L"Name",          PropType::String,   true },
+    { L"ElementName",   PropType::String,   true },
+    { L"EnabledState",  PropType::Integer,  true },
+    { L"HealthState",   PropType::Integer,  false },
+};
+static_assert(_countof(c_vmProps) == c_vmPropCount, "c_vmProps doesn't match its indices");
+
+// Fills vm, which may still hold a VM from the last refresh (see Refill), so
+// every field is assigned.  __PATH only depends on the host and the VM's key,
+// so it's kept when vm already holds the same VM; only a VM that's new to
+// this snapshot costs a Get.
+static bool ReadSnapshot(PropertyReader& reader, IWbemClassObject* pObject, const std::wstring& host, VmSnapshot& vm)
+{
+    TraceSpan span("Get(snapshot)");
+
+    if (!reader.Read(pObject))
+        return false;
+
+    size_t idLength;
+    LPCWSTR id = reader.GetString(c_vmId, &idLength);
+    if (vm.path.empty() || vm.host != host || vm.id.length() != idLength || wmemcmp(vm.id.c_str(), id, idLength))
+    {
+        if (!GetStringProp(pObject, L"__PATH", vm.path))
+            return false;
+        vm.host = host;
+        vm.id.assign(id, idLength);
     }
 
-    if (ULONG(state))
+    reader.GetString(c_vmName, vm.name);
+    vm.state = VmState(reader.GetInteger(c_vmState));
+    vm.health = reader.Has(c_vmHealth) ? ULONG(reader.GetInteger(c_vmHealth)) : 0;
+    vm.stats = VmStats();
+    vm.stale = false;
+    return true;
+}
+
+// Enumerate the available virtual machines.  Only the properties in
+// c_vmProps are requested; the keys (CreationClassName and Name) are included
+// so that WMI still fills in __PATH.
+static const WCHAR c_vmQuery[] = L"SELECT CreationClassName, Name, ElementName, EnabledState, HealthState FROM Msvm_ComputerSystem WHERE Caption=\"Virtual Machine\"";
+
+// Reads the VMs into vms, reusing the snapshots already in it (see Refill),
+// so that reading the same VMs again allocates nothing.  If callback is
+// given, each VM is instead passed to it as soon as it's read, and vms only
+// holds the one being read.
+static HRESULT EnumerateVirtualMachines(const std::wstring& host, const std::wstring& query, VirtualMachines& vms, VmCallback callback=nullptr, void* context=nullptr)
+{
+    ULONG delivered = 0;
+    WmiSession& session = GetSession(host);
+    return session.Call([&](IWbemServices* pServices) -> HRESULT
     {
-        WCHAR unknown[64];
-        swprintf_s(unknown, L"  [%d]", state);
-        inout.append(unknown);
+        HRESULT hr;
+
+        const WmiDeadline deadline(session, c_callTimeout);
+
+        SPI<IEnumWbemClassObject> spEnum;
+        const long flags = WBEM_FLAG_FORWARD_ONLY|WBEM_FLAG_RETURN_IMMEDIATELY;
+        {
+            TraceSpan span("ExecQuery(Msvm_ComputerSystem)");
+            hr = pServices->ExecQuery(BSTR(L"WQL"), BSTR(query.c_str()), flags, 0, &spEnum);
+        }
+        if (FAILED(hr))
+            return hr;
+
+        // Fetch objects in batches to avoid a round trip per VM.
+
+        constexpr ULONG c_batch = 32;
+        IWbemClassObject* objects[c_batch];
+        PropertyReader reader(c_vmProps);
+        Refill<VmSnapshot> refill(vms);
+
+        while (true)
+        {
+            ULONG uReturned = 0;
+            {
+                TraceSpan span("Next(Msvm_ComputerSystem)");
+                hr = NextObjects(spEnum, deadline, c_batch, objects, &uReturned);
+            }
+            if (FAILED(hr))
+            {
+                // Don't let the session retry if results were already
+                // delivered; the caller would see duplicates.
+                return (delivered && WmiSession::IsDisconnected(hr)) ? E_ABORT : hr;
+            }
+
+            for (ULONG i = 0; i < uReturned; ++i)
+            {
+                SPI<IWbemClassObject> spObject;
+                spObject = objects[i];
+
+                VmSnapshot& vm = refill.Next();
+                if (!ReadSnapshot(reader, spObject, host, vm))
+                {
+                    refill.Unfill();
+                    continue;
+                }
+
+                ++delivered;
+                if (callback)
+                {
+                    callback(std::move(vm), context);
+                    refill.Unfill();
+                }
+            }
+
+            // WBEM_S_FALSE means fewer than c_batch were left, i.e. done.
+            if (hr == WBEM_S_FALSE)
+                break;
+        }
+
+        return S_OK;
+    });
+}
+
+HRESULT EnumerateVirtualMachines(VmCallback callback, void* context, LPCWSTR id)
+{
+    std::wstring query(c_vmQuery);
+    if (id)
+    {
+        query.append(L" AND Name=\"");
+        query.append(id);
+        query.append(L"\"");
+    }
+
+    VirtualMachines scratch;
+    return EnumerateVirtualMachines(std::wstring(), query, scratch, callback, context);
+}
+
+// Summary information for every VM on a host comes from one
+// GetSummaryInformation call instead of a query per VM.
+
+constexpr ULONGLONG c_statsTtl = 5000;
+
+// The Msvm_SummaryInformation properties copied into VmStats.
+enum { c_summaryId, c_summaryProcessorLoad, c_summaryMemoryUsage, c_summaryUpTime, c_summaryHeartbeat, c_summaryPropCount };
+static constexpr PropDef c_summaryProps[] =
+{
+    { L"Name",          PropType::String,   true },
+    { L"ProcessorLoad", PropType::Integer,  false },
+    { L"MemoryUsage",   PropType::Integer,  false },
+    { L"UpTime",        PropType::Integer,  false },
+    { L"Heartbeat",     PropType::Integer,  false },
+};
+static_assert(_countof(c_summaryProps) == c_summaryPropCount, "c_summaryProps doesn't match its indices");
+
+static HRESULT GetSummaryInformation(HostState& state, FlatMap<std::wstring, VmStats>& out)
+{
+    // https://learn.microsoft.com/en-us/windows/win32/hyperv_v2/getsummaryinformation-msvm-virtualsystemmanagementservice
+    static const LONG c_requested[] =
+    {
+        0,                      // Name.
+        101,                    // ProcessorLoad.
+        103,                    // MemoryUsage.
+        104,                    // Heartbeat.
+        105,                    // UpTime.
+    };
+
+    return state.session.Call([&](IWbemServices* pServices) -> HRESULT
+    {
+        HRESULT hr;
+
+        const WmiDeadline deadline(state.session, c_callTimeout);
+
+        if (state.managementService.empty())
+        {
+            hr = GetServicePath(pServices, deadline, L"Msvm_VirtualSystemManagementService", state.managementService);
+            if (FAILED(hr))
+                return hr;
+        }
+        const std::wstring& path = state.managementService;
+
+        SPI<IWbemClassObject> spInParams;
+        hr = GetMethodParams(pServices, deadline, L"Msvm_VirtualSystemManagementService", L"GetSummaryInformation", &spInParams);
+        if (FAILED(hr))
+            return hr;
+
+        // Omitting SettingData requests every VM.
+        VARIANT vt;
+        VariantInit(&vt);
+        vt.vt = VT_ARRAY|VT_I4;
+        vt.parray = SafeArrayCreateVector(VT_I4, 0, _countof(c_requested));
+        if (!vt.parray)
+            return E_OUTOFMEMORY;
+        for (LONG i = 0; i < LONG(_countof(c_requested)); ++i)
+            SafeArrayPutElement(vt.parray, &i, const_cast<LONG*>(&c_requested[i]));
+        hr = spInParams->Put(L"RequestedInformation", 0, &vt, 0);
+        VariantClear(&vt);
+        if (FAILED(hr))
+            return hr;
+
+        SPI<IWbemClassObject> spOutParams;
+        hr = ExecMethod(pServices, deadline, path.c_str(), L"GetSummaryInformation", spInParams, &spOutParams);
+        if (FAILED(hr))
+            return hr;
+
+        ULONG returnValue;
+        if (!GetIntegerProp(spOutParams, L"ReturnValue", returnValue) || returnValue != 0)
+            return WBEM_E_FAILED;
+
+        hr = spOutParams->Get(L"SummaryInformation", 0, &vt, 0, 0);
+        if (FAILED(hr))
+            return hr;
+
+        if (V_VT(&vt) == (VT_ARRAY|VT_UNKNOWN))
+        {
+            IUnknown** items;
+            if (SUCCEEDED(SafeArrayAccessData(vt.parray, reinterpret_cast<void**>(&items))))
+            {
+                PropertyReader reader(c_summaryProps);
+                std::wstring id;
+                const ULONG count = vt.parray->rgsabound[0].cElements;
+                for (ULONG i = 0; i < count; ++i)
+                {
+                    SPQI<IWbemClassObject> spSummary;
+                    if (!items[i] || !spSummary.FQuery(items[i]))
+                        continue;
+
+                    if (!reader.Read(spSummary))
+                        continue;
+
+                    reader.GetString(c_summaryId, id);
+                    VmStats& stats = out[id];
+                    stats.valid = true;
+                    stats.processorLoad = ULONG(reader.GetInteger(c_summaryProcessorLoad));
+                    stats.memoryUsage = reader.GetInteger(c_summaryMemoryUsage);
+                    stats.uptime = reader.GetInteger(c_summaryUpTime);
+                    stats.heartbeat = ULONG(reader.GetInteger(c_summaryHeartbeat));
+                }
+                SafeArrayUnaccessData(vt.parray);
+            }
+        }
+
+        VariantClear(&vt);
+        return S_OK;
+    });
+}
+
+static void AttachStats(HostState& state, VirtualMachines& vms)
+{
+    const ULONGLONG now = GetTickCount64();
+    if (!state.statsTime || now - state.statsTime >= c_statsTtl)
+    {
+        TraceSpan span("GetSummaryInformation");
+
+        // On failure, keep showing the previous values until the next try.
+        FlatMap<std::wstring, VmStats> stats;
+        if (SUCCEEDED(GetSummaryInformation(state, stats)))
+            state.stats = std::move(stats);
+        state.statsTime = now;
+    }
+
+    for (auto& vm : vms)
+    {
+        if (const VmStats* stats = state.stats.Find(vm.id))
+            vm.stats = *stats;
+    }
+}
+
+static HWND s_hwndRefresh = 0;
+static UINT s_msgRefresh = 0;
+static SRWLOCK s_cacheLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE s_cacheChanged = CONDITION_VARIABLE_INIT;
+static VmListPtr s_cache;
+static ULONGLONG s_cacheTime = 0;
+
+void InitRefresher(HWND hwnd, UINT msg)
+{
+    s_hwndRefresh = hwnd;
+    s_msgRefresh = msg;
+}
+
+// Rebuilds the merged list of all hosts.  Must be called with s_cacheLock
+// held exclusively, so that an older merge can never replace a newer one.
+static VmListPtr MergeHosts(bool fresh)
+{
+    VirtualMachines merged;
+
+    size_t count = 0;
+    for (const auto& host : s_hosts)
+        count += host->vms.size();
+    merged.reserve(count);
+    for (const auto& host : s_hosts)
+        merged.insert(merged.end(), host->vms.begin(), host->vms.end());
+    std::sort(merged.begin(), merged.end(), &VmSnapshot::less);
+
+    s_cache = std::make_shared<const VirtualMachines>(std::move(merged));
+    s_cacheTime = fresh ? GetTickCount64() : 0;
+    return s_cache;
+}
+
+// Replaces one host's VMs, and publishes the merged list of all hosts.  On
+// success the host's previous list is swapped into vms, for the next refresh
+// to refill.
+static void PublishHost(HostState& state, VirtualMachines& vms, HRESULT hr)
+{
+    AcquireSRWLockExclusive(&s_cacheLock);
+    if (SUCCEEDED(hr))
+    {
+        state.vms.swap(vms);
+    }
+    else
+    {
+        // Keep showing what the host had, as stale, until it answers again.
+        for (auto& vm : state.vms)
+            vm.stale = true;
+    }
+    state.hr = hr;
+    state.reported = true;
+    const VmListPtr merged = MergeHosts(true);
+    ReleaseSRWLockExclusive(&s_cacheLock);
+
+    PruneShutdownComponents(*merged);
+    WakeAllConditionVariable(&s_cacheChanged);
+}
+
+static void CALLBACK RefreshCallback(PTP_CALLBACK_INSTANCE /*instance*/, void* context)
+{
+    HostState* const pState = static_cast<HostState*>(context);
+    const HRESULT hrInit = CoInitializeEx(0, COINIT_MULTITHREADED);
+
+    // If another refresh was requested while this one was running, the
+    // result may already be stale, so go again.
+    do
+    {
+        VirtualMachines& vms = pState->spare;
+        HRESULT hr;
+        {
+            TraceSpan span("GetVirtualMachines");
+            hr = EnumerateVirtualMachines(pState->host, c_vmQuery, vms);
+        }
+        if (SUCCEEDED(hr))
+            AttachStats(*pState, vms);
+        PublishHost(*pState, vms, hr);
+    }
+    while (pState->refresh.Finish());
+
+    if (s_hwndRefresh)
+        PostMessage(s_hwndRefresh, s_msgRefresh, 0, 0);
+
+    if (SUCCEEDED(hrInit))
+        CoUninitialize();
+}
+
+bool RequestRefresh()
+{
+    bool started = false;
+    for (const auto& state : s_hosts)
+    {
+        if (!state->refresh.Request())
+            continue;
+
+        if (!TrySubmitThreadpoolCallback(RefreshCallback, state.get(), nullptr))
+        {
+            state->refresh.Abandon();
+            continue;
+        }
+
+        started = true;
+    }
+    return started;
+}
+
+struct VmQuery
+{
+    HWND hwnd;
+    UINT msg;
+    const HostState* pState;
+    std::vector<std::wstring> ids;
+};
+
+static void CALLBACK QueryCallback(PTP_CALLBACK_INSTANCE /*instance*/, void* context)
+{
+    VmQuery* const pQuery = static_cast<VmQuery*>(context);
+    const HRESULT hrInit = CoInitializeEx(0, COINIT_MULTITHREADED);
+
+    std::wstring query(c_vmQuery);
+    for (size_t i = 0; i < pQuery->ids.size(); ++i)
+    {
+        query.append(i ? L" OR Name=\"" : L" AND (Name=\"");
+        query.append(pQuery->ids[i]);
+        query.append(L"\"");
+    }
+    query.append(L")");
+
+    VirtualMachines* const pVms = new VirtualMachines;
+    {
+        TraceSpan span("QueryVirtualMachines");
+        EnumerateVirtualMachines(pQuery->pState->host, query, *pVms);
+    }
+
+    if (!PostMessage(pQuery->hwnd, pQuery->msg, 0, LPARAM(pVms)))
+        delete pVms;
+    delete pQuery;
+
+    if (SUCCEEDED(hrInit))
+        CoUninitialize();
+}
+
+bool QueryVirtualMachines(HWND hwnd, UINT msg, const std::vector<std::wstring>& ids)
+{
+    if (ids.empty())
+        return false;
+
+    // The VMs could be on any host, so ask each one.
+    bool started = false;
+    for (const auto& state : s_hosts)
+    {
+        VmQuery* const pQuery = new VmQuery;
+        pQuery->hwnd = hwnd;
+        pQuery->msg = msg;
+        pQuery->pState = state.get();
+        pQuery->ids = ids;
+
+        if (!TrySubmitThreadpoolCallback(QueryCallback, pQuery, nullptr))
+        {
+            delete pQuery;
+            continue;
+        }
+        started = true;
+    }
+    return started;
+}
+
+VmListPtr GetCachedVirtualMachines(ULONGLONG* pAge)
+{
+    AcquireSRWLockShared(&s_cacheLock);
+    VmListPtr vms = s_cache;
+    const ULONGLONG time = s_cacheTime;
+    ReleaseSRWLockShared(&s_cacheLock);
+
+    if (pAge)
+        *pAge = vms ? GetTickCount64() - time : ULONGLONG(-1);
+    return vms;
+}
+
+VmListPtr WaitForVirtualMachines(DWORD timeout)
+{
+    TraceSpan span("WaitForVirtualMachines");
+
+    RequestRefresh();
+
+    const ULONGLONG deadline = GetTickCount64() + timeout;
+
+    AcquireSRWLockExclusive(&s_cacheLock);
+    while (true)
+    {
+        bool all = true;
+        for (const auto& state : s_hosts)
+            all = all && state->reported;
+
+        const ULONGLONG now = GetTickCount64();
+        if (all || now >= deadline)
+            break;
+
+        SleepConditionVariableSRW(&s_cacheChanged, &s_cacheLock, DWORD(deadline - now), 0);
+    }
+    VmListPtr vms = s_cache;
+    ReleaseSRWLockExclusive(&s_cacheLock);
+
+    if (!vms)
+        vms = std::make_shared<const VirtualMachines>();
+    return vms;
+}
+
+void CancelWmiCalls()
+{
+    for (const auto& state : s_hosts)
+        state->session.Cancel();
+}
+
+std::vector<HostStatus> GetHostStatus()
+{
+    std::vector<HostStatus> status;
+    status.reserve(s_hosts.size());
+
+    AcquireSRWLockShared(&s_cacheLock);
+    for (const auto& state : s_hosts)
+    {
+        HostStatus host;
+        host.host = state->host;
+        host.hr = state->hr;
+        host.reported = state->reported;
+        host.responding = state->session.IsResponding();
+        status.emplace_back(std::move(host));
+    }
+    ReleaseSRWLockShared(&s_cacheLock);
+
+    return status;
+}
+
+static bool GetLastKnownPath(std::wstring& out, bool create)
+{
+    WCHAR dir[1024];
+    const DWORD dw = GetEnvironmentVariableW(L"LOCALAPPDATA", dir, _countof(dir));
+    if (!dw || dw >= _countof(dir))
+        return false;
+
+    out = dir;
+    out.append(L"\\HyperVTray");
+    if (create && !CreateDirectoryW(out.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+        return false;
+
+    out.append(L"\\vms.cache");
+    return true;
+}
+
+bool LoadLastKnownVirtualMachines()
+{
+    TraceSpan span("LoadLastKnownVirtualMachines");
+
+    std::wstring path;
+    if (!GetLastKnownPath(path, false))
+        return false;
+
+    SFileHandle hFile(CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0));
+    if (hFile.IsEmpty())
+        return false;
+
+    // Anything bigger is not a file this wrote.
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size) || !size.QuadPart || size.QuadPart > 16 * 1024 * 1024)
+        return false;
+
+    SHandle hMapping(CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr));
+    if (!hMapping)
+        return false;
+
+    const void* const view = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+        return false;
+
+    std::vector<CachedVm> cached;
+    const bool ok = ReadVmCache(static_cast<const unsigned char*>(view), size_t(size.QuadPart), cached);
+    UnmapViewOfFile(view);
+    if (!ok)
+        return false;
+
+    // Only for hosts that are still configured, and haven't reported yet.
+    bool any = false;
+    AcquireSRWLockExclusive(&s_cacheLock);
+    for (const auto& state : s_hosts)
+    {
+        if (state->reported)
+            continue;
+
+        for (const auto& entry : cached)
+        {
+            if (entry.host != state->host)
+                continue;
+
+            // Copied, not moved:  a moved-from entry would have an empty
+            // host, and match the local host on a later iteration.
+            VmSnapshot vm;
+            vm.host = entry.host;
+            vm.id = entry.id;
+            vm.name = entry.name;
+            vm.state = entry.state;
+            vm.stale = true;
+            state->vms.emplace_back(std::move(vm));
+            any = true;
+        }
+    }
+    if (any)
+        MergeHosts(false/*fresh*/);
+    ReleaseSRWLockExclusive(&s_cacheLock);
+
+    return any;
+}
+
+// Saving runs on a pool thread, since it serializes the whole list to
+// compare it and may write the file.  Saves requested while one is running
+// are coalesced into one more save, of the latest list.
+
+static SRWLOCK s_saveLock = SRWLOCK_INIT;
+static VmListPtr s_pendingSave;
+static bool s_saving = false;
+
+// Only ever runs on one thread at a time.
+static void WriteLastKnownVirtualMachines(const VirtualMachines& vms)
+{
+    std::vector<CachedVm> cached;
+    cached.reserve(vms.size());
+    for (const auto& vm : vms)
+    {
+        CachedVm entry;
+        entry.host = vm.host;
+        entry.id = vm.id;
+        entry.name = vm.name;
+        entry.state = vm.state;
+        cached.emplace_back(std::move(entry));
+    }
+
+    // Stats change all the time, but they aren't saved, so only rewrite the
+    // file when something that is saved has changed.
+    static std::vector<unsigned char> s_lastSaved;
+    std::vector<unsigned char> unstamped;
+    WriteVmCache(cached, 0, unstamped);
+    if (unstamped == s_lastSaved)
+        return;
+
+    TraceSpan span("SaveLastKnownVirtualMachines");
+
+    ULARGE_INTEGER now;
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    now.LowPart = ft.dwLowDateTime;
+    now.HighPart = ft.dwHighDateTime;
+    std::vector<unsigned char> data;
+    WriteVmCache(cached, now.QuadPart, data);
+
+    // Write a temporary file and then replace, so a crash midway can't leave
+    // a truncated file (which the checksum would reject anyway).
+    std::wstring path;
+    if (!GetLastKnownPath(path, true))
+        return;
+    const std::wstring temp = path + L".tmp";
+
+    {
+        SFileHandle hFile(CreateFileW(temp.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0));
+        if (hFile.IsEmpty())
+            return;
+
+        DWORD written;
+        if (!WriteFile(hFile, data.data(), DWORD(data.size()), &written, nullptr) || written != data.size())
+        {
+            hFile.Close();
+            DeleteFileW(temp.c_str());
+            return;
+        }
+    }
+
+    if (!MoveFileExW(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFileW(temp.c_str());
+        return;
+    }
+
+    s_lastSaved = std::move(unstamped);
+}
+
+static void CALLBACK SaveCallback(PTP_CALLBACK_INSTANCE /*instance*/, void* /*context*/)
+{
+    while (true)
+    {
+        AcquireSRWLockExclusive(&s_saveLock);
+        const VmListPtr vms = std::move(s_pendingSave);
+        s_saving = !!vms;
+        ReleaseSRWLockExclusive(&s_saveLock);
+
+        if (!vms)
+            break;
+        WriteLastKnownVirtualMachines(*vms);
+    }
+}
+
+void SaveLastKnownVirtualMachines()
+{
+    // Only a complete list is worth saving.
+    VmListPtr vms;
+    AcquireSRWLockShared(&s_cacheLock);
+    bool complete = true;
+    for (const auto& state : s_hosts)
+        complete = complete && state->reported && SUCCEEDED(state->hr);
+    if (complete)
+        vms = s_cache;
+    ReleaseSRWLockShared(&s_cacheLock);
+    if (!vms)
+        return;
+
+    AcquireSRWLockExclusive(&s_saveLock);
+    s_pendingSave = std::move(vms);
+    const bool start = !s_saving;
+    s_saving = true;
+    ReleaseSRWLockExclusive(&s_saveLock);
+
+    if (start && !TrySubmitThreadpoolCallback(SaveCallback, nullptr, nullptr))
+    {
+        AcquireSRWLockExclusive(&s_saveLock);
+        s_pendingSave.reset();
+        s_saving = false;
+        ReleaseSRWLockExclusive(&s_saveLock);
+    }
+}
+
+class VmEventSink : public SubscriptionSink
+{
+public:
+    VmEventSink(HWND hwnd, UINT msg) : m_hwnd(hwnd), m_msg(msg) {}
+
+    // IWbemObjectSink.  These are called on a WMI thread, so they only
+    // extract plain data and post it to the UI thread.
+    STDMETHODIMP Indicate(long lObjectCount, IWbemClassObject** apObjArray) override
+    {
+        for (long i = 0; i < lObjectCount; ++i)
+        {
+            VARIANT vt;
+            VariantInit(&vt);
+            if (SUCCEEDED(apObjArray[i]->Get(L"TargetInstance", 0, &vt, 0, 0)) && V_VT(&vt) == VT_UNKNOWN && V_UNKNOWN(&vt))
+            {
+                // Indications can arrive on several WMI threads at once, so
+                // each call uses its own reader.
+                SPQI<IWbemClassObject> spTarget;
+                PropertyReader reader(c_vmProps);
+                if (spTarget.FQuery(V_UNKNOWN(&vt)) && reader.Read(spTarget))
+                {
+                    VmStateEvent* pEvent = new VmStateEvent;
+                    reader.GetString(c_vmId, pEvent->id);
+                    reader.GetString(c_vmName, pEvent->name);
+                    pEvent->state = VmState(reader.GetInteger(c_vmState));
+                    if (!PostMessage(m_hwnd, m_msg, 0, LPARAM(pEvent)))
+                        delete pEvent;
+                }
+            }
+            VariantClear(&vt);
+        }
+        return WBEM_S_NO_ERROR;
+    }
+    STDMETHODIMP SetStatus(long lFlags, HRESULT hResult, BSTR /*strParam*/, IWbemClassObject* /*pObjParam*/) override
+    {
+        // The subscription only completes if it was cancelled or failed.
+        if (lFlags == WBEM_STATUS_COMPLETE)
+        {
+            SetEnded();
+            if (hResult != WBEM_E_CALL_CANCELLED)
+                PostMessage(m_hwnd, m_msg, WPARAM(FAILED(hResult) ? hResult : E_ABORT), 0);
+        }
+        return WBEM_S_NO_ERROR;
+    }
+
+private:
+    const HWND m_hwnd;
+    const UINT m_msg;
+};
+
+static void CancelSubscription(IWbemServices* pServices, IWbemObjectSink* pSink)
+{
+    if (pServices && pSink)
+        pServices->CancelAsyncCall(pSink);
+}
+
+static bool IsSubscribed(const HostState& state)
+{
+    return state.spEventSink && !state.spEventSink->IsEnded();
+}
+
+// A host whose subscription is still delivering events keeps it.
+static HRESULT SubscribeHost(HostState& state, HWND hwnd, UINT msg)
+{
+    AcquireSRWLockShared(&state.eventLock);
+    const bool closed = state.eventsClosed;
+    const bool subscribed = IsSubscribed(state);
+    ReleaseSRWLockShared(&state.eventLock);
+    if (closed)
+        return E_ABORT;
+    if (subscribed)
+        return S_OK;
+
+    SPI<SubscriptionSink> spSink;
+    spSink = new VmEventSink(hwnd, msg);
+
+    SPI<IWbemServices> spServices;
+    HRESULT hr = state.session.Call([&](IWbemServices* pServices) -> HRESULT
+    {
+        // Only state changes are interesting; WMI filters out the rest.
+        TraceSpan span("ExecNotificationQueryAsync");
+        const HRESULT hr = pServices->ExecNotificationQueryAsync(BSTR(L"WQL"),
+            BSTR(L"SELECT * FROM __InstanceModificationEvent WITHIN 1 "
+                 L"WHERE TargetInstance ISA 'Msvm_ComputerSystem' "
+                 L"AND TargetInstance.EnabledState <> PreviousInstance.EnabledState"),
+            0, 0, spSink);
+        if (SUCCEEDED(hr))
+            spServices.Set(pServices);
+        return hr;
+    });
+    if (FAILED(hr))
+        return hr;
+
+    // Another thread may have subscribed the host in the meantime, or the
+    // window may be going away; then it's the new subscription that's
+    // cancelled.
+    SPI<IWbemServices> spOldServices;
+    SPI<SubscriptionSink> spOldSink;
+    AcquireSRWLockExclusive(&state.eventLock);
+    if (state.eventsClosed || IsSubscribed(state))
+    {
+        hr = state.eventsClosed ? E_ABORT : S_OK;
+        spOldServices = std::move(spServices);
+        spOldSink = std::move(spSink);
+    }
+    else
+    {
+        spOldServices = std::move(state.spEventServices);
+        spOldSink = std::move(state.spEventSink);
+        state.spEventServices = std::move(spServices);
+        state.spEventSink = std::move(spSink);
+    }
+    ReleaseSRWLockExclusive(&state.eventLock);
+
+    CancelSubscription(spOldServices, spOldSink);
+    return hr;
+}
+
+// Hosts that can't deliver events are covered by polling, so a failure here
+// doesn't undo the other hosts' subscriptions.
+HRESULT SubscribeStateChanges(HWND hwnd, UINT msg)
+{
+    HRESULT hrFirst = S_OK;
+    for (const auto& state : s_hosts)
+    {
+        const HRESULT hr = SubscribeHost(*state, hwnd, msg);
+        if (FAILED(hr) && SUCCEEDED(hrFirst))
+            hrFirst = hr;
+    }
+    return hrFirst;
+}
+
+void UnsubscribeStateChanges()
+{
+    for (const auto& state : s_hosts)
+    {
+        SPI<IWbemServices> spServices;
+        SPI<SubscriptionSink> spSink;
+        AcquireSRWLockExclusive(&state->eventLock);
+        state->eventsClosed = true;
+        spServices = std::move(state->spEventServices);
+        spSink = std::move(state->spEventSink);
+        ReleaseSRWLockExclusive(&state->eventLock);
+
+        CancelSubscription(spServices, spSink);
+    }
+}
+
+void AppendStatsString(std::wstring& inout, const VmStats& stats)
+{
+    if (!stats.valid)
         return;
+
+    WCHAR text[128];
+    swprintf_s(text, L"  %u%% CPU, %llu MB", stats.processorLoad, stats.memoryUsage);
+    inout.append(text);
+
+    // Minutes are enough, and keep the text from changing on every refresh.
+    const ULONGLONG minutes = stats.uptime / 60000;
+    if (minutes >= 24 * 60)
+        swprintf_s(text, L", up %llud %lluh", minutes / (24 * 60), (minutes / 60) % 24);
+    else if (minutes >= 60)
+        swprintf_s(text, L", up %lluh %llum", minutes / 60, minutes % 60);
+    else
+        swprintf_s(text, L", up %llum", minutes);
+    inout.append(text);
+
+    // https://learn.microsoft.com/en-us/windows/win32/hyperv_v2/msvm-summaryinformation
+    switch (stats.heartbeat)
+    {
+    case 0:
+    case 2:     break;  // Not reported, or OK.
+    case 12:    inout.append(L", no heartbeat"); break;
+    case 13:    inout.append(L", heartbeat lost"); break;
+    default:    inout.append(L", heartbeat error"); break;
     }
 }
 
@@ -4,48 +4,266 @@
 #pragma once
 
 #include "main.h"
+#include "vmstate.h"
+#include "session.h"
 #include <wbemidl.h>
 #include <vector>
+#include <memory>
 
-enum class VmState
-{
-    // https://learn.microsoft.com/en-us/windows/win32/hyperv_v2/msvm-computersystem
-    Unknown     = 0,
-    Other       = 1,        // Corresponds to CIM_EnabledLogicalElement.EnabledState = Other.
-    Running     = 2,        // Enabled.
-    Stopped     = 3,        // Disabled.
-    ShutDown    = 4,        // Valid in version 1 (V1) of Hyper-V only. The virtual machine is shutting down via the shutdown service. Corresponds to CIM_EnabledLogicalElement.EnabledState = ShuttingDown.
-    Saved       = 6,        // Corresponds to CIM_EnabledLogicalElement.EnabledState = Enabled but offline.
-    Test        = 7,
-    Defer       = 8,
-    Paused      = 9,        // Corresponds to CIM_EnabledLogicalElement.EnabledState = Quiesce, Enabled but paused.
-    Starting    = 10,
-    Reset       = 11,
-    _Starting   = 32770,
-    Saving      = 32773,
-    Stopping    = 32774,
-    Pausing     = 32776,
-    Resuming    = 32777,
+// Long-lived connection to a WMI namespace.  The IWbemServices proxy is
+// created on first use and then shared by everything that talks to WMI; the
+// reconnecting, retrying, and circuit breaking are done by Session (see
+// session.h), with WmiSession as its backend.
+//
+// While the circuit breaker is open, Call() fails immediately with
+// HRESULT_FROM_WIN32(ERROR_TIMEOUT) instead of waiting on a service that
+// isn't responding.
+class WmiSession : private SessionBackend
+{
+public:
+                    WmiSession(LPCWSTR ns);
+                    ~WmiSession() = default;
+
+    HRESULT         GetServices(IWbemServices** ppServices);
+    void            Disconnect(IWbemServices* pServices=nullptr) { m_session.Disconnect(pServices); }
+
+    // Runs func(IWbemServices*) -> HRESULT, reconnecting and retrying once
+    // if the connection was lost.
+    template<class F>
+    HRESULT         Call(F&& func)
+    {
+        return m_session.Call([&](const Session::Connection& connection) {
+            return func(static_cast<IWbemServices*>(connection.get()));
+        });
+    }
+
+    // Makes waits in calls already in flight give up (see WmiDeadline).
+    void            Cancel() { InterlockedIncrement(&m_generation); }
+    LONG            GetGeneration() const { return m_generation; }
+
+    bool            IsResponding() { return m_session.IsResponding(); }
+
+    static bool     IsDisconnected(HRESULT hr);
+    static bool     IsNotResponding(HRESULT hr);
+
+private:
+    // SessionBackend.
+    SessionResult   Connect(Connection& out) override;
+    bool            LostConnection(SessionResult result) const override { return IsDisconnected(result); }
+    bool            TripsBreaker(SessionResult result) const override;
+    SessionResult   Refused() const override { return HRESULT_FROM_WIN32(ERROR_TIMEOUT); }
+    unsigned long long Now() const override { return GetTickCount64(); }
+
+private:
+    const std::wstring m_namespace;
+    volatile LONG   m_generation = 0;
+    Session         m_session;
+
+    WmiSession(const WmiSession&) = delete;
+    WmiSession& operator=(const WmiSession&) = delete;
 };
 
-void LaunchManager(HWND hwnd);
-void VmConnect(IWbemClassObject* pObject);
-void ChangeVmState(IWbemClassObject* pObject, VmState requestedState);
+// Deadline for the waits within one WMI call.  Calls are semisynchronous and
+// wait in short slices, so that WmiSession::Cancel() takes effect promptly.
+class WmiDeadline
+{
+public:
+                    WmiDeadline(const WmiSession& session, ULONGLONG timeout);
 
-struct VmEntry
+    long            Slice() const;      // How long the next wait may be.
+    bool            Expired() const;
+    HRESULT         Status() const;     // Timed out or cancelled.
+
+private:
+    const WmiSession& m_session;
+    const ULONGLONG m_due;
+    const LONG      m_generation;
+};
+
+// Semisynchronous helpers that give up with WmiDeadline::Status().
+// NextObjects() returns WBEM_S_FALSE at the end, like Next(), and may return
+// WBEM_S_TIMEDOUT with some objects.
+HRESULT NextObjects(IEnumWbemClassObject* pEnum, const WmiDeadline& deadline, ULONG count, IWbemClassObject** objects, ULONG* pReturned);
+HRESULT WaitForCallResult(IWbemCallResult* pCallResult, const WmiDeadline& deadline);
+
+// Method helpers.  GetServicePath() finds the one instance of a service class
+// (e.g. Msvm_VirtualSystemManagementService).  GetMethodParams() spawns the
+// input parameters for a method, from a cache of their definitions.
+// ExecMethod() runs a method semisynchronously and returns its output
+// parameters.
+HRESULT GetServicePath(IWbemServices* pServices, const WmiDeadline& deadline, LPCWSTR className, std::wstring& out);
+HRESULT GetMethodParams(IWbemServices* pServices, const WmiDeadline& deadline, LPCWSTR className, LPCWSTR methodName, IWbemClassObject** ppInParams);
+HRESULT ExecMethod(IWbemServices* pServices, const WmiDeadline& deadline, LPCWSTR objectPath, LPCWSTR methodName, IWbemClassObject* pInParams, IWbemClassObject** ppOutParams);
+
+// Base for IWbemObjectSink implementations.  Indicate() and SetStatus() are
+// called on WMI threads; they must not block.
+class ObjectSink : public IWbemObjectSink
 {
-    VmEntry(IWbemClassObject* pObject, LPCWSTR name) : vm(pObject), name(name) {}
-    VmEntry(SPI<IWbemClassObject>&& spObject, std::wstring&& name) : vm(std::move(spObject)), name(std::move(name)) {}
+public:
+    STDMETHODIMP QueryInterface(REFIID riid, void** ppv) override
+    {
+        if (riid == IID_IUnknown || riid == IID_IWbemObjectSink)
+        {
+            *ppv = static_cast<IWbemObjectSink*>(this);
+            AddRef();
+            return S_OK;
+        }
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+    STDMETHODIMP_(ULONG) AddRef() override { return InterlockedIncrement(&m_refs); }
+    STDMETHODIMP_(ULONG) Release() override
+    {
+        const ULONG refs = InterlockedDecrement(&m_refs);
+        if (!refs)
+            delete this;
+        return refs;
+    }
 
-    bool operator()(const VmEntry& a, const VmEntry& b) const { return _wcsicmp(a.name.c_str(), b.name.c_str()) < 0; }
-    static bool less(const VmEntry& a, const VmEntry& b) { return _wcsicmp(a.name.c_str(), b.name.c_str()) < 0; }
+protected:
+    virtual ~ObjectSink() = default;
 
-    SPI<IWbemClassObject> vm;
+private:
+    ULONG m_refs = 1;
+};
+
+// InitCom() initializes the calling thread for the MTA and sets process-wide
+// COM security.  InitComSecurity() is only the latter; it must be called
+// right after CoInitializeEx, before anything in the process uses COM, or it
+// fails with RPC_E_TOO_LATE.
+HRESULT InitCom();
+HRESULT InitComSecurity();
+
+// Hosts.  Each host has its own session to \\host\ROOT\Virtualization\V2;
+// the empty name is the local machine.  SetHosts() must be called before any
+// background work starts; without it, only the local machine is used.
+void SetHosts(const std::vector<std::wstring>& hosts);
+size_t GetHostCount();
+WmiSession& GetSession(const std::wstring& host=std::wstring());
+
+// Result of the latest refresh of each host, in SetHosts() order.
+struct HostStatus
+{
+    std::wstring host;
+    HRESULT hr = S_OK;
+    bool reported = false;      // A refresh has finished at least once.
+    bool responding = true;     // The host's circuit breaker is closed.
+};
+std::vector<HostStatus> GetHostStatus();
+
+// Makes every WMI call in flight give up as soon as it can, e.g. on exit.
+void CancelWmiCalls();
+
+// Resource usage from Msvm_SummaryInformation.  These are only meaningful
+// while the VM is running.
+struct VmStats
+{
+    bool valid = false;
+    ULONG processorLoad = 0;    // Percent.
+    ULONGLONG memoryUsage = 0;  // Assigned memory, in MB.
+    ULONGLONG uptime = 0;       // Milliseconds.
+    ULONG heartbeat = 0;        // OperationalStatus of the heartbeat integration service.
+};
+
+// Plain data copied out of an Msvm_ComputerSystem instance, so the UI never
+// needs to hold WMI proxies or call IWbemClassObject::Get.
+struct VmSnapshot
+{
+    static bool less(const VmSnapshot& a, const VmSnapshot& b)
+    {
+        const int cmp = _wcsicmp(a.host.c_str(), b.host.c_str());
+        return cmp ? cmp < 0 : _wcsicmp(a.name.c_str(), b.name.c_str()) < 0;
+    }
+
+    std::wstring host;          // Empty for the local machine.
+    std::wstring id;            // Name (a GUID).
+    std::wstring name;          // ElementName.
+    std::wstring path;          // __PATH, used as the target for methods.
+    VmState state = VmState::Unknown;
+    ULONG health = 0;           // HealthState.
+    VmStats stats;              // Filled in by the background refresh.
+    bool stale = false;         // From the last-known list; not confirmed by WMI yet.
+};
+typedef std::vector<VmSnapshot> VirtualMachines;
+
+// Streams VMs on the local machine to the callback as each batch arrives from
+// WMI, in no particular order.  If id is given, only that VM (by Name GUID) is
+// returned.
+typedef void (*VmCallback)(VmSnapshot&& vm, void* context);
+HRESULT EnumerateVirtualMachines(VmCallback callback, void* context, LPCWSTR id=nullptr);
+
+// Fetches only the given VMs, with one query per host, and posts
+// (msg, 0, VirtualMachines*) to the window as each host answers; the receiver
+// must delete the list.
+bool QueryVirtualMachines(HWND hwnd, UINT msg, const std::vector<std::wstring>& ids);
+
+// Background refresh of the VM list.  RequestRefresh() enumerates each host
+// on its own pool thread (unless a refresh of that host is already in flight)
+// and posts (msg, 0, 0) to the window each time the cached list has been
+// replaced.  Hosts are independent, so one slow host never delays the others;
+// each enumeration also has a deadline.  If a host's refresh fails, its
+// previous VMs stay in the list, marked stale.  The refresh also fills in
+// VmSnapshot::stats, from a single GetSummaryInformation call per host whose
+// result is reused for a few seconds.
+typedef std::shared_ptr<const VirtualMachines> VmListPtr;
+void InitRefresher(HWND hwnd, UINT msg);
+bool RequestRefresh();
+VmListPtr GetCachedVirtualMachines(ULONGLONG* pAge=nullptr);
+
+// Last-known VM list, in %LOCALAPPDATA%\HyperVTray\vms.cache, so the first
+// menu after a reboot can show right away while VMMS is still starting.
+// LoadLastKnownVirtualMachines() memory maps the file and seeds the cached
+// list with its VMs, marked stale, for each host that hasn't reported yet.
+// SaveLastKnownVirtualMachines() rewrites the file from the cached list once
+// every host has reported successfully, if the VMs or their states changed.
+// The comparison and the write happen on a pool thread.
+bool LoadLastKnownVirtualMachines();
+void SaveLastKnownVirtualMachines();
+
+// Requests a refresh and waits until every host has reported at least once,
+// or until the timeout.  Never returns null, but the list may be partial.
+VmListPtr WaitForVirtualMachines(DWORD timeout);
+
+void LaunchManager(HWND hwnd);
+void VmConnect(const VmSnapshot& vm);
+// Synchronous state change.  If Hyper-V started a job to finish it, job
+// receives the job's path (see GetJobStatus()); otherwise it's cleared.
+HRESULT ChangeVmState(const VmSnapshot& vm, VmState requestedState, std::wstring* job=nullptr);
+
+// Asynchronous state changes.  Queued requests are issued concurrently (up to
+// the limit) and each completion is posted to the window as
+// (msg, 0, VmRequestResult*); the receiver must delete the result.
+struct VmRequestResult
+{
+    std::wstring host;
+    std::wstring id;
+    std::wstring name;
+    VmState requestedState = VmState::Unknown;
+    HRESULT hr = S_OK;
+    ULONG returnValue = 0;      // ReturnValue from the method.
+    std::wstring job;           // Msvm_ConcreteJob path, when returnValue is 4096.
+};
+void InitStateChanges(HWND hwnd, UINT msg, ULONG limit);
+void QueueStateChange(const VmSnapshot& vm, VmState requestedState);
+
+// State change notifications pushed by WMI, from every host.  Each change is
+// posted to the window as (msg, 0, VmStateEvent*); the receiver must delete
+// the event.  If a host's subscription ends unexpectedly, (msg, hr, nullptr)
+// is posted instead.
+//
+// SubscribeStateChanges() subscribes each host that isn't already, and
+// returns the first failure; the hosts that did subscribe stay subscribed,
+// so calling it again only retries the rest.  It may run on several threads
+// at once.  After UnsubscribeStateChanges(), nothing subscribes again.
+struct VmStateEvent
+{
+    std::wstring id;
     std::wstring name;
+    VmState state = VmState::Unknown;
 };
-typedef std::vector<VmEntry> VirtualMachines;
-VirtualMachines GetVirtualMachines();
+HRESULT SubscribeStateChanges(HWND hwnd, UINT msg);
+void UnsubscribeStateChanges();
 
-void AppendStateString(std::wstring& inout, VmState state, bool brackets);
+void AppendStatsString(std::wstring& inout, const VmStats& stats);
 bool GetStringProp(IWbemClassObject* pObject, LPCWSTR propName, std::wstring& out);
 bool GetIntegerProp(IWbemClassObject* pObject, LPCWSTR propName, ULONG& out);
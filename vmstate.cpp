@@ -0,0 +1,26 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#include "vmstate.h"
+
+void AppendStateString(std::wstring& inout, VmState state, bool brackets)
+{
+    if (const VmStateInfo* info = FindStateInfo(state))
+    {
+        if (!inout.empty())
+            inout.append(brackets ? L"  [" : L" ");
+        else if (brackets)
+            inout.append(L"[");
+        inout.append(info->text);
+        if (brackets)
+            inout.append(L"]");
+        return;
+    }
+
+    if (unsigned(state))
+    {
+        inout.append(L"  [");
+        inout.append(std::to_wstring(unsigned(state)));
+        inout.append(L"]");
+    }
+}
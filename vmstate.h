@@ -0,0 +1,227 @@
+// Copyright (c) 2024 Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+enum class VmState
+{
+    // https://learn.microsoft.com/en-us/windows/win32/hyperv_v2/msvm-computersystem
+    Unknown     = 0,
+    Other       = 1,        // Corresponds to CIM_EnabledLogicalElement.EnabledState = Other.
+    Running     = 2,        // Enabled.
+    Stopped     = 3,        // Disabled.
+    ShutDown    = 4,        // Valid in version 1 (V1) of Hyper-V only. The virtual machine is shutting down via the shutdown service. Corresponds to CIM_EnabledLogicalElement.EnabledState = ShuttingDown.
+    Saved       = 6,        // Corresponds to CIM_EnabledLogicalElement.EnabledState = Enabled but offline.
+    Test        = 7,
+    Defer       = 8,
+    Paused      = 9,        // Corresponds to CIM_EnabledLogicalElement.EnabledState = Quiesce, Enabled but paused.
+    Starting    = 10,
+    Reset       = 11,
+    _Starting   = 32770,
+    Saving      = 32773,
+    Stopping    = 32774,
+    Pausing     = 32776,
+    Resuming    = 32777,
+};
+
+enum class VmOp { Connect, Start, Stop, ShutDown, Save, Pause, Select, Checkpoint, ApplyCheckpoint, Max };
+
+constexpr unsigned OpBit(VmOp op) { return 1u << unsigned(op); }
+
+// The state a request for an operation asks for.
+constexpr VmState GetOpTarget(VmOp op)
+{
+    return (op == VmOp::Start) ? VmState::Running :
+           (op == VmOp::Stop) ? VmState::Stopped :
+           (op == VmOp::ShutDown) ? VmState::ShutDown :
+           (op == VmOp::Save) ? VmState::Saved :
+           (op == VmOp::Pause) ? VmState::Paused :
+           VmState::Unknown;
+}
+
+//----------------------------------------------------------------------------
+// State transition table.
+//
+// Everything the UI knows about a state:  what to call it, whether it's
+// settled or on its way to another state, and which operations Hyper-V
+// accepts while the VM is in it.  Requesting anything else only costs a WMI
+// round trip that fails with "invalid state for this operation".
+
+enum class VmStateKind
+{
+    Indeterminate,      // Not known to be either; nothing is ruled out.
+    Stable,             // Stays put until something is requested.
+    Transitioning,      // On its way to settlesTo.
+};
+
+struct VmStateInfo
+{
+    VmState state;
+    const wchar_t* text;
+    VmStateKind kind;
+    VmState settlesTo;
+    unsigned ops;       // OpBit() for each VmOp that's valid in this state.
+};
+
+constexpr unsigned c_opsAlways = OpBit(VmOp::Connect) | OpBit(VmOp::Select);
+constexpr unsigned c_opsAll = c_opsAlways | OpBit(VmOp::Start) | OpBit(VmOp::Stop) |
+                              OpBit(VmOp::ShutDown) | OpBit(VmOp::Save) | OpBit(VmOp::Pause) |
+                              OpBit(VmOp::Checkpoint) | OpBit(VmOp::ApplyCheckpoint);
+// A checkpoint can be taken in any settled state, but only applied while the
+// VM isn't running.
+constexpr unsigned c_opsOff = c_opsAlways | OpBit(VmOp::Start) | OpBit(VmOp::Checkpoint) | OpBit(VmOp::ApplyCheckpoint);
+// Hyper-V rejects a state change while another is in progress, and Stop is a
+// guest shutdown (InitiateShutdown), which needs a guest that's running and
+// responding.  So nothing but Connect and Select is offered until the VM
+// settles.
+constexpr unsigned c_opsTransitioning = c_opsAlways;
+
+// Sorted by state, for FindStateInfo().
+constexpr VmStateInfo c_stateTable[] =
+{
+    { VmState::Unknown,     L"Unknown",     VmStateKind::Indeterminate, VmState::Unknown,   c_opsAll },
+    { VmState::Other,       L"Other",       VmStateKind::Indeterminate, VmState::Unknown,   c_opsAll },
+    { VmState::Running,     L"Running",     VmStateKind::Stable,        VmState::Running,   c_opsAll & ~(OpBit(VmOp::Start) | OpBit(VmOp::ApplyCheckpoint)) },
+    { VmState::Stopped,     L"Stopped",     VmStateKind::Stable,        VmState::Stopped,   c_opsOff },
+    { VmState::ShutDown,    L"ShutDown",    VmStateKind::Transitioning, VmState::Stopped,   c_opsTransitioning },
+    { VmState::Saved,       L"Saved",       VmStateKind::Stable,        VmState::Saved,     c_opsOff },
+    { VmState::Test,        L"Test",        VmStateKind::Indeterminate, VmState::Unknown,   c_opsAll },
+    { VmState::Defer,       L"Defer",       VmStateKind::Indeterminate, VmState::Unknown,   c_opsAll },
+    { VmState::Paused,      L"Paused",      VmStateKind::Stable,        VmState::Paused,    c_opsAlways | OpBit(VmOp::Start) | OpBit(VmOp::Save) | OpBit(VmOp::Checkpoint) },
+    { VmState::Starting,    L"Starting",    VmStateKind::Transitioning, VmState::Running,   c_opsTransitioning },
+    { VmState::Reset,       L"Reset",       VmStateKind::Transitioning, VmState::Running,   c_opsTransitioning },
+    { VmState::_Starting,   L"Starting",    VmStateKind::Transitioning, VmState::Running,   c_opsTransitioning },
+    { VmState::Saving,      L"Saving",      VmStateKind::Transitioning, VmState::Saved,     c_opsTransitioning },
+    { VmState::Stopping,    L"Stopping",    VmStateKind::Transitioning, VmState::Stopped,   c_opsTransitioning },
+    { VmState::Pausing,     L"Pausing",     VmStateKind::Transitioning, VmState::Paused,    c_opsTransitioning },
+    { VmState::Resuming,    L"Resuming",    VmStateKind::Transitioning, VmState::Running,   c_opsTransitioning },
+};
+
+// Returns nullptr for a state that isn't in the table.
+constexpr const VmStateInfo* FindStateInfo(VmState state)
+{
+    size_t lo = 0;
+    size_t hi = sizeof(c_stateTable) / sizeof(c_stateTable[0]);
+    while (lo < hi)
+    {
+        const size_t mid = (lo + hi) / 2;
+        if (unsigned(c_stateTable[mid].state) < unsigned(state))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < sizeof(c_stateTable) / sizeof(c_stateTable[0]) && c_stateTable[lo].state == state) ? &c_stateTable[lo] : nullptr;
+}
+
+// States outside the table are treated like Unknown.
+constexpr unsigned GetEnabledOps(VmState state)
+{
+    return FindStateInfo(state) ? FindStateInfo(state)->ops : c_opsAll;
+}
+
+constexpr bool IsStableState(VmState state)
+{
+    return FindStateInfo(state) && FindStateInfo(state)->kind == VmStateKind::Stable;
+}
+
+constexpr bool IsTransitioningState(VmState state)
+{
+    return FindStateInfo(state) && FindStateInfo(state)->kind == VmStateKind::Transitioning;
+}
+
+// The state a VM ends up in once the current transition finishes, or Unknown.
+constexpr VmState GetSettledState(VmState state)
+{
+    return FindStateInfo(state) ? FindStateInfo(state)->settlesTo : VmState::Unknown;
+}
+
+// Consistency checks, run over every row of the table at compile time.
+namespace VmStateChecks
+{
+    constexpr size_t c_count = sizeof(c_stateTable) / sizeof(c_stateTable[0]);
+
+    constexpr bool IsSorted()
+    {
+        for (size_t i = 1; i < c_count; ++i)
+            if (!(unsigned(c_stateTable[i - 1].state) < unsigned(c_stateTable[i].state)))
+                return false;
+        return true;
+    }
+
+    constexpr bool AllFound()
+    {
+        for (size_t i = 0; i < c_count; ++i)
+            if (FindStateInfo(c_stateTable[i].state) != &c_stateTable[i])
+                return false;
+        return true;
+    }
+
+    constexpr bool AllNamed()
+    {
+        for (size_t i = 0; i < c_count; ++i)
+            if (!c_stateTable[i].text || !c_stateTable[i].text[0])
+                return false;
+        return true;
+    }
+
+    // Stable states settle to themselves, transitions settle to a stable
+    // state, and indeterminate states don't claim to settle anywhere.
+    constexpr bool SettlesConsistently()
+    {
+        for (size_t i = 0; i < c_count; ++i)
+        {
+            const VmStateInfo& info = c_stateTable[i];
+            switch (info.kind)
+            {
+            case VmStateKind::Stable:
+                if (info.settlesTo != info.state)
+                    return false;
+                break;
+            case VmStateKind::Transitioning:
+                if (!IsStableState(info.settlesTo))
+                    return false;
+                break;
+            default:
+                if (info.settlesTo != VmState::Unknown)
+                    return false;
+                break;
+            }
+        }
+        return true;
+    }
+
+    // Connect and Select work in any state, nothing outside c_opsAll is
+    // enabled, and a stable state doesn't enable an op that leads back to
+    // itself.
+    constexpr bool OpsConsistent()
+    {
+        for (size_t i = 0; i < c_count; ++i)
+        {
+            const VmStateInfo& info = c_stateTable[i];
+            if ((info.ops & c_opsAlways) != c_opsAlways || (info.ops & ~c_opsAll))
+                return false;
+            for (unsigned op = 0; op < unsigned(VmOp::Max); ++op)
+            {
+                if (info.kind == VmStateKind::Stable &&
+                    (info.ops & OpBit(VmOp(op))) &&
+                    GetSettledState(GetOpTarget(VmOp(op))) == info.state)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    static_assert(c_count == 16, "Every VmState needs a row in c_stateTable");
+    static_assert(IsSorted(), "c_stateTable must be sorted by state, with no duplicates");
+    static_assert(AllFound(), "FindStateInfo() can't find every row");
+    static_assert(AllNamed(), "Every state needs display text");
+    static_assert(SettlesConsistently(), "A state settles somewhere inconsistent");
+    static_assert(OpsConsistent(), "A state enables an op it shouldn't");
+    static_assert(FindStateInfo(VmState(5)) == nullptr && GetEnabledOps(VmState(5)) == c_opsAll, "Unlisted states allow everything");
+}
+
+// Appends the state's display text, after a space (or in brackets).
+void AppendStateString(std::wstring& inout, VmState state, bool brackets);